@@ -1,126 +1,326 @@
+// POSIX and BSD calls such as strdup, fdatasync and madvise are hidden under -std=c11
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
-#define ORDER 4 
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+/* B+ tree fanout: each node holds at most ORDER - 1 keys. Override with -DORDER=<n>. */
+#ifndef ORDER
+#define ORDER 128
+#endif
+#if ORDER < 4
+#error "ORDER must be at least 4"
+#endif
+#define CACHE_LINE_SIZE 64
+/* Tree keys are 64-bit so secondary indexes can pack a value and a transaction ID */
+typedef long long BPKey;
+/* Occupancy floors that splits guarantee; deletes rebalance below these */
+#define MIN_LEAF_KEYS ((ORDER - 1) / 2)
+#define MIN_INTERNAL_KEYS ((ORDER - 2) / 2)
+/* Fanout of at least 4 keeps any reachable tree far below this depth */
+#define BPTREE_MAX_HEIGHT 64
+/* Key slots rounded up so the keys array always spans whole cache lines */
+#define KEYS_PER_CACHE_LINE (CACHE_LINE_SIZE / (int)sizeof(BPKey))
+#define NODE_KEY_SLOTS ((ORDER - 1 + KEYS_PER_CACHE_LINE - 1) / KEYS_PER_CACHE_LINE * KEYS_PER_CACHE_LINE)
 #define TRANSACTION_FILE "transactions.txt"
 #define SELLER_PRICES_FILE "sellers_prices.txt"
+#define WAL_FILE "energy.wal"
+#define SHARD_SEGMENT_FILE WAL_FILE ".shard%d"  // log segment of one ingest shard
+#define MAX_SHARDS 64
+#define SNAPSHOT_FILE "energy.snapshot"
 #define MAX_DATE_LENGTH 11  
+/* Share of each node the bulk loader fills; the slack absorbs later inserts without splitting */
+#ifndef BULK_LOAD_FILL_FACTOR
+#define BULK_LOAD_FILL_FACTOR 0.9
+#endif
 
 /* ============== TABLE FORMATTING CODE ============== */
+#define OUTPUT_BUFFER_BYTES (64 * 1024)
+
+/* Output collected in memory. With a stream set, a full buffer is flushed to it;
+   without one (batch answers held until their sync), the buffer grows instead. */
+typedef struct {
+    char* data;
+    size_t used;
+    size_t capacity;
+    FILE* stream;
+} OutputBuffer;
+
+void initOutputBuffer(OutputBuffer* out, FILE* stream) {
+    out->data = (char*)malloc(OUTPUT_BUFFER_BYTES);
+    if (!out->data) {
+        printf("Memory allocation failed for output buffer.\n");
+        exit(1);
+    }
+    out->used = 0;
+    out->capacity = OUTPUT_BUFFER_BYTES;
+    out->stream = stream;
+}
+
+void flushOutputBuffer(OutputBuffer* out) {
+    if (out->stream && out->used) fwrite(out->data, 1, out->used, out->stream);
+    out->used = 0;
+}
+
+void freeOutputBuffer(OutputBuffer* out) {
+    flushOutputBuffer(out);
+    free(out->data);
+    out->data = NULL;
+}
+
+void outputWrite(OutputBuffer* out, const void* data, size_t length) {
+    if (out->used + length > out->capacity) {
+        if (out->stream) {
+            flushOutputBuffer(out);
+            if (length > out->capacity) {
+                fwrite(data, 1, length, out->stream);
+                return;
+            }
+        } else {
+            while (out->used + length > out->capacity) out->capacity *= 2;
+            out->data = (char*)realloc(out->data, out->capacity);
+            if (!out->data) {
+                printf("Memory allocation failed for output buffer.\n");
+                exit(1);
+            }
+        }
+    }
+    memcpy(out->data + out->used, data, length);
+    out->used += length;
+}
+
+void outputPrintf(OutputBuffer* out, const char* format, ...) {
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0) return;
+    if ((size_t)length < sizeof(line)) {
+        outputWrite(out, line, (size_t)length);
+        return;
+    }
+    char* longLine = (char*)malloc((size_t)length + 1);
+    if (!longLine) {
+        printf("Memory allocation failed for output buffer.\n");
+        exit(1);
+    }
+    va_start(args, format);
+    vsnprintf(longLine, (size_t)length + 1, format, args);
+    va_end(args);
+    outputWrite(out, longLine, (size_t)length);
+    free(longLine);
+}
+
 #define MAX_TABLE_COLS 10
-#define MAX_TABLE_ROWS 1000
 #define MAX_COL_WIDTH 30
+/* Rows held back to size the columns before anything is printed */
+#define TABLE_SAMPLE_ROWS 1000
+#define TABLE_SAMPLE_BYTES (128 * 1024)
 
+/* Rows are rendered as they are added. The first TABLE_SAMPLE_ROWS rows are held back
+   to size the columns; later rows go straight into the output buffer, so memory use
+   does not depend on the number of rows. When a result outgrows the sample, each
+   column is also widened to the widest value it can hold, if that is known. */
 typedef struct {
-    char* columns[MAX_TABLE_COLS];
+    const char* columns[MAX_TABLE_COLS];
     int col_widths[MAX_TABLE_COLS];
+    int max_widths[MAX_TABLE_COLS];  // widest possible value, see add_table_column
     int num_cols;
-    char* rows[MAX_TABLE_ROWS][MAX_TABLE_COLS];
     int num_rows;
+    int streaming;  // header printed, widths fixed
+    char* sample;   // held-back cells, each NUL-terminated
+    size_t sample_used;
+    OutputBuffer output;  // flushed to stdout
 } Table;
 
 void init_table(Table* table) {
-    table->num_cols = 0;
-    table->num_rows = 0;
-    for (int i = 0; i < MAX_TABLE_COLS; i++) {
-        table->col_widths[i] = 0;
-        table->columns[i] = NULL;
+    memset(table, 0, sizeof(*table));
+    table->sample = (char*)malloc(TABLE_SAMPLE_BYTES);
+    if (!table->sample) {
+        printf("Memory allocation failed for table.\n");
+        exit(1);
     }
+    initOutputBuffer(&table->output, stdout);
 }
 
 void free_table(Table* table) {
-    for (int i = 0; i < table->num_cols; i++) {
-        if (table->columns[i]) free(table->columns[i]);
-    }
-    for (int i = 0; i < table->num_rows; i++) {
-        for (int j = 0; j < table->num_cols; j++) {
-            if (table->rows[i][j]) free(table->rows[i][j]);
-        }
-    }
+    free(table->sample);
+    table->sample = NULL;
+    freeOutputBuffer(&table->output);
 }
 
-void add_table_column(Table* table, const char* col_name) {
+/* max_width is the widest value the column can hold (11 for an int, MAX_COL_WIDTH for a
+   formatted double). Pass 0 only for tables too short to outgrow the sample. */
+void add_table_column(Table* table, const char* col_name, int max_width) {
     if (table->num_cols >= MAX_TABLE_COLS) return;
-    table->columns[table->num_cols] = strdup(col_name);
+    table->columns[table->num_cols] = col_name;
     table->col_widths[table->num_cols] = strlen(col_name);
+    table->max_widths[table->num_cols] = max_width > MAX_COL_WIDTH ? MAX_COL_WIDTH : max_width;
     table->num_cols++;
 }
 
-void add_table_row(Table* table, ...) {
-    if (table->num_rows >= MAX_TABLE_ROWS) return;
-    
-    va_list args;
-    va_start(args, table);
-    
+void write_table_output(Table* table, const char* data, size_t length) {
+    outputWrite(&table->output, data, length);
+}
+
+void print_horizontal_border(Table* table) {
+    char line[MAX_TABLE_COLS * (MAX_COL_WIDTH + 3) + 2];
+    size_t length = 0;
+    line[length++] = '+';
     for (int i = 0; i < table->num_cols; i++) {
-        char* val = va_arg(args, char*);
-        table->rows[table->num_rows][i] = strdup(val ? val : "");
-        int len = strlen(val);
-        if (len > table->col_widths[i]) {
-            table->col_widths[i] = len > MAX_COL_WIDTH ? MAX_COL_WIDTH : len;
-        }
+        memset(line + length, '-', table->col_widths[i] + 2);
+        length += table->col_widths[i] + 2;
+        line[length++] = '+';
     }
-    
-    va_end(args);
-    table->num_rows++;
+    line[length++] = '\n';
+    write_table_output(table, line, length);
 }
 
-void print_horizontal_border(Table* table) {
-    putchar('+');
+/* Renders one row at the table's current widths into out. Only reads the table, so
+   scan workers can render rows of a streaming table into their own buffers. */
+void render_table_row(const Table* table, OutputBuffer* out, const char* const* cells) {
+    static const char spaces[MAX_COL_WIDTH + 1] = "                              ";
+    outputWrite(out, "|", 1);
     for (int i = 0; i < table->num_cols; i++) {
-        for (int j = 0; j < table->col_widths[i] + 2; j++) {
-            putchar('-');
+        size_t length = strlen(cells[i]);
+        outputWrite(out, " ", 1);
+        outputWrite(out, cells[i], length);
+        for (int pad = table->col_widths[i] - (int)length; pad > 0; pad -= MAX_COL_WIDTH)
+            outputWrite(out, spaces, pad < MAX_COL_WIDTH ? pad : MAX_COL_WIDTH);
+        outputWrite(out, " |", 2);
+    }
+    outputWrite(out, "\n", 1);
+}
+
+void print_table_row(Table* table, const char* const* cells) {
+    render_table_row(table, &table->output, cells);
+}
+
+/* Fixes the column widths, then prints the header and the held-back rows. */
+void start_table_stream(Table* table, int outgrew_sample) {
+    if (outgrew_sample) {
+        for (int i = 0; i < table->num_cols; i++) {
+            if (table->max_widths[i] > table->col_widths[i]) table->col_widths[i] = table->max_widths[i];
+        }
+    }
+    print_horizontal_border(table);
+    print_table_row(table, table->columns);
+    print_horizontal_border(table);
+    const char* cells[MAX_TABLE_COLS];
+    const char* cursor = table->sample;
+    for (int row = 0; row < table->num_rows; row++) {
+        for (int i = 0; i < table->num_cols; i++) {
+            cells[i] = cursor;
+            cursor += strlen(cursor) + 1;
         }
-        putchar('+');
+        print_table_row(table, cells);
     }
-    putchar('\n');
+    table->streaming = 1;
 }
 
-void print_table(Table* table) {
-    if (table->num_cols == 0 || table->num_rows == 0) return;
-    
-    // Print header
-    print_horizontal_border(table);
-    printf("|");
+void add_table_row(Table* table, ...) {
+    const char* cells[MAX_TABLE_COLS];
+    size_t bytes = 0;
+    va_list args;
+    va_start(args, table);
     for (int i = 0; i < table->num_cols; i++) {
-        printf(" %-*s |", table->col_widths[i], table->columns[i]);
+        const char* val = va_arg(args, const char*);
+        cells[i] = val ? val : "";
+        bytes += strlen(cells[i]) + 1;
     }
-    printf("\n");
-    print_horizontal_border(table);
-    
-    // Print rows
-    for (int i = 0; i < table->num_rows; i++) {
-        printf("|");
-        for (int j = 0; j < table->num_cols; j++) {
-            printf(" %-*s |", table->col_widths[j], table->rows[i][j]);
+    va_end(args);
+
+    if (!table->streaming) {
+        if (table->num_rows < TABLE_SAMPLE_ROWS && table->sample_used + bytes <= TABLE_SAMPLE_BYTES) {
+            for (int i = 0; i < table->num_cols; i++) {
+                int len = strlen(cells[i]);
+                if (len > table->col_widths[i]) {
+                    table->col_widths[i] = len > MAX_COL_WIDTH ? MAX_COL_WIDTH : len;
+                }
+                memcpy(table->sample + table->sample_used, cells[i], len + 1);
+                table->sample_used += len + 1;
+            }
+            table->num_rows++;
+            return;
         }
-        printf("\n");
+        start_table_stream(table, 1);
     }
+    print_table_row(table, cells);
+    table->num_rows++;
+}
+
+/* Prints whatever is still held back plus the closing border; prints nothing for a
+   table without rows. Returns the number of rows. */
+int print_table(Table* table) {
+    if (table->num_cols == 0 || table->num_rows == 0) return 0;
+    if (!table->streaming) start_table_stream(table, 0);
     print_horizontal_border(table);
+    flushOutputBuffer(&table->output);
+    return table->num_rows;
 }
 
+/* Every field is read by the filters and reports, so the record stays one dense
+   48-byte block: the 8-byte fields first, then the IDs. */
 typedef struct Transaction {
-    int transactionID;
-    int buyerID;
-    int sellerID;
+    long long epoch;  // wall-clock seconds since 1970-01-01, see parseTimestamp
     double energyAmount;
     double pricePerKwh;
     double totalPrice;
-    char timestamp[30];
-    struct Transaction* next;
+    int transactionID;
+    int buyerID;
+    int sellerID;
 } Transaction;
 
+// A transaction's row in table output: seven cells, none wider than a formatted double
+#define TRANSACTION_CELLS 7
+#define TRANSACTION_CELL_BYTES 40
+
 typedef struct BPTreeNode {
+    // Keys come first so a descent touches only the cache lines it compares
+    _Alignas(CACHE_LINE_SIZE) BPKey keys[NODE_KEY_SLOTS];
     int isLeaf;  
     int numKeys;  
-    int keys[ORDER - 1];  
-    struct BPTreeNode* children[ORDER]; 
-    struct BPTreeNode* next;  
-    Transaction* records[ORDER - 1];  
+    uint64_t epoch;  // store epoch the node was last copied in, see VERSIONED STORE
+    uint64_t latch;  // version latch for concurrent writers, see CONCURRENT B+ TREE
+    // Internal nodes use children, leaves use records; never both
+    union {
+        struct BPTreeNode* children[ORDER]; 
+        Transaction* records[ORDER - 1];  
+    };
 } BPTreeNode;
 
+/* Root-to-leaf descent: nodes[0] is the root, nodes[depth - 1] the leaf, and
+   childIdx[i] is the slot of nodes[i] that leads to nodes[i + 1]. */
+typedef struct {
+    BPTreeNode* nodes[BPTREE_MAX_HEIGHT];
+    int childIdx[BPTREE_MAX_HEIGHT];
+    int depth;
+} BPTreePath;
+
+/* A position in key order. Leaves are not chained: a copy-on-write leaf could not be
+   relinked from a neighbour that a snapshot still shares. Stepping past the end of a
+   leaf climbs the path instead, to the next subtree. */
+typedef struct {
+    BPTreePath path;
+    int pos;  // slot in the leaf at path.nodes[path.depth - 1]
+} BPTreeCursor;
+
 typedef struct RegularBuyer {
     int buyerID;
     struct RegularBuyer* next;
@@ -134,7 +334,6 @@ typedef struct Seller {
     double totalRevenue;  
     RegularBuyer* regularBuyers;
     BPTreeNode* transactionTree; 
-    struct Seller* next;
 } Seller;
 
 typedef struct Buyer {
@@ -142,203 +341,1747 @@ typedef struct Buyer {
     double totalEnergyPurchased;
     int numTransactions;
     BPTreeNode* transactionTree; 
-    struct Buyer* next;
 } Buyer;
 
+/* Open-addressing map from an entity ID to its slot in a dense entity array */
+typedef struct {
+    int id;
+    int index;  // -1 marks an empty slot
+} EntitySlot;
+
+typedef struct {
+    EntitySlot* slots;
+    int capacity;  // power of two
+    int count;
+} EntityIndex;
+
 typedef struct {
     int sellerID;
     int buyerID;
     int transactionCount;
 } SellerBuyerPair;
 
+/* Live transaction count per (seller, buyer) pair, hashed into a dense pair array */
+typedef struct {
+    SellerBuyerPair* pairs;
+    unsigned char* regular;  // per pair: buyer is on the seller's regular-buyer list
+    int count;
+    int capacity;
+    int* slots;  // index into pairs, -1 marks an empty slot
+    int slotCapacity;  // power of two
+} PairCounter;
+
+/* Treap node for the buyer leaderboard. Node i belongs to buyers[i] and caches the
+   energy total it was placed under, so removal finds it even after the buyer changes. */
+typedef struct {
+    double energy;
+    unsigned int priority;
+    int left;   // buyer index, -1 for none
+    int right;
+    int size;   // nodes in this subtree
+} LeaderboardNode;
+
 typedef struct {
     Transaction** transactions;
     int count;
     int capacity;
 } TransactionArray;
 
+/* Outcome of applying one change; the menu and batch mode each report it their own way */
+typedef enum {
+    CHANGE_APPLIED,
+    CHANGE_DUPLICATE_ID,
+    CHANGE_NOT_FOUND,
+    CHANGE_UNKNOWN_SELLER,
+    CHANGE_LOG_FAILED  // the write-ahead log append failed, so nothing was changed
+} ChangeStatus;
+
+/* What findOrCreateSeller does with a seller ID it has not seen outside loading */
+typedef enum {
+    UNKNOWN_SELLER_PROMPT,  // ask for the rates on stdin
+    UNKNOWN_SELLER_REJECT,
+    UNKNOWN_SELLER_DEFAULT  // register the seller at the default rates
+} UnknownSellerPolicy;
+
 BPTreeNode* globalTransactionTree = NULL;
-Seller* seller_head = NULL;
-Buyer* buyer_head = NULL;
+/* Secondary index over the same transactions, keyed by timeIndexKey */
+BPTreeNode* timeIndexTree = NULL;
+/* Secondary index keyed by energyIndexKey, so energy-range results come out sorted */
+BPTreeNode* energyIndexTree = NULL;
+/* Sellers and buyers live in dense arrays in creation order; the indexes map IDs to
+   positions. Growing an array moves it, so entity pointers are only held briefly. */
+Seller* sellers = NULL;
+int sellerCount = 0;
+int sellerCapacity = 0;
+EntityIndex sellerIndex = {NULL, 0, 0};
+Buyer* buyers = NULL;
+int buyerCount = 0;
+int buyerCapacity = 0;
+EntityIndex buyerIndex = {NULL, 0, 0};
+PairCounter pairCounter = {NULL, NULL, 0, 0, NULL, 0};
+LeaderboardNode* leaderboardNodes = NULL;
+int leaderboardCapacity = 0;
+int leaderboardRoot = -1;
 int nextTransactionID = 1;
+/* With --shards the sellers, partial buyers and pair counts live in the shards
+   instead of the arrays above; see SHARDED STORE */
+int shardCount = 0;
 
-Transaction* createTransaction(int transactionID, int buyerID, int sellerID, double energyAmount, double pricePerKwh, char* timestamp);
+Transaction* createTransaction(int transactionID, int buyerID, int sellerID, double energyAmount, double pricePerKwh, long long epoch);
 BPTreeNode* createBPTreeNode(int isLeaf);
+Seller* findSeller(int sellerID);
+Buyer* findBuyer(int buyerID);
 Seller* findOrCreateSeller(int sellerID);
 Buyer* findOrCreateBuyer(int buyerID);
 void insertTransaction(Transaction* t);
+ChangeStatus applyInsert(Transaction* t);
+ChangeStatus applyDelete(int transactionID);
 void insertTransactionIntoBPTree(BPTreeNode** root, Transaction* t);
-void insertInternalNode(BPTreeNode** root, int key, BPTreeNode* rightChild, BPTreeNode* parent);
-void splitLeafNode(BPTreeNode** root, BPTreeNode* node, BPTreeNode* parent);
-void splitInternalNode(BPTreeNode** root, BPTreeNode* node, BPTreeNode* parent);
+void insertRecordIntoBPTree(BPTreeNode** root, BPKey key, Transaction* record);
+void insertIntoLeafOnPath(BPTreeNode** root, BPTreePath* path, BPKey key, Transaction* record);
+BPTreeNode* findLeafWithPath(BPTreeNode* root, BPKey key, BPTreePath* path);
+void insertInternalNode(BPTreeNode** root, BPKey key, BPTreeNode* rightChild, BPTreePath* path, int level);
+void splitLeafNode(BPTreeNode** root, BPTreePath* path, int level);
+void splitInternalNode(BPTreeNode** root, BPTreePath* path, int level);
 int findTransactionInBPTree(BPTreeNode* root, int transactionID);
 void displayTransactionsFromTree(BPTreeNode* leaf);
+void add_transaction_table_columns(Table* table);
+void add_transaction_table_row(Table* table, const Transaction* t);
+void format_transaction_cells(const Transaction* t, char cells[][TRANSACTION_CELL_BYTES], const char** row);
 void traverseAndFilterTransactions(BPTreeNode* node, int id, int isSeller, int* found);
 void freeTransactions();
 void loadDataFromFile();
+void loadTransactionFile(const char* path);
+void noteWalRecord();
+double currentTimeSeconds();
+BPTreeNode* bulkLoadBPTree(Transaction** sorted, int count, BPKey (*keyOf)(const Transaction*));
+BPKey transactionIdKey(const Transaction* t);
+BPKey transactionTimeKey(const Transaction* t);
+BPKey transactionEnergyKey(const Transaction* t);
+int removeKeyFromBPTree(BPTreeNode** root, BPKey key);
+BPTreeNode* seekBPTree(BPTreeNode* root, BPKey key, BPTreeCursor* cursor);
+BPTreeNode* nextLeafInBPTree(BPTreeCursor* cursor);
 void loadSellerPrices();
-void saveSellerPrices();
 void findTransactionsByTimeRange(char* startDate, char* endDate);
+void showRollupWindow(int isBuyer, int entityID, char* startDate, char* endDate);
 void calculateTotalRevenueBySellerID(int sellerID);
 void calculateTotalRevenueForAllSellers();
 void findTransactionsByEnergyRange(double minEnergy, double maxEnergy);
-int compareTransactionsByEnergy(const void* a, const void* b);
-int isDateInRange(const char* date, const char* startDate, const char* endDate);
+int parseTimestamp(const char* text, long long* epoch);
 int countTransactionsInTree(BPTreeNode *root);
-void sortBuyersByEnergyBought();
-void sortSellerBuyerPairsByTransactions();
-void addRegularBuyer(Seller* seller, Buyer* buyer);
+int getTreeHeight(BPTreeNode* root);
+int checkBPTree(BPTreeNode* root);
+void leaderboardInsert(int buyerIndex);
+void adjustBuyerEnergy(Buyer* buyer, double delta);
+void sortBuyersByEnergyBought(int offset, int limit);
+void showBuyerRank(int buyerID);
+void sortSellerBuyerPairsByTransactions(int topN);
+int adjustPairCount(PairCounter* counter, int sellerID, int buyerID, int delta);
+void addRegularBuyer(PairCounter* counter, Seller* seller, Buyer* buyer, int pairIndex);
 void deleteTransaction(int transactionID);
 void deleteTransactionFromBPTree(BPTreeNode** root, int transactionID);
 void borrowFromNext(BPTreeNode* node, int idx);
 void borrowFromPrev(BPTreeNode* node, int idx);
-void mergeNodes(BPTreeNode** root, BPTreeNode* node, int idx);
-BPTreeNode* findParent(BPTreeNode* root, BPTreeNode* child);
+BPTreeNode* mergeNodes(BPTreeNode* node, int idx);
 void removeFromLeaf(BPTreeNode* node, int idx);
-void removeFromNonLeaf(BPTreeNode** root, BPTreeNode* node, int idx);
-void deleteTransactionFile(int transactionID);
+int rebalancePath(BPTreeNode** root, BPTreePath* path, BPTreeNode** dropped);
 void insertTransactionIntoEntityTree(BPTreeNode** entityTree, Transaction* t);
+int retireShardSegments();
+Seller* findShardedSeller(int sellerID);
+Seller* addShardedSeller(int sellerID, double rateBelow300, double rateAbove300);
+void addShardedTrade(Seller* seller, Transaction* t);
+void removeShardedTrade(Transaction* t);
+int countShardedSellers();
+void releaseShards();
 
-Transaction* createTransaction(int transactionID, int buyerID, int sellerID, double energyAmount, double pricePerKwh, char* timestamp) {
-    Transaction* t = (Transaction*)malloc(sizeof(Transaction));
-    if (!t) {
-        printf("Memory allocation failed for transaction.\n");
+/* ============== OBJECT POOLS ============== */
+/* B+ tree nodes and transactions come from per-type slab pools instead of one
+   malloc each. Objects are carved sequentially out of large aligned slabs, released
+   objects go on a free list for reuse, and shutdown frees whole slabs at once.
+   Pools are not thread-safe; only the thread that owns the trees allocates, apart
+   from concurrent tree writers, which split nodes off private pools. */
+#define POOL_SLAB_BYTES (1 << 20)
+
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct PoolFreeObject {
+    struct PoolFreeObject* next;
+} PoolFreeObject;
+
+typedef struct {
+    const char* name;
+    size_t objectSize;
+    size_t alignment;
+    size_t slabHeaderSize;
+    int objectsPerSlab;
+    PoolSlab* slabs;
+    PoolFreeObject* freeList;
+    char* bumpNext;
+    char* bumpEnd;
+    long long allocations;
+    long long frees;
+    long long liveObjects;
+    long long peakLiveObjects;
+    long long slabCount;
+} ObjectPool;
+
+void initObjectPool(ObjectPool* pool, const char* name, size_t objectSize, size_t alignment) {
+    memset(pool, 0, sizeof(ObjectPool));
+    pool->name = name;
+    pool->alignment = alignment;
+    pool->objectSize = (objectSize + alignment - 1) / alignment * alignment;
+    pool->slabHeaderSize = (sizeof(PoolSlab) + alignment - 1) / alignment * alignment;
+    pool->objectsPerSlab = (int)((POOL_SLAB_BYTES - pool->slabHeaderSize) / pool->objectSize);
+    if (pool->objectsPerSlab < 1) pool->objectsPerSlab = 1;
+}
+
+void* poolAlloc(ObjectPool* pool) {
+    void* object;
+    if (pool->freeList) {
+        object = pool->freeList;
+        pool->freeList = pool->freeList->next;
+    } else {
+        if (pool->bumpNext == pool->bumpEnd) {
+            size_t slabBytes = pool->slabHeaderSize + pool->objectSize * pool->objectsPerSlab;
+            PoolSlab* slab = (PoolSlab*)aligned_alloc(pool->alignment, slabBytes);
+            if (!slab) {
+                printf("Memory allocation failed for %s pool.\n", pool->name);
+                exit(1);
+            }
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            pool->slabCount++;
+            pool->bumpNext = (char*)slab + pool->slabHeaderSize;
+            pool->bumpEnd = pool->bumpNext + pool->objectSize * pool->objectsPerSlab;
+        }
+        object = pool->bumpNext;
+        pool->bumpNext += pool->objectSize;
+    }
+    pool->allocations++;
+    pool->liveObjects++;
+    if (pool->liveObjects > pool->peakLiveObjects) pool->peakLiveObjects = pool->liveObjects;
+    return object;
+}
+
+void poolFree(ObjectPool* pool, void* object) {
+    if (!object) return;
+    PoolFreeObject* freed = (PoolFreeObject*)object;
+    freed->next = pool->freeList;
+    pool->freeList = freed;
+    pool->frees++;
+    pool->liveObjects--;
+}
+
+/* Releases every slab at once; all objects from the pool become invalid. */
+void destroyObjectPool(ObjectPool* pool) {
+    PoolSlab* slab = pool->slabs;
+    while (slab) {
+        PoolSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    initObjectPool(pool, pool->name, pool->objectSize, pool->alignment);
+}
+
+/* Moves every slab of from into pool; objects keep their addresses and can be freed
+   to pool later. The uncarved tail of from's last slab goes on pool's free list. */
+void mergeObjectPool(ObjectPool* pool, ObjectPool* from) {
+    for (; from->bumpNext != from->bumpEnd; from->bumpNext += from->objectSize) {
+        PoolFreeObject* object = (PoolFreeObject*)from->bumpNext;
+        object->next = pool->freeList;
+        pool->freeList = object;
+    }
+    while (from->freeList) {
+        PoolFreeObject* object = from->freeList;
+        from->freeList = object->next;
+        object->next = pool->freeList;
+        pool->freeList = object;
+    }
+    while (from->slabs) {
+        PoolSlab* slab = from->slabs;
+        from->slabs = slab->next;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+    }
+    pool->slabCount += from->slabCount;
+    pool->allocations += from->allocations;
+    pool->frees += from->frees;
+    pool->liveObjects += from->liveObjects;
+    if (pool->liveObjects > pool->peakLiveObjects) pool->peakLiveObjects = pool->liveObjects;
+    initObjectPool(from, from->name, from->objectSize, from->alignment);
+}
+
+void printPoolStatistics(ObjectPool* pool) {
+    size_t slabBytes = pool->slabHeaderSize + pool->objectSize * pool->objectsPerSlab;
+    long long reserved = pool->slabCount * (long long)slabBytes;
+    long long inUse = pool->liveObjects * (long long)pool->objectSize;
+    long long carved = pool->slabCount * (long long)pool->objectsPerSlab - (pool->bumpEnd - pool->bumpNext) / (long long)pool->objectSize;
+    printf("%s pool: %lld live (peak %lld), %lld allocs, %lld frees, %lld on free list\n",
+           pool->name, pool->liveObjects, pool->peakLiveObjects, pool->allocations, pool->frees,
+           carved - pool->liveObjects);
+    printf("  %lld slabs, %lld bytes reserved, %lld bytes in use, %.1f%% unused\n",
+           pool->slabCount, reserved, inUse, reserved > 0 ? 100.0 * (reserved - inUse) / reserved : 0.0);
+}
+
+ObjectPool nodePool;
+ObjectPool transactionPool;
+/* Concurrent tree writers and shard writers take and return nodes through their own
+   pools, merged in once they are joined */
+_Thread_local ObjectPool* threadNodePool = NULL;
+
+void initObjectPools() {
+    initObjectPool(&nodePool, "B+ tree node", sizeof(BPTreeNode), CACHE_LINE_SIZE);
+    initObjectPool(&transactionPool, "Transaction", sizeof(Transaction), _Alignof(Transaction));
+}
+
+void releaseTransaction(Transaction* t) {
+    poolFree(&transactionPool, t);
+}
+
+void releaseBPTreeNode(BPTreeNode* node) {
+    poolFree(threadNodePool ? threadNodePool : &nodePool, node);
+}
+
+// Frees a tree's nodes only, never its records, which other trees may still point at
+void releaseBPTree(BPTreeNode* node) {
+    if (!node) return;
+    if (!node->isLeaf)
+        for (int i = 0; i <= node->numKeys; i++) releaseBPTree(node->children[i]);
+    releaseBPTreeNode(node);
+}
+
+/* ============== VERSIONED STORE ============== */
+/* Reports on other threads read pinned snapshots while the owning thread keeps
+   changing the trees. Each node records the store epoch it was written in. Pinning a
+   snapshot closes the current epoch: from then on a node written in that epoch or
+   earlier is copied before it changes, and the copy is linked in along the root-to-
+   leaf path, so the snapshot's roots still reach exactly the nodes they reached when
+   it was pinned. Replaced nodes and deleted transactions are retired instead of
+   freed, and go back to their pools once every snapshot pinned before they were
+   retired is gone (epoch-based reclamation). With nothing pinned, changes are made in
+   place as before.
+   Only the owning thread changes the trees, pins, unpins and reclaims, so the pools
+   stay single-threaded; readers only follow pointers from their snapshot. */
+typedef struct {
+    long long transactions;
+    double revenue;
+    double energy;
+} StoreTotals;
+
+typedef struct {
+    uint64_t epoch;
+    BPTreeNode* transactions;  // ID-keyed, like globalTransactionTree
+    BPTreeNode* byTime;
+    BPTreeNode* byEnergy;
+    StoreTotals totals;
+} StoreSnapshot;
+
+typedef struct {
+    void* object;
+    uint64_t epoch;  // retired while this epoch was being written
+    int isNode;      // otherwise a Transaction
+} RetiredObject;
+
+uint64_t storeEpoch = 1;   // epoch being written
+uint64_t pinnedEpoch = 0;  // newest pinned epoch, 0 when nothing is pinned
+StoreTotals storeTotals;
+StoreSnapshot** pinnedSnapshots = NULL;
+int pinnedCount = 0, pinnedCapacity = 0;
+RetiredObject* retiredObjects = NULL;
+size_t retiredCount = 0, retiredCapacity = 0;
+
+static inline int isSharedNode(const BPTreeNode* node) {
+    return node->epoch <= pinnedEpoch;
+}
+
+void retireObject(void* object, int isNode) {
+    if (retiredCount == retiredCapacity) {
+        retiredCapacity = retiredCapacity ? retiredCapacity * 2 : 1024;
+        retiredObjects = (RetiredObject*)realloc(retiredObjects, retiredCapacity * sizeof(RetiredObject));
+        if (!retiredObjects) {
+            printf("Memory allocation failed for retired objects.\n");
+            exit(1);
+        }
+    }
+    retiredObjects[retiredCount].object = object;
+    retiredObjects[retiredCount].epoch = storeEpoch;
+    retiredObjects[retiredCount].isNode = isNode;
+    retiredCount++;
+}
+
+// Frees the node now, or once no snapshot can reach it
+void discardBPTreeNode(BPTreeNode* node) {
+    if (isSharedNode(node))
+        retireObject(node, 1);
+    else
+        releaseBPTreeNode(node);
+}
+
+void discardTransaction(Transaction* t) {
+    if (pinnedEpoch)
+        retireObject(t, 0);
+    else
+        releaseTransaction(t);
+}
+
+// A copy of a shared node for the current epoch; the original is retired
+BPTreeNode* copyBPTreeNode(BPTreeNode* node) {
+    BPTreeNode* copy = (BPTreeNode*)poolAlloc(&nodePool);
+    memcpy(copy, node, sizeof(BPTreeNode));
+    copy->epoch = storeEpoch;
+    retireObject(node, 1);
+    return copy;
+}
+
+/* Copies every shared node on the path, top down, and links each copy into its
+   parent (or root), so the path can be changed in place. */
+void makePathWritable(BPTreeNode** root, BPTreePath* path) {
+    if (!pinnedEpoch) return;
+    for (int level = 0; level < path->depth; level++) {
+        if (!isSharedNode(path->nodes[level])) continue;
+        BPTreeNode* copy = copyBPTreeNode(path->nodes[level]);
+        if (level == 0)
+            *root = copy;
+        else
+            path->nodes[level - 1]->children[path->childIdx[level - 1]] = copy;
+        path->nodes[level] = copy;
+    }
+}
+
+// children[idx] of a writable node, copied first if a snapshot shares it
+BPTreeNode* writableChild(BPTreeNode* parent, int idx) {
+    BPTreeNode* child = parent->children[idx];
+    if (isSharedNode(child)) {
+        child = copyBPTreeNode(child);
+        parent->children[idx] = child;
+    }
+    return child;
+}
+
+/* Frees the retired objects that no pinned snapshot can reach: those retired in an
+   epoch no later than the oldest one pinned. They are in retirement order. */
+void reclaimRetired() {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < pinnedCount; i++) {
+        if (pinnedSnapshots[i]->epoch < oldest) oldest = pinnedSnapshots[i]->epoch;
+    }
+    size_t freed = 0;
+    while (freed < retiredCount && retiredObjects[freed].epoch <= oldest) {
+        if (retiredObjects[freed].isNode)
+            releaseBPTreeNode((BPTreeNode*)retiredObjects[freed].object);
+        else
+            releaseTransaction((Transaction*)retiredObjects[freed].object);
+        freed++;
+    }
+    retiredCount -= freed;
+    memmove(retiredObjects, retiredObjects + freed, retiredCount * sizeof(RetiredObject));
+}
+
+// Pins the current state; the trees it names stay intact until it is unpinned
+StoreSnapshot* pinSnapshot() {
+    StoreSnapshot* snapshot = (StoreSnapshot*)malloc(sizeof(StoreSnapshot));
+    if (pinnedCount == pinnedCapacity) {
+        pinnedCapacity = pinnedCapacity ? pinnedCapacity * 2 : 16;
+        pinnedSnapshots = (StoreSnapshot**)realloc(pinnedSnapshots, pinnedCapacity * sizeof(StoreSnapshot*));
+    }
+    if (!snapshot || !pinnedSnapshots) {
+        printf("Memory allocation failed for snapshot.\n");
         exit(1);
     }
+    snapshot->epoch = storeEpoch;
+    snapshot->transactions = globalTransactionTree;
+    snapshot->byTime = timeIndexTree;
+    snapshot->byEnergy = energyIndexTree;
+    snapshot->totals = storeTotals;
+    pinnedSnapshots[pinnedCount++] = snapshot;
+    pinnedEpoch = storeEpoch++;
+    return snapshot;
+}
+
+void unpinSnapshot(StoreSnapshot* snapshot) {
+    pinnedEpoch = 0;
+    int kept = 0;
+    for (int i = 0; i < pinnedCount; i++) {
+        if (pinnedSnapshots[i] == snapshot) continue;
+        if (pinnedSnapshots[i]->epoch > pinnedEpoch) pinnedEpoch = pinnedSnapshots[i]->epoch;
+        pinnedSnapshots[kept++] = pinnedSnapshots[i];
+    }
+    pinnedCount = kept;
+    free(snapshot);
+    reclaimRetired();
+}
+
+/* ============== TIMESTAMPS ============== */
+/* Days since 1970-01-01 in the proleptic Gregorian calendar. Timestamps are
+   treated as plain wall-clock values, so no time zone or DST rules apply. */
+long long daysFromCivil(int year, int month, int day) {
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    long long yearOfEra = year - era * 400;
+    long long dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long long dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+/* Accepts years 1900 to 2100 and only dates and times that exist, so nothing is
+   normalised (2024-02-30 is not 2024-03-01) and every epoch fits the time index key. */
+int isValidCivilTime(int year, int month, int day, int hour, int minute, int second) {
+    static const int daysInMonth[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (year < 1900 || year > 2100 || month < 1 || month > 12 || day < 1) return 0;
+    int isLeapYear = (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0));
+    if (day > daysInMonth[month - 1] + (month == 2 && isLeapYear)) return 0;
+    return hour >= 0 && hour <= 23 && minute >= 0 && minute <= 59 && second >= 0 && second <= 59;
+}
+
+/* Parses "YYYY-MM-DD HH:MM:SS" into seconds since the epoch; returns 0 on bad input. */
+int parseTimestamp(const char* text, long long* epoch) {
+    int year, month, day, hour, minute, second;
+    if (sscanf(text, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second) != 6 ||
+        !isValidCivilTime(year, month, day, hour, minute, second)) {
+        return 0;
+    }
+    *epoch = daysFromCivil(year, month, day) * 86400LL + hour * 3600LL + minute * 60LL + second;
+    return 1;
+}
+
+/* Inverse of daysFromCivil. */
+void civilFromDays(long long days, int* year, int* month, int* day) {
+    days += 719468;
+    long long era = (days >= 0 ? days : days - 146096) / 146097;
+    long long dayOfEra = days - era * 146097;
+    long long yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    long long dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    long long monthIndex = (5 * dayOfYear + 2) / 153;
+    *day = (int)(dayOfYear - (153 * monthIndex + 2) / 5 + 1);
+    *month = (int)(monthIndex < 10 ? monthIndex + 3 : monthIndex - 9);
+    *year = (int)(yearOfEra + era * 400 + (*month <= 2));
+}
+
+/* Formats epoch seconds back to "YYYY-MM-DD HH:MM:SS" for display and the log file. */
+void formatTimestamp(long long epoch, char* buffer, size_t size) {
+    long long days = epoch / 86400;
+    long long secondOfDay = epoch % 86400;
+    if (secondOfDay < 0) {
+        secondOfDay += 86400;
+        days--;
+    }
+    int year, month, day;
+    civilFromDays(days, &year, &month, &day);
+    snprintf(buffer, size, "%04d-%02d-%02d %02d:%02d:%02d", year, month, day,
+             (int)(secondOfDay / 3600), (int)(secondOfDay / 60 % 60), (int)(secondOfDay % 60));
+}
+
+Transaction* createTransaction(int transactionID, int buyerID, int sellerID, double energyAmount, double pricePerKwh, long long epoch) {
+    Transaction* t = (Transaction*)poolAlloc(&transactionPool);
     t->transactionID = transactionID;
     t->buyerID = buyerID;
     t->sellerID = sellerID;
     t->energyAmount = energyAmount;
     t->pricePerKwh = pricePerKwh;
     t->totalPrice = energyAmount * pricePerKwh;
-    strncpy(t->timestamp, timestamp, sizeof(t->timestamp) - 1);
-    t->timestamp[sizeof(t->timestamp) - 1] = '\0';
-    t->next = NULL;
+    t->epoch = epoch;
     if (transactionID >= nextTransactionID) {
         nextTransactionID = transactionID + 1;
     }
     return t;
 }
 
-BPTreeNode* createBPTreeNode(int isLeaf) {
-    BPTreeNode* newNode = (BPTreeNode*)malloc(sizeof(BPTreeNode));
-    if (!newNode) {
-        printf("Memory allocation failed for B+ tree node.\n");
-        exit(1);
-    }
-    newNode->isLeaf = isLeaf;
-    newNode->numKeys = 0;
-    newNode->next = NULL;
-    for (int i = 0; i < ORDER - 1; i++) {
-        newNode->keys[i] = 0;
-        newNode->records[i] = NULL;
-    }
-    for (int i = 0; i < ORDER; i++) {
-        newNode->children[i] = NULL;
+/* ============== WRITE-AHEAD LOG ============== */
+/* Every change is appended to WAL_FILE before it is acknowledged: inserts, deletes
+   and seller rate changes, one binary record each. A record is a fixed header holding
+   a CRC-32C, the payload length, a log sequence number (LSN) and the record type,
+   followed by the payload. LSNs rise by one per record. The file opens with a header
+   naming the first LSN it holds; a checkpoint drops the records it covers by moving
+   the rest to a fresh file.
+   Records collect in a buffer and reach the file under one of three sync policies:
+     SYNC_PER_RECORD  write and fdatasync every record before the change returns
+     SYNC_EVERY_N     write and fdatasync once N records are pending
+     SYNC_INTERVAL    a flusher thread writes and fdatasyncs every T milliseconds
+   A record counts as durable once the fdatasync covering it returns. A full buffer
+   is written out early but not synced. */
+#define APPEND_LOG_BUFFER_BYTES (64 * 1024)
+#define WAL_MAGIC "ETWALOG1"
+#define WAL_VERSION 1
+
+typedef enum { SYNC_PER_RECORD, SYNC_EVERY_N, SYNC_INTERVAL } SyncPolicy;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    uint64_t firstLsn;  // LSN of the first record in this file
+    uint32_t reserved;
+    uint32_t checksum;  // CRC-32C of the header up to this field
+} WalFileHeader;
+
+typedef enum { WAL_INSERT = 1, WAL_DELETE = 2, WAL_SELLER_RATES = 3, WAL_SHARD_INSERT = 4 } WalRecordType;
+
+typedef struct {
+    uint32_t checksum;  // CRC-32C of the rest of the header and the payload
+    uint32_t length;    // payload bytes
+    uint64_t lsn;
+    uint32_t type;
+    uint32_t reserved;
+} WalRecordHeader;
+
+typedef struct {
+    int64_t epoch;
+    double energyAmount;
+    double pricePerKwh;
+    double totalPrice;
+    int32_t transactionID;
+    int32_t buyerID;
+    int32_t sellerID;
+    int32_t reserved;
+} WalInsert;
+
+// An insert in an ingest shard's segment, with where its line starts in the input file
+typedef struct {
+    WalInsert insert;
+    uint64_t inputOffset;
+} WalShardInsert;
+
+typedef struct {
+    int32_t transactionID;
+    int32_t reserved;
+} WalDelete;
+
+typedef struct {
+    int32_t sellerID;
+    int32_t reserved;
+    double rateBelow300;
+    double rateAbove300;
+} WalSellerRates;
+
+// Payload size each record type must carry; 0 for unknown types
+size_t walPayloadBytes(uint32_t type) {
+    switch (type) {
+        case WAL_INSERT: return sizeof(WalInsert);
+        case WAL_DELETE: return sizeof(WalDelete);
+        case WAL_SELLER_RATES: return sizeof(WalSellerRates);
+        case WAL_SHARD_INSERT: return sizeof(WalShardInsert);
+        default: return 0;
     }
-    return newNode;
 }
 
-int findTransactionInBPTree(BPTreeNode* root, int transactionID) {
-    if (!root) return 0;
-    BPTreeNode* cursor = root;
-    while (!cursor->isLeaf) {
-        int i;
-        for (i = 0; i < cursor->numKeys; i++) {
-            if (transactionID < cursor->keys[i]) {
-                break;
-            }
-        }
-        cursor = cursor->children[i];
-    }
-    for (int i = 0; i < cursor->numKeys; i++) {
-        if (cursor->keys[i] == transactionID) {
-            return 1;  
+/* CRC-32C (Castagnoli). Uses the SSE4.2 instruction when the build targets it and
+   slicing-by-8 tables otherwise. */
+uint32_t crc32cTables[8][256];
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    for (; length >= 8; p += 8, length -= 8) {
+        unsigned long long word;
+        memcpy(&word, p, 8);
+        crc = (uint32_t)_mm_crc32_u64(crc, word);
+    }
+    for (; length > 0; p++, length--)
+        crc = _mm_crc32_u8(crc, *p);
+#else
+    if (!crc32cTables[0][1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++)
+                value = value & 1 ? (value >> 1) ^ 0x82F63B78u : value >> 1;
+            crc32cTables[0][i] = value;
         }
+        for (int t = 1; t < 8; t++)
+            for (int i = 0; i < 256; i++)
+                crc32cTables[t][i] = (crc32cTables[t - 1][i] >> 8) ^ crc32cTables[0][crc32cTables[t - 1][i] & 0xFF];
+    }
+    for (; length >= 8; p += 8, length -= 8) {
+        uint32_t low = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32cTables[7][low & 0xFF] ^ crc32cTables[6][(low >> 8) & 0xFF] ^
+              crc32cTables[5][(low >> 16) & 0xFF] ^ crc32cTables[4][low >> 24] ^
+              crc32cTables[3][p[4]] ^ crc32cTables[2][p[5]] ^
+              crc32cTables[1][p[6]] ^ crc32cTables[0][p[7]];
+    }
+    for (; length > 0; p++, length--)
+        crc = crc32cTables[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+#endif
+    return ~crc;
+}
+
+uint32_t walRecordChecksum(const WalRecordHeader* header, const void* payload) {
+    uint32_t crc = crc32c(0, &header->length, sizeof(WalRecordHeader) - offsetof(WalRecordHeader, length));
+    return crc32c(crc, payload, header->length);
+}
+
+// Syncs the directory so a rename or a new file in it survives a crash
+void syncDirectory() {
+    int dirFd = open(".", O_RDONLY);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
     }
-    return 0; 
 }
 
-int loading_mode = 0;
+int walWriteHeader(int fd, uint64_t firstLsn) {
+    WalFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAL_MAGIC, sizeof(header.magic));
+    header.version = WAL_VERSION;
+    header.headerBytes = sizeof(WalFileHeader);
+    header.firstLsn = firstLsn;
+    header.checksum = crc32c(0, &header, offsetof(WalFileHeader, checksum));
+    return write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) ? 0 : -1;
+}
 
-Seller* findOrCreateSeller(int sellerID) {
-    Seller* current = seller_head;
-    while (current) {
-        if (current->sellerID == sellerID) {
-            return current;
+/* Creates an empty log at path whose first record will carry firstLsn. The file is
+   written under a temporary name and renamed, so path is never seen half-written. */
+int walCreate(const char* path, uint64_t firstLsn) {
+    char tempPath[256];
+    snprintf(tempPath, sizeof(tempPath), "%s.new", path);
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int failed = walWriteHeader(fd, firstLsn) != 0 || fdatasync(fd) != 0;
+    if (close(fd) != 0 || failed || rename(tempPath, path) != 0) {
+        remove(tempPath);
+        return -1;
+    }
+    syncDirectory();
+    return 0;
+}
+
+typedef struct {
+    const char* path;
+    int fd;  // -1 while closed
+    SyncPolicy policy;
+    int syncEveryRecords;
+    int syncIntervalMs;
+    char buffer[APPEND_LOG_BUFFER_BYTES];
+    size_t used;
+    uint64_t nextLsn;    // set by recovery before the first append
+    int pendingRecords;  // appended since the last fdatasync
+    int syncsInFlight;   // fdatasyncs running outside the lock; the fd must outlive them
+    int failed;          // a write or sync failed; see appendLogFailLocked
+    off_t writtenBytes;  // file length once the writes so far land
+    off_t syncedBytes;   // file length the last successful fdatasync covered
+    int deferSyncs;      // batch and ingest: per-record syncs wait for one appendLogSync per chunk or batch
+    long long recordsAppended;
+    long long writeCalls;
+    long long syncCalls;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t syncDone;
+    pthread_t flusher;
+    int flusherRunning;
+    int stopFlusher;
+} AppendLog;
+
+AppendLog transactionLog = { .path = WAL_FILE, .fd = -1, .policy = SYNC_PER_RECORD, .syncEveryRecords = 1,
+                             .syncIntervalMs = 100 };
+
+/* After a failed write or sync nothing past the last good sync can be trusted: a
+   retried write would repeat records that recovery then reads as a torn tail. So the
+   file is cut back to what that sync covered, the buffer is dropped and every later
+   append is refused. Records whose append failed are therefore never replayed, and
+   only records not yet synced under a relaxed --sync policy are lost. */
+void appendLogFailLocked(AppendLog* log) {
+    if (log->failed) return;
+    log->failed = 1;
+    log->used = 0;
+    log->pendingRecords = 0;
+    if (ftruncate(log->fd, log->syncedBytes) != 0 || fdatasync(log->fd) != 0) {
+        printf("Error cutting %s back to its last sync: %s\n", log->path, strerror(errno));
+    }
+    log->writtenBytes = log->syncedBytes;
+    printf("%s is no longer accepting records; restart to recover from it.\n", log->path);
+}
+
+// Writes out the buffer; caller holds the lock. Returns 0 on success.
+int appendLogDrainLocked(AppendLog* log) {
+    if (log->failed) return -1;
+    size_t offset = 0;
+    while (offset < log->used) {
+        ssize_t written = write(log->fd, log->buffer + offset, log->used - offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            printf("Error writing to %s: %s\n", log->path, strerror(errno));
+            appendLogFailLocked(log);
+            return -1;
         }
-        current = current->next;
-    }
-    
-    double rateBelow300 = 0.0, rateAbove300 = 0.0;
-    if (!loading_mode) {
-        printf("New Seller detected (ID: %d). Please enter the price for energy:\n", sellerID);
-        printf("Price per kWh for energy below 300 kWh: ");
-        scanf("%lf", &rateBelow300);
-        printf("Price per kWh for energy above 300 kWh: ");
-        scanf("%lf", &rateAbove300);
-    }
-    
-    Seller* newSeller = (Seller*)malloc(sizeof(Seller));
-    if (!newSeller) {
-        printf("Memory allocation failed for seller.\n");
-        exit(1);
-    }
-    
-    newSeller->sellerID = sellerID;
-    newSeller->rateBelow300 = rateBelow300;
-    newSeller->rateAbove300 = rateAbove300;
-    newSeller->numTransactions = 0;
-    newSeller->totalRevenue = 0.0;
-    newSeller->regularBuyers = NULL;
-    newSeller->transactionTree = NULL;
-    newSeller->next = seller_head;
-    seller_head = newSeller;
-    
-    if (!loading_mode) {
-        saveSellerPrices();
+        offset += (size_t)written;
+        log->writtenBytes += written;
+        log->writeCalls++;
     }
-    
-    return newSeller;
+    log->used = 0;
+    return 0;
 }
 
-Buyer* findOrCreateBuyer(int buyerID) {
-    Buyer* current = buyer_head;
-    while (current) {
-        if (current->buyerID == buyerID) {
-            return current;
+// Writes out the buffer and makes everything appended so far durable
+int appendLogSync(AppendLog* log) {
+    pthread_mutex_lock(&log->lock);
+    if (log->fd < 0 || (log->used == 0 && log->pendingRecords == 0)) {
+        int status = log->failed ? -1 : 0;
+        pthread_mutex_unlock(&log->lock);
+        return status;
+    }
+    int status = appendLogDrainLocked(log);
+    int fd = log->fd;
+    off_t syncing = log->writtenBytes;
+    log->pendingRecords = 0;
+    log->syncsInFlight++;
+    pthread_mutex_unlock(&log->lock);
+    // Appends may continue while the sync is in flight; they wait for the next one
+    if (status == 0 && fdatasync(fd) != 0) {
+        printf("Error syncing %s: %s\n", log->path, strerror(errno));
+        status = -1;
+    }
+    pthread_mutex_lock(&log->lock);
+    if (status != 0) {
+        appendLogFailLocked(log);
+    } else if (!log->failed && syncing > log->syncedBytes) {
+        log->syncedBytes = syncing;
+    }
+    if (log->failed) status = -1;
+    log->syncCalls++;
+    log->syncsInFlight--;
+    pthread_cond_broadcast(&log->syncDone);
+    pthread_mutex_unlock(&log->lock);
+    return status;
+}
+
+void* appendLogFlusher(void* arg) {
+    AppendLog* log = (AppendLog*)arg;
+    pthread_mutex_lock(&log->lock);
+    while (!log->stopFlusher) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += log->syncIntervalMs / 1000;
+        deadline.tv_nsec += (long)(log->syncIntervalMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
-        current = current->next;
+        pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+        if (log->stopFlusher) break;
+        pthread_mutex_unlock(&log->lock);
+        appendLogSync(log);
+        pthread_mutex_lock(&log->lock);
     }
-    
-    Buyer* newBuyer = (Buyer*)malloc(sizeof(Buyer));
-    if (!newBuyer) {
-        printf("Memory allocation failed for buyer.\n");
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+int appendLogOpen(AppendLog* log, const char* path, SyncPolicy policy, int everyRecords, int intervalMs) {
+    log->path = path;
+    log->policy = policy;
+    log->syncEveryRecords = everyRecords > 0 ? everyRecords : 1;
+    log->syncIntervalMs = intervalMs > 0 ? intervalMs : 1;
+    log->used = 0;
+    log->pendingRecords = 0;
+    log->syncsInFlight = 0;
+    log->recordsAppended = log->writeCalls = log->syncCalls = 0;
+    log->stopFlusher = 0;
+    log->flusherRunning = 0;
+    log->failed = 0;
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log->fd < 0) {
+        printf("Error opening %s for appending: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Recovery has checked and synced what is already there
+    log->writtenBytes = log->syncedBytes = lseek(log->fd, 0, SEEK_END);
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->wake, NULL);
+    pthread_cond_init(&log->syncDone, NULL);
+    if (policy == SYNC_INTERVAL) {
+        if (pthread_create(&log->flusher, NULL, appendLogFlusher, log) != 0) {
+            printf("Error starting the log flusher thread.\n");
+            exit(1);
+        }
+        log->flusherRunning = 1;
+    }
+    return 0;
+}
+
+/* Stops the flusher, syncs whatever is still buffered and closes the file. */
+void appendLogClose(AppendLog* log) {
+    if (log->fd < 0) return;
+    if (log->flusherRunning) {
+        pthread_mutex_lock(&log->lock);
+        log->stopFlusher = 1;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->flusher, NULL);
+        log->flusherRunning = 0;
+    }
+    appendLogSync(log);
+    close(log->fd);
+    log->fd = -1;
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    pthread_cond_destroy(&log->syncDone);
+}
+
+/* Frames and buffers one record, assigning it the next LSN. Returns 0 once the sync
+   policy is satisfied. On failure the record is not in the file and never will be. */
+int appendLogRecord(AppendLog* log, WalRecordType type, const void* payload, size_t length) {
+    // Only the owning thread opens and closes the log, so fd can be checked unlocked
+    if (log->fd < 0) {
+        printf("Error: %s is not open for appending.\n", log->path);
+        return -1;
+    }
+    WalRecordHeader header;
+    size_t total = sizeof(header) + length;
+    pthread_mutex_lock(&log->lock);
+    if (log->failed || (log->used + total > sizeof(log->buffer) && appendLogDrainLocked(log) != 0)) {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+    // The LSN is taken under the lock so records reach the buffer in LSN order
+    header.length = (uint32_t)length;
+    header.lsn = log->nextLsn++;
+    header.type = (uint32_t)type;
+    header.reserved = 0;
+    header.checksum = walRecordChecksum(&header, payload);
+    memcpy(log->buffer + log->used, &header, sizeof(header));
+    memcpy(log->buffer + log->used + sizeof(header), payload, length);
+    log->used += total;
+    log->pendingRecords++;
+    log->recordsAppended++;
+    int syncNow = (log->policy == SYNC_PER_RECORD && !log->deferSyncs) ||
+                  (log->policy == SYNC_EVERY_N && log->pendingRecords >= log->syncEveryRecords);
+    pthread_mutex_unlock(&log->lock);
+    return syncNow ? appendLogSync(log) : 0;
+}
+
+void fillWalInsert(WalInsert* record, const Transaction* t) {
+    record->epoch = t->epoch;
+    record->energyAmount = t->energyAmount;
+    record->pricePerKwh = t->pricePerKwh;
+    record->totalPrice = t->totalPrice;
+    record->transactionID = t->transactionID;
+    record->buyerID = t->buyerID;
+    record->sellerID = t->sellerID;
+    record->reserved = 0;
+}
+
+int appendTransactionRecord(AppendLog* log, const Transaction* t) {
+    WalInsert record;
+    fillWalInsert(&record, t);
+    return appendLogRecord(log, WAL_INSERT, &record, sizeof(record));
+}
+
+int appendShardInsertRecord(AppendLog* log, const Transaction* t, uint64_t inputOffset) {
+    WalShardInsert record;
+    fillWalInsert(&record.insert, t);
+    record.inputOffset = inputOffset;
+    return appendLogRecord(log, WAL_SHARD_INSERT, &record, sizeof(record));
+}
+
+// Appends a tombstone that cancels the live record with this ID on replay
+int appendTombstone(AppendLog* log, int transactionID) {
+    WalDelete record = { transactionID, 0 };
+    return appendLogRecord(log, WAL_DELETE, &record, sizeof(record));
+}
+
+int appendSellerRatesRecord(AppendLog* log, int sellerID, double rateBelow300, double rateAbove300) {
+    WalSellerRates record = { sellerID, 0, rateBelow300, rateAbove300 };
+    return appendLogRecord(log, WAL_SELLER_RATES, &record, sizeof(record));
+}
+
+/* Parses "record", "every:N" or "interval:MS" as given to --sync; returns 0 on bad input. */
+int parseSyncPolicy(const char* text, SyncPolicy* policy, int* everyRecords, int* intervalMs) {
+    int value;
+    char extra;
+    if (strcmp(text, "record") == 0) {
+        *policy = SYNC_PER_RECORD;
+        return 1;
+    }
+    if (sscanf(text, "every:%d%c", &value, &extra) == 1 && value > 0) {
+        *policy = SYNC_EVERY_N;
+        *everyRecords = value;
+        return 1;
+    }
+    if (sscanf(text, "interval:%d%c", &value, &extra) == 1 && value > 0) {
+        *policy = SYNC_INTERVAL;
+        *intervalMs = value;
+        return 1;
+    }
+    return 0;
+}
+
+void describeSyncPolicy(const AppendLog* log, char* buffer, size_t size) {
+    if (log->policy == SYNC_PER_RECORD)
+        snprintf(buffer, size, "per record");
+    else if (log->policy == SYNC_EVERY_N)
+        snprintf(buffer, size, "every %d records", log->syncEveryRecords);
+    else
+        snprintf(buffer, size, "every %d ms", log->syncIntervalMs);
+}
+
+/* ============== IN-NODE KEY SEARCH ============== */
+/* Each kernel returns how many of keys[0..numKeys) are <= key: the child slot to
+   descend into, or the insert position in a leaf. */
+
+int nodeUpperBoundLinear(const BPKey* keys, int numKeys, BPKey key) {
+    int i;
+    for (i = 0; i < numKeys; i++) {
+        if (key < keys[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
+static inline int nodeUpperBoundBinary(const BPKey* keys, int numKeys, BPKey key) {
+    if (numKeys == 0) return 0;
+    const BPKey* base = keys;
+    int len = numKeys;
+    while (len > 1) {
+        int half = len / 2;
+        base = (base[half] <= key) ? base + half : base;
+        len -= half;
+    }
+    return (int)(base - keys) + (*base <= key);
+}
+
+/* Kernel choice: a build that targets AVX2 (-mavx2, -march=native) inlines that
+   kernel. Other x86 builds compile it for its own target and selectNodeSearchKernel()
+   switches to it at startup when the CPU supports AVX2. Otherwise the branchless
+   binary search is used. With 64-bit keys a cache line holds only 8 keys and the
+   narrower SSE4.2 kernel, the first SSE level with a 64-bit compare, does not beat
+   the binary search, so it is only timed. -DBPTREE_SEARCH_BINARY forces the binary
+   search. Debug option 5 times every kernel the CPU can run. */
+#if !defined(BPTREE_SEARCH_BINARY) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NODE_SEARCH_SIMD 1
+
+/* Branchless search over the first key of each cache line picks the one line that
+   can hold the answer; the vector kernels then count within it. */
+static inline int nodeSearchLine(const BPKey* keys, int numKeys, BPKey key) {
+    int line = 0;
+    int len = (numKeys + KEYS_PER_CACHE_LINE - 1) / KEYS_PER_CACHE_LINE;
+    while (len > 1) {
+        int half = len / 2;
+        line = (keys[(line + half) * KEYS_PER_CACHE_LINE] <= key) ? line + half : line;
+        len -= half;
+    }
+    return line;
+}
+
+/* greater has a bit per lane of the chosen line whose key exceeds the search key.
+   Lanes past numKeys read the padded tail of the keys array and are masked out; keys
+   are sorted, so the remaining bits form one run whose first lane is the count. */
+static inline int nodeSearchLineCount(int numKeys, int line, unsigned int greater) {
+    int valid = numKeys - line * KEYS_PER_CACHE_LINE;
+    if (valid > KEYS_PER_CACHE_LINE) valid = KEYS_PER_CACHE_LINE;
+    return line * KEYS_PER_CACHE_LINE + __builtin_ctz(greater | (~0u << valid));
+}
+
+__attribute__((target("avx2")))
+static inline int nodeUpperBoundAvx2(const BPKey* keys, int numKeys, BPKey key) {
+    if (numKeys == 0) return 0;
+    int line = nodeSearchLine(keys, numKeys, key);
+    const BPKey* block = keys + line * KEYS_PER_CACHE_LINE;
+    __m256i needle = _mm256_set1_epi64x(key);
+    unsigned int greater = 0;
+    for (int i = 0; i < KEYS_PER_CACHE_LINE; i += 4) {
+        __m256i lanes = _mm256_load_si256((const __m256i*)(block + i));
+        greater |= (unsigned int)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(lanes, needle))) << i;
+    }
+    return nodeSearchLineCount(numKeys, line, greater);
+}
+
+__attribute__((target("sse4.2")))
+static inline int nodeUpperBoundSse42(const BPKey* keys, int numKeys, BPKey key) {
+    if (numKeys == 0) return 0;
+    int line = nodeSearchLine(keys, numKeys, key);
+    const BPKey* block = keys + line * KEYS_PER_CACHE_LINE;
+    __m128i needle = _mm_set1_epi64x(key);
+    unsigned int greater = 0;
+    for (int i = 0; i < KEYS_PER_CACHE_LINE; i += 2) {
+        __m128i lanes = _mm_load_si128((const __m128i*)(block + i));
+        greater |= (unsigned int)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(lanes, needle))) << i;
+    }
+    return nodeSearchLineCount(numKeys, line, greater);
+}
+#endif
+
+#if defined(NODE_SEARCH_SIMD) && defined(__AVX2__)
+static const char* const nodeSearchKernel = "AVX2";
+#define nodeUpperBound nodeUpperBoundAvx2
+void selectNodeSearchKernel(void) {}
+#elif defined(NODE_SEARCH_SIMD)
+static const char* nodeSearchKernel = "branchless binary";
+static int (*nodeUpperBoundKernel)(const BPKey*, int, BPKey) = nodeUpperBoundBinary;
+#define nodeUpperBound(keys, numKeys, key) nodeUpperBoundKernel(keys, numKeys, key)
+// Called once at startup, before any tree is searched
+void selectNodeSearchKernel(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        nodeSearchKernel = "AVX2";
+        nodeUpperBoundKernel = nodeUpperBoundAvx2;
+    }
+}
+#else
+static const char* const nodeSearchKernel = "branchless binary";
+#define nodeUpperBound nodeUpperBoundBinary
+void selectNodeSearchKernel(void) {}
+#endif
+
+/* Slot holding key in a leaf, or -1 when the leaf does not contain it. */
+static inline int nodeFindKey(const BPTreeNode* node, BPKey key) {
+    int pos = nodeUpperBound(node->keys, node->numKeys, key) - 1;
+    return (pos >= 0 && node->keys[pos] == key) ? pos : -1;
+}
+
+BPTreeNode* createBPTreeNode(int isLeaf) {
+    // Pool slabs are cache-line aligned and sizeof(BPTreeNode) is a whole number of lines
+    BPTreeNode* newNode = (BPTreeNode*)poolAlloc(threadNodePool ? threadNodePool : &nodePool);
+    memset(newNode, 0, sizeof(BPTreeNode));
+    newNode->isLeaf = isLeaf;
+    newNode->epoch = storeEpoch;
+    return newNode;
+}
+
+int findTransactionInBPTree(BPTreeNode* root, int transactionID) {
+    if (!root) return 0;
+    BPTreeNode* cursor = root;
+    while (!cursor->isLeaf) {
+        cursor = cursor->children[nodeUpperBound(cursor->keys, cursor->numKeys, transactionID)];
+    }
+    return nodeFindKey(cursor, transactionID) >= 0;
+}
+
+int loading_mode = 0;
+UnknownSellerPolicy unknownSellerPolicy = UNKNOWN_SELLER_PROMPT;
+double defaultRateBelow300 = 0.0, defaultRateAbove300 = 0.0;
+
+/* ============== ENTITY REGISTRY ============== */
+
+static inline unsigned int hashEntityID(int id) {
+    unsigned int h = (unsigned int)id * 2654435769u;
+    return h ^ (h >> 16);
+}
+
+// Shard that owns a seller when the store is split count ways, see SHARDED STORE
+static inline int shardOfSeller(int sellerID, int count) {
+    return count > 1 ? (int)(hashEntityID(sellerID) % (unsigned int)count) : 0;
+}
+
+int entityIndexFind(const EntityIndex* index, int id) {
+    if (!index->slots) return -1;
+    unsigned int mask = (unsigned int)index->capacity - 1;
+    for (unsigned int i = hashEntityID(id) & mask; ; i = (i + 1) & mask) {
+        if (index->slots[i].index < 0) return -1;
+        if (index->slots[i].id == id) return index->slots[i].index;
+    }
+}
+
+void entityIndexInsert(EntityIndex* index, int id, int position);
+
+// Doubles the table and re-inserts every entry; keeps the load factor at or below 1/2
+void growEntityIndex(EntityIndex* index) {
+    EntitySlot* old = index->slots;
+    int oldCapacity = index->capacity;
+    index->capacity = oldCapacity ? oldCapacity * 2 : 64;
+    index->slots = (EntitySlot*)malloc(index->capacity * sizeof(EntitySlot));
+    if (!index->slots) {
+        printf("Memory allocation failed for entity index.\n");
         exit(1);
     }
-    
+    for (int i = 0; i < index->capacity; i++)
+        index->slots[i].index = -1;
+    index->count = 0;
+    for (int i = 0; i < oldCapacity; i++)
+        if (old[i].index >= 0)
+            entityIndexInsert(index, old[i].id, old[i].index);
+    free(old);
+}
+
+void entityIndexInsert(EntityIndex* index, int id, int position) {
+    if ((index->count + 1) * 2 > index->capacity)
+        growEntityIndex(index);
+    unsigned int mask = (unsigned int)index->capacity - 1;
+    unsigned int i = hashEntityID(id) & mask;
+    while (index->slots[i].index >= 0)
+        i = (i + 1) & mask;
+    index->slots[i].id = id;
+    index->slots[i].index = position;
+    index->count++;
+}
+
+void freeEntityIndex(EntityIndex* index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+Seller* findSeller(int sellerID) {
+    if (shardCount > 0) return findShardedSeller(sellerID);
+    int i = entityIndexFind(&sellerIndex, sellerID);
+    return i >= 0 ? &sellers[i] : NULL;
+}
+
+Buyer* findBuyer(int buyerID) {
+    int i = entityIndexFind(&buyerIndex, buyerID);
+    return i >= 0 ? &buyers[i] : NULL;
+}
+
+int compareSellersById(const void* a, const void* b) {
+    int x = ((const Seller*)a)->sellerID, y = ((const Seller*)b)->sellerID;
+    return (x > y) - (x < y);
+}
+
+/* A copy of count sellers sorted by seller ID, for whole-store listings that must not
+   depend on registration order. The caller frees it; the copies share the trees. */
+Seller* sellersById(const Seller* list, int count) {
+    Seller* ordered = (Seller*)malloc((count ? count : 1) * sizeof(Seller));
+    if (!ordered) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    memcpy(ordered, list, count * sizeof(Seller));
+    qsort(ordered, count, sizeof(Seller), compareSellersById);
+    return ordered;
+}
+
+Seller* addSeller(int sellerID, double rateBelow300, double rateAbove300) {
+    if (shardCount > 0) return addShardedSeller(sellerID, rateBelow300, rateAbove300);
+    if (sellerCount == sellerCapacity) {
+        int newCapacity = sellerCapacity ? sellerCapacity * 2 : 16;
+        Seller* grown = (Seller*)realloc(sellers, newCapacity * sizeof(Seller));
+        if (!grown) {
+            printf("Memory allocation failed for seller.\n");
+            exit(1);
+        }
+        sellers = grown;
+        sellerCapacity = newCapacity;
+    }
+    Seller* newSeller = &sellers[sellerCount];
+    newSeller->sellerID = sellerID;
+    newSeller->rateBelow300 = rateBelow300;
+    newSeller->rateAbove300 = rateAbove300;
+    newSeller->numTransactions = 0;
+    newSeller->totalRevenue = 0.0;
+    newSeller->regularBuyers = NULL;
+    newSeller->transactionTree = NULL;
+    entityIndexInsert(&sellerIndex, sellerID, sellerCount++);
+    return newSeller;
+}
+
+Buyer* addBuyer(int buyerID) {
+    if (buyerCount == buyerCapacity) {
+        int newCapacity = buyerCapacity ? buyerCapacity * 2 : 16;
+        Buyer* grown = (Buyer*)realloc(buyers, newCapacity * sizeof(Buyer));
+        if (!grown) {
+            printf("Memory allocation failed for buyer.\n");
+            exit(1);
+        }
+        buyers = grown;
+        buyerCapacity = newCapacity;
+    }
+    Buyer* newBuyer = &buyers[buyerCount];
     newBuyer->buyerID = buyerID;
     newBuyer->totalEnergyPurchased = 0;
     newBuyer->numTransactions = 0;
     
     // Initialize the buyer's B+ tree for transactions
     newBuyer->transactionTree = NULL;
+    entityIndexInsert(&buyerIndex, buyerID, buyerCount);
+    leaderboardInsert(buyerCount++);
+    return newBuyer;
+}
+
+static inline unsigned int hashSellerBuyerPair(int sellerID, int buyerID) {
+    unsigned long long key = ((unsigned long long)(unsigned int)sellerID << 32) | (unsigned int)buyerID;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(key >> 32);
+}
+
+// Doubles the slot table and rehashes the pairs; keeps the load factor at or below 1/2
+void growPairCounterSlots(PairCounter* counter) {
+    free(counter->slots);
+    counter->slotCapacity = counter->slotCapacity ? counter->slotCapacity * 2 : 256;
+    counter->slots = (int*)malloc(counter->slotCapacity * sizeof(int));
+    if (!counter->slots) {
+        printf("Memory allocation failed for pair counter.\n");
+        exit(1);
+    }
+    for (int i = 0; i < counter->slotCapacity; i++)
+        counter->slots[i] = -1;
+    unsigned int mask = (unsigned int)counter->slotCapacity - 1;
+    for (int p = 0; p < counter->count; p++) {
+        unsigned int i = hashSellerBuyerPair(counter->pairs[p].sellerID, counter->pairs[p].buyerID) & mask;
+        while (counter->slots[i] >= 0)
+            i = (i + 1) & mask;
+        counter->slots[i] = p;
+    }
+}
+
+/* Adds delta to a pair's count, creating the pair on first sight, and returns the
+   pair's index. Pairs that drop to zero keep their slot so they can come back
+   without rehashing. */
+int adjustPairCount(PairCounter* counter, int sellerID, int buyerID, int delta) {
+    if ((counter->count + 1) * 2 > counter->slotCapacity)
+        growPairCounterSlots(counter);
+    unsigned int mask = (unsigned int)counter->slotCapacity - 1;
+    unsigned int i = hashSellerBuyerPair(sellerID, buyerID) & mask;
+    while (counter->slots[i] >= 0) {
+        SellerBuyerPair* pair = &counter->pairs[counter->slots[i]];
+        if (pair->sellerID == sellerID && pair->buyerID == buyerID) {
+            pair->transactionCount += delta;
+            return counter->slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    if (counter->count == counter->capacity) {
+        int newCapacity = counter->capacity ? counter->capacity * 2 : 128;
+        SellerBuyerPair* grown = (SellerBuyerPair*)realloc(counter->pairs, newCapacity * sizeof(SellerBuyerPair));
+        unsigned char* grownRegular = grown ? (unsigned char*)realloc(counter->regular, newCapacity) : NULL;
+        if (!grown || !grownRegular) {
+            printf("Memory allocation failed for pair counter.\n");
+            exit(1);
+        }
+        counter->pairs = grown;
+        counter->regular = grownRegular;
+        counter->capacity = newCapacity;
+    }
+    counter->pairs[counter->count].sellerID = sellerID;
+    counter->pairs[counter->count].buyerID = buyerID;
+    counter->pairs[counter->count].transactionCount = delta;
+    counter->regular[counter->count] = 0;
+    counter->slots[i] = counter->count;
+    return counter->count++;
+}
+
+void freePairCounter(PairCounter* counter) {
+    free(counter->pairs);
+    free(counter->regular);
+    free(counter->slots);
+    counter->pairs = NULL;
+    counter->regular = NULL;
+    counter->slots = NULL;
+    counter->count = counter->capacity = counter->slotCapacity = 0;
+}
+
+/* ============== TIME ROLLUPS ============== */
+/* Revenue, energy and trade count per seller and per buyer in hour, day, month and
+   year buckets, kept current by every insert and delete. A window of whole hours is
+   summed from the widest buckets that fit in it: hours up to the first midnight, days
+   up to the first of a month, months up to the first of a year, whole years, then
+   months, days and hours again at the far end. So a window costs at most
+   23 + 30 + 11 + 11 + 30 + 23 = 128 bucket reads plus one per whole year, however many
+   trades fall in it. The buckets are hashed into a dense array like the pair counter,
+   and a bucket that drops to zero keeps its slot. */
+typedef enum { ROLLUP_HOUR, ROLLUP_DAY, ROLLUP_MONTH, ROLLUP_YEAR } RollupLevel;
+
+typedef struct {
+    int entityID;
+    int bucket;              // hours or days since 1970, or months or years since year 0
+    unsigned char isBuyer;
+    unsigned char level;     // RollupLevel
+    int trades;
+    double energy;
+    double revenue;
+} RollupBucket;
+
+typedef struct {
+    RollupBucket* buckets;
+    int count;
+    int capacity;
+    int* slots;  // index into buckets, -1 marks an empty slot
+    int slotCapacity;  // power of two
+} RollupTable;
+
+RollupTable rollups = {NULL, 0, 0, NULL, 0};
+
+/* A seller's or buyer's totals over [startEpoch, endEpoch), both on the hour */
+typedef struct {
+    int isBuyer;
+    int entityID;
+    long long startEpoch;
+    long long endEpoch;
+    long long trades;
+    double energy;
+    double revenue;
+    int bucketsRead;
+} RollupWindow;
+
+static inline unsigned int hashRollupBucket(int isBuyer, int entityID, int level, int bucket) {
+    unsigned long long key = ((unsigned long long)(unsigned int)entityID << 32) | (unsigned int)bucket;
+    key = (key ^ ((unsigned long long)(isBuyer * 3 + level) << 59)) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(key >> 32);
+}
+
+// Doubles the slot table and rehashes the buckets; keeps the load factor at or below 1/2
+void growRollupSlots(RollupTable* table) {
+    free(table->slots);
+    table->slotCapacity = table->slotCapacity ? table->slotCapacity * 2 : 1024;
+    table->slots = (int*)malloc(table->slotCapacity * sizeof(int));
+    if (!table->slots) {
+        printf("Memory allocation failed for rollups.\n");
+        exit(1);
+    }
+    for (int i = 0; i < table->slotCapacity; i++)
+        table->slots[i] = -1;
+    unsigned int mask = (unsigned int)table->slotCapacity - 1;
+    for (int b = 0; b < table->count; b++) {
+        const RollupBucket* bucket = &table->buckets[b];
+        unsigned int i = hashRollupBucket(bucket->isBuyer, bucket->entityID, bucket->level, bucket->bucket) & mask;
+        while (table->slots[i] >= 0)
+            i = (i + 1) & mask;
+        table->slots[i] = b;
+    }
+}
+
+// The bucket, or NULL when it was never written and create is 0
+RollupBucket* findRollupBucket(int isBuyer, int entityID, int level, int bucket, int create) {
+    RollupTable* table = &rollups;
+    if (create && (table->count + 1) * 2 > table->slotCapacity)
+        growRollupSlots(table);
+    if (!table->slots) return NULL;
+    unsigned int mask = (unsigned int)table->slotCapacity - 1;
+    unsigned int i = hashRollupBucket(isBuyer, entityID, level, bucket) & mask;
+    for (; table->slots[i] >= 0; i = (i + 1) & mask) {
+        RollupBucket* found = &table->buckets[table->slots[i]];
+        if (found->bucket == bucket && found->entityID == entityID && found->level == level &&
+            found->isBuyer == isBuyer)
+            return found;
+    }
+    if (!create) return NULL;
+    if (table->count == table->capacity) {
+        int newCapacity = table->capacity ? table->capacity * 2 : 1024;
+        RollupBucket* grown = (RollupBucket*)realloc(table->buckets, newCapacity * sizeof(RollupBucket));
+        if (!grown) {
+            printf("Memory allocation failed for rollups.\n");
+            exit(1);
+        }
+        table->buckets = grown;
+        table->capacity = newCapacity;
+    }
+    RollupBucket* created = &table->buckets[table->count];
+    memset(created, 0, sizeof(RollupBucket));
+    created->entityID = entityID;
+    created->bucket = bucket;
+    created->isBuyer = (unsigned char)isBuyer;
+    created->level = (unsigned char)level;
+    table->slots[i] = table->count++;
+    return created;
+}
+
+static inline long long floorDiv(long long a, long long b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+static inline int monthBucket(long long day) {
+    int year, month, dayOfMonth;
+    civilFromDays(day, &year, &month, &dayOfMonth);
+    return year * 12 + month - 1;
+}
+
+/* Adds t to the hour, day, month and year buckets of its seller and buyer, or takes it out
+   again with sign -1. */
+void adjustRollups(const Transaction* t, int sign) {
+    long long hour = floorDiv(t->epoch, 3600);
+    int month = monthBucket(floorDiv(hour, 24));
+    int buckets[4] = { (int)hour, (int)floorDiv(hour, 24), month, month / 12 };
+    for (int isBuyer = 0; isBuyer <= 1; isBuyer++) {
+        int entityID = isBuyer ? t->buyerID : t->sellerID;
+        for (int level = ROLLUP_HOUR; level <= ROLLUP_YEAR; level++) {
+            RollupBucket* bucket = findRollupBucket(isBuyer, entityID, level, buckets[level], 1);
+            bucket->trades += sign;
+            bucket->energy += sign * t->energyAmount;
+            bucket->revenue += sign * t->totalPrice;
+            // Sums drift when trades come out; an empty bucket is exactly zero again
+            if (bucket->trades == 0) bucket->energy = bucket->revenue = 0.0;
+        }
+    }
+}
+
+void addRollupBucket(RollupWindow* window, int level, long long bucket) {
+    const RollupBucket* found = findRollupBucket(window->isBuyer, window->entityID, level, (int)bucket, 0);
+    window->bucketsRead++;
+    if (!found) return;
+    window->trades += found->trades;
+    window->energy += found->energy;
+    window->revenue += found->revenue;
+}
+
+/* Sums a seller's or buyer's trades from the hour holding startEpoch through the hour
+   holding endEpoch. */
+void sumRollupWindow(RollupWindow* window, int isBuyer, int entityID, long long startEpoch, long long endEpoch) {
+    memset(window, 0, sizeof(RollupWindow));
+    window->isBuyer = isBuyer;
+    window->entityID = entityID;
+    long long hour = floorDiv(startEpoch, 3600);
+    long long endHour = floorDiv(endEpoch, 3600) + 1;
+    window->startEpoch = hour * 3600;
+    window->endEpoch = endHour * 3600;
+    while (hour < endHour) {
+        long long day = floorDiv(hour, 24);
+        if (hour != day * 24 || (day + 1) * 24 > endHour) {
+            addRollupBucket(window, ROLLUP_HOUR, hour++);
+            continue;
+        }
+        int year, month, dayOfMonth;
+        civilFromDays(day, &year, &month, &dayOfMonth);
+        long long nextYear = daysFromCivil(year + 1, 1, 1);
+        long long nextMonth = month == 12 ? nextYear : daysFromCivil(year, month + 1, 1);
+        if (dayOfMonth == 1 && month == 1 && nextYear * 24 <= endHour) {
+            addRollupBucket(window, ROLLUP_YEAR, year);
+            hour = nextYear * 24;
+        } else if (dayOfMonth == 1 && nextMonth * 24 <= endHour) {
+            addRollupBucket(window, ROLLUP_MONTH, year * 12 + month - 1);
+            hour = nextMonth * 24;
+        } else {
+            addRollupBucket(window, ROLLUP_DAY, day);
+            hour += 24;
+        }
+    }
+}
+
+void freeRollupTable(RollupTable* table) {
+    free(table->buckets);
+    free(table->slots);
+    table->buckets = NULL;
+    table->slots = NULL;
+    table->count = table->capacity = table->slotCapacity = 0;
+}
+
+/* ============== BUYER LEADERBOARD ============== */
+/* Buyers ordered by energy purchased, most first, ties by buyer ID. Subtree sizes
+   answer rank and k-th queries in O(log n) without re-sorting. */
+
+static inline int leaderboardSize(int node) {
+    return node < 0 ? 0 : leaderboardNodes[node].size;
+}
+
+static inline void leaderboardUpdate(int node) {
+    leaderboardNodes[node].size = 1 + leaderboardSize(leaderboardNodes[node].left)
+                                    + leaderboardSize(leaderboardNodes[node].right);
+}
+
+// Nonzero when buyer a ranks ahead of buyer b
+static inline int leaderboardBefore(int a, int b) {
+    double ea = leaderboardNodes[a].energy, eb = leaderboardNodes[b].energy;
+    if (ea != eb) return ea > eb;
+    return buyers[a].buyerID < buyers[b].buyerID;
+}
+
+unsigned int leaderboardPriority() {
+    static unsigned int state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Splits a subtree into the buyers ranked ahead of pivot and the rest
+void leaderboardSplit(int node, int pivot, int* ahead, int* behind) {
+    if (node < 0) {
+        *ahead = *behind = -1;
+        return;
+    }
+    if (leaderboardBefore(node, pivot)) {
+        leaderboardSplit(leaderboardNodes[node].right, pivot, &leaderboardNodes[node].right, behind);
+        *ahead = node;
+    } else {
+        leaderboardSplit(leaderboardNodes[node].left, pivot, ahead, &leaderboardNodes[node].left);
+        *behind = node;
+    }
+    leaderboardUpdate(node);
+}
+
+// Joins two subtrees where every buyer in ahead ranks before every buyer in behind
+int leaderboardJoin(int ahead, int behind) {
+    if (ahead < 0) return behind;
+    if (behind < 0) return ahead;
+    if (leaderboardNodes[ahead].priority > leaderboardNodes[behind].priority) {
+        leaderboardNodes[ahead].right = leaderboardJoin(leaderboardNodes[ahead].right, behind);
+        leaderboardUpdate(ahead);
+        return ahead;
+    }
+    leaderboardNodes[behind].left = leaderboardJoin(ahead, leaderboardNodes[behind].left);
+    leaderboardUpdate(behind);
+    return behind;
+}
+
+void leaderboardInsert(int buyerIndex) {
+    if (buyerIndex >= leaderboardCapacity) {
+        int newCapacity = leaderboardCapacity ? leaderboardCapacity * 2 : 16;
+        while (newCapacity <= buyerIndex) newCapacity *= 2;
+        LeaderboardNode* grown = (LeaderboardNode*)realloc(leaderboardNodes, newCapacity * sizeof(LeaderboardNode));
+        if (!grown) {
+            printf("Memory allocation failed for leaderboard.\n");
+            exit(1);
+        }
+        leaderboardNodes = grown;
+        leaderboardCapacity = newCapacity;
+    }
+    LeaderboardNode* node = &leaderboardNodes[buyerIndex];
+    node->energy = buyers[buyerIndex].totalEnergyPurchased;
+    node->priority = leaderboardPriority();
+    node->left = node->right = -1;
+    node->size = 1;
+    // The loader links every buyer at once with rebuildLeaderboard
+    if (loading_mode) return;
+    int ahead, behind;
+    leaderboardSplit(leaderboardRoot, buyerIndex, &ahead, &behind);
+    leaderboardRoot = leaderboardJoin(leaderboardJoin(ahead, buyerIndex), behind);
+}
+
+int leaderboardRemove(int node, int buyerIndex) {
+    if (node < 0) return -1;
+    if (node == buyerIndex)
+        return leaderboardJoin(leaderboardNodes[node].left, leaderboardNodes[node].right);
+    if (leaderboardBefore(buyerIndex, node))
+        leaderboardNodes[node].left = leaderboardRemove(leaderboardNodes[node].left, buyerIndex);
+    else
+        leaderboardNodes[node].right = leaderboardRemove(leaderboardNodes[node].right, buyerIndex);
+    leaderboardUpdate(node);
+    return node;
+}
+
+/* Every change to a buyer's energy total goes through here to keep the order current. */
+void adjustBuyerEnergy(Buyer* buyer, double delta) {
+    int buyerIndex = (int)(buyer - buyers);
+    leaderboardRoot = leaderboardRemove(leaderboardRoot, buyerIndex);
+    buyer->totalEnergyPurchased += delta;
+    leaderboardInsert(buyerIndex);
+}
+
+int compareLeaderboardOrder(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    if (leaderboardBefore(x, y)) return -1;
+    return leaderboardBefore(y, x);
+}
+
+int leaderboardFixSizes(int node) {
+    if (node < 0) return 0;
+    leaderboardNodes[node].size = 1 + leaderboardFixSizes(leaderboardNodes[node].left)
+                                    + leaderboardFixSizes(leaderboardNodes[node].right);
+    return leaderboardNodes[node].size;
+}
+
+/* Rebuilds the whole treap from the buyers' current totals: one sort, then a linear
+   stack pass that links the sorted buyers into a heap on priority. The loader uses
+   this instead of one re-seat per replayed transaction. */
+void rebuildLeaderboard() {
+    leaderboardRoot = -1;
+    if (buyerCount == 0) return;
+    int* order = (int*)malloc(buyerCount * sizeof(int));
+    int* stack = (int*)malloc(buyerCount * sizeof(int));
+    if (!order || !stack) {
+        printf("Memory allocation failed for leaderboard.\n");
+        exit(1);
+    }
+    for (int i = 0; i < buyerCount; i++) {
+        order[i] = i;
+        leaderboardNodes[i].energy = buyers[i].totalEnergyPurchased;
+    }
+    qsort(order, buyerCount, sizeof(int), compareLeaderboardOrder);
+    int depth = 0;
+    for (int i = 0; i < buyerCount; i++) {
+        int node = order[i];
+        LeaderboardNode* entry = &leaderboardNodes[node];
+        entry->priority = leaderboardPriority();
+        entry->right = -1;
+        int lastPopped = -1;
+        while (depth > 0 && leaderboardNodes[stack[depth - 1]].priority < entry->priority)
+            lastPopped = stack[--depth];
+        entry->left = lastPopped;
+        if (depth > 0) leaderboardNodes[stack[depth - 1]].right = node;
+        stack[depth++] = node;
+    }
+    leaderboardRoot = stack[0];
+    leaderboardFixSizes(leaderboardRoot);
+    free(order);
+    free(stack);
+}
+
+// 1-based position of a buyer on the leaderboard
+int leaderboardRank(int buyerIndex) {
+    int rank = 1;
+    int node = leaderboardRoot;
+    while (node >= 0) {
+        if (node == buyerIndex)
+            return rank + leaderboardSize(leaderboardNodes[node].left);
+        if (leaderboardBefore(buyerIndex, node)) {
+            node = leaderboardNodes[node].left;
+        } else {
+            rank += leaderboardSize(leaderboardNodes[node].left) + 1;
+            node = leaderboardNodes[node].right;
+        }
+    }
+    return -1;
+}
+
+// Buyer index at a 0-based leaderboard position, or -1 past the end
+int leaderboardAt(int position) {
+    int node = leaderboardRoot;
+    while (node >= 0) {
+        int leftSize = leaderboardSize(leaderboardNodes[node].left);
+        if (position == leftSize) return node;
+        if (position < leftSize) {
+            node = leaderboardNodes[node].left;
+        } else {
+            position -= leftSize + 1;
+            node = leaderboardNodes[node].right;
+        }
+    }
+    return -1;
+}
+
+/* Returns NULL when unknownSellerPolicy rejects a new seller, or when its rates could
+   not be logged; the seller is only registered once they are. */
+Seller* findOrCreateSeller(int sellerID) {
+    Seller* existing = findSeller(sellerID);
+    if (existing) {
+        return existing;
+    }
+    
+    double rateBelow300 = 0.0, rateAbove300 = 0.0;
+    if (!loading_mode && unknownSellerPolicy == UNKNOWN_SELLER_REJECT) {
+        return NULL;
+    }
+    if (!loading_mode && unknownSellerPolicy == UNKNOWN_SELLER_DEFAULT) {
+        rateBelow300 = defaultRateBelow300;
+        rateAbove300 = defaultRateAbove300;
+    } else if (!loading_mode) {
+        printf("New Seller detected (ID: %d). Please enter the price for energy:\n", sellerID);
+        printf("Price per kWh for energy below 300 kWh: ");
+        scanf("%lf", &rateBelow300);
+        printf("Price per kWh for energy above 300 kWh: ");
+        scanf("%lf", &rateAbove300);
+    }
     
-    newBuyer->next = buyer_head;
-    buyer_head = newBuyer;
+    if (!loading_mode) {
+        if (appendSellerRatesRecord(&transactionLog, sellerID, rateBelow300, rateAbove300) != 0) {
+            printf("Error recording the rates of seller %d in the write-ahead log.\n", sellerID);
+            return NULL;
+        }
+    }
     
-    return newBuyer;
+    Seller* newSeller = addSeller(sellerID, rateBelow300, rateAbove300);
+    // A checkpoint may start here, so it must see the seller the log already has
+    if (!loading_mode) noteWalRecord();
+    return newSeller;
+}
+
+Buyer* findOrCreateBuyer(int buyerID) {
+    Buyer* existing = findBuyer(buyerID);
+    if (existing) {
+        return existing;
+    }
+    return addBuyer(buyerID);
 }
 
-void addRegularBuyer(Seller* seller, Buyer* buyer) {
+/* pairIndex is the seller-buyer pair's counter slot, whose flag stands in for a walk
+   of the seller's list. */
+void addRegularBuyer(PairCounter* counter, Seller* seller, Buyer* buyer, int pairIndex) {
     if (buyer->numTransactions > 5) {
-        RegularBuyer* current = seller->regularBuyers;
-        while (current) {
-            if (current->buyerID == buyer->buyerID) {
-                return; 
-            }
-            current = current->next;
+        if (counter->regular[pairIndex]) {
+            return;
         }
+        counter->regular[pairIndex] = 1;
         RegularBuyer* newRegularBuyer = (RegularBuyer*)malloc(sizeof(RegularBuyer));
         if (!newRegularBuyer) {
             printf("Memory allocation failed for regular buyer.\n");
@@ -359,53 +2102,20 @@ void loadSellerPrices() {
     int sellerID;
     double rateBelow300, rateAbove300;
     while (fscanf(file, "%d %lf %lf", &sellerID, &rateBelow300, &rateAbove300) == 3) {
-        Seller* current = seller_head;
-        int found = 0;
-        while (current) {
-            if (current->sellerID == sellerID) {
-                current->rateBelow300 = rateBelow300;
-                current->rateAbove300 = rateAbove300;
-                found = 1;
-                break;
-            }
-            current = current->next;
-        }
-        if (!found) {
-            Seller* newSeller = (Seller*)malloc(sizeof(Seller));
-            if (!newSeller) {
-                printf("Memory allocation failed for seller.\n");
-                exit(1);
-            }
-            newSeller->sellerID = sellerID;
-            newSeller->rateBelow300 = rateBelow300;
-            newSeller->rateAbove300 = rateAbove300;
-            newSeller->numTransactions = 0;
-            newSeller->totalRevenue = 0.0;  
-            newSeller->regularBuyers = NULL; 
-            newSeller->transactionTree = NULL; 
-            newSeller->next = seller_head;
-            seller_head = newSeller;
+        Seller* current = findSeller(sellerID);
+        if (current) {
+            current->rateBelow300 = rateBelow300;
+            current->rateAbove300 = rateAbove300;
+        } else {
+            addSeller(sellerID, rateBelow300, rateAbove300);
             printf("Loaded seller ID: %d with rates %.2f/%.2f\n", sellerID, rateBelow300, rateAbove300);
         }
     }
     fclose(file);
 }
 
-void saveSellerPrices() {
-    FILE *file = fopen(SELLER_PRICES_FILE, "w");
-    if (!file) {
-        printf("Error opening file for saving prices.\n");
-        return;
-    }
-    Seller* current = seller_head;
-    while (current) {
-        fprintf(file, "%d %.2lf %.2lf\n", current->sellerID, current->rateBelow300, current->rateAbove300);
-        current = current->next;
-    }
-    fclose(file);
-}
-
-void splitLeafNode(BPTreeNode** root, BPTreeNode* node, BPTreeNode* parent) {
+void splitLeafNode(BPTreeNode** root, BPTreePath* path, int level) {
+    BPTreeNode* node = path->nodes[level];
     int mid = (ORDER - 1) / 2;
     BPTreeNode* newNode = createBPTreeNode(1); 
     for (int i = mid; i < ORDER - 1; i++) {
@@ -416,10 +2126,8 @@ void splitLeafNode(BPTreeNode** root, BPTreeNode* node, BPTreeNode* parent) {
         node->records[i] = NULL;
     }
     node->numKeys = mid;
-    newNode->next = node->next;
-    node->next = newNode;
-    int promoteKey = newNode->keys[0];
-    if (parent == NULL) {
+    BPKey promoteKey = newNode->keys[0];
+    if (level == 0) {
         BPTreeNode* newRoot = createBPTreeNode(0);
         newRoot->keys[0] = promoteKey;
         newRoot->children[0] = node;
@@ -427,14 +2135,15 @@ void splitLeafNode(BPTreeNode** root, BPTreeNode* node, BPTreeNode* parent) {
         newRoot->numKeys = 1;
         *root = newRoot;
     } else {
-        insertInternalNode(root, promoteKey, newNode, parent);
+        insertInternalNode(root, promoteKey, newNode, path, level - 1);
     }
 }
 
-void splitInternalNode(BPTreeNode** root, BPTreeNode* node, BPTreeNode* parent) {
+void splitInternalNode(BPTreeNode** root, BPTreePath* path, int level) {
+    BPTreeNode* node = path->nodes[level];
     int mid = (ORDER - 1) / 2;
     BPTreeNode* newNode = createBPTreeNode(0);
-    int promoteKey = node->keys[mid];
+    BPKey promoteKey = node->keys[mid];
     for (int i = mid + 1; i < ORDER - 1; i++) {
         newNode->keys[i - (mid + 1)] = node->keys[i];
         newNode->numKeys++;
@@ -445,7 +2154,7 @@ void splitInternalNode(BPTreeNode** root, BPTreeNode* node, BPTreeNode* parent)
         node->children[i] = NULL;
     }
     node->numKeys = mid;
-    if (parent == NULL) {
+    if (level == 0) {
         BPTreeNode* newRoot = createBPTreeNode(0);
         newRoot->keys[0] = promoteKey;
         newRoot->children[0] = node;
@@ -453,17 +2162,14 @@ void splitInternalNode(BPTreeNode** root, BPTreeNode* node, BPTreeNode* parent)
         newRoot->numKeys = 1;
         *root = newRoot;
     } else {
-        insertInternalNode(root, promoteKey, newNode, parent);
+        insertInternalNode(root, promoteKey, newNode, path, level - 1);
     }
 }
 
-void insertInternalNode(BPTreeNode** root, int key, BPTreeNode* rightChild, BPTreeNode* node) {
-    int pos;
-    for (pos = 0; pos < node->numKeys; pos++) {
-        if (key < node->keys[pos]) {
-            break;
-        }
-    }
+void insertInternalNode(BPTreeNode** root, BPKey key, BPTreeNode* rightChild, BPTreePath* path, int level) {
+    BPTreeNode* node = path->nodes[level];
+    // The child that split sits at childIdx, so the separator goes right after it
+    int pos = path->childIdx[level];
     for (int i = node->numKeys; i > pos; i--) {
         node->keys[i] = node->keys[i-1];
     }
@@ -474,99 +2180,101 @@ void insertInternalNode(BPTreeNode** root, int key, BPTreeNode* rightChild, BPTr
     node->children[pos+1] = rightChild;
     node->numKeys++;
     if (node->numKeys == ORDER - 1) {
-        if (node == *root) {
-            splitInternalNode(root, node, NULL);
-            return;
-        }
-        BPTreeNode* parent = NULL;
-        BPTreeNode* cursor = *root;
-        BPTreeNode* stack[100];
-        int stackTop = -1;
-        stackTop++;
-        stack[stackTop] = cursor;
-        while (stackTop >= 0) {
-            cursor = stack[stackTop];
-            stackTop--;
-            for (int i = 0; i <= cursor->numKeys; i++) {
-                if (cursor->children[i] == node) {
-                    parent = cursor;
-                    stackTop = -1;
-                    break;
-                }
-                if (!cursor->isLeaf && cursor->children[i] != NULL) {
-                    stackTop++;
-                    stack[stackTop] = cursor->children[i];
-                }
-            }
-        }
-        if (parent != NULL) {
-            splitInternalNode(root, node, parent);
-        } else {
-            printf("Warning: Parent not found for internal node during split.\n");
-            splitInternalNode(root, node, NULL);
-        }
+        splitInternalNode(root, path, level);
     }
 }
 
-void insertTransactionIntoBPTree(BPTreeNode** root, Transaction* t) {
+/* Descends from the root to the leaf that should hold key, recording every node and
+   the child index taken so splits and merges can walk back up without a parent search. */
+BPTreeNode* findLeafWithPath(BPTreeNode* root, BPKey key, BPTreePath* path) {
+    BPTreeNode* cursor = root;
+    path->depth = 0;
+    while (!cursor->isLeaf) {
+        int i = nodeUpperBound(cursor->keys, cursor->numKeys, key);
+        path->nodes[path->depth] = cursor;
+        path->childIdx[path->depth] = i;
+        path->depth++;
+        cursor = cursor->children[i];
+    }
+    path->nodes[path->depth] = cursor;
+    path->childIdx[path->depth] = -1;
+    path->depth++;
+    return cursor;
+}
+
+void insertRecordIntoBPTree(BPTreeNode** root, BPKey key, Transaction* record) {
     if (!*root) {
         *root = createBPTreeNode(1);
-        (*root)->keys[0] = t->transactionID;
-        (*root)->records[0] = t;
+        (*root)->keys[0] = key;
+        (*root)->records[0] = record;
         (*root)->numKeys = 1;
         return;
     }
-    BPTreeNode* cursor = *root;
-    BPTreeNode* parents[100]; 
-    int parentIndex = -1;
-    while (!cursor->isLeaf) {
-        parentIndex++;
-        parents[parentIndex] = cursor;
-        
-        int i;
-        for (i = 0; i < cursor->numKeys; i++) {
-            if (t->transactionID < cursor->keys[i]) {
-                break;
-            }
-        }
-        cursor = cursor->children[i];
-    }
-    int pos;
-    for (pos = 0; pos < cursor->numKeys; pos++) {
-        if (t->transactionID < cursor->keys[pos]) {
-            break;
-        }
-    }
+    BPTreePath path;
+    findLeafWithPath(*root, key, &path);
+    makePathWritable(root, &path);
+    insertIntoLeafOnPath(root, &path, key, record);
+}
+
+// Adds key to the leaf that ends path, splitting upward as far as the path overflows
+void insertIntoLeafOnPath(BPTreeNode** root, BPTreePath* path, BPKey key, Transaction* record) {
+    BPTreeNode* cursor = path->nodes[path->depth - 1];
+    int pos = nodeUpperBound(cursor->keys, cursor->numKeys, key);
     for (int i = cursor->numKeys; i > pos; i--) {
         cursor->keys[i] = cursor->keys[i-1];
         cursor->records[i] = cursor->records[i-1];
     }
-    cursor->keys[pos] = t->transactionID;
-    cursor->records[pos] = t;
+    cursor->keys[pos] = key;
+    cursor->records[pos] = record;
     cursor->numKeys++;
     if (cursor->numKeys == ORDER - 1) {
-        if (parentIndex == -1) {
-            splitLeafNode(root, cursor, NULL);
-        } else {
-            splitLeafNode(root, cursor, parents[parentIndex]);
-        }
+        splitLeafNode(root, path, path->depth - 1);
     }
 }
 
-void insertTransaction(Transaction* t) {
+void insertTransactionIntoBPTree(BPTreeNode** root, Transaction* t) {
+    insertRecordIntoBPTree(root, t->transactionID, t);
+}
+
+/* Logs t and adds it to every index. Takes ownership of t: it is released unless the
+   insert went through. The log comes first, so a failed append changes nothing. */
+ChangeStatus applyInsert(Transaction* t) {
     if (findTransactionInBPTree(globalTransactionTree, t->transactionID)) {
-        printf("Error: Transaction with ID %d already exists. Cannot create duplicate transactions.\n", t->transactionID);
-        free(t);
-        return;
+        releaseTransaction(t);
+        return CHANGE_DUPLICATE_ID;
     }
     
     Seller* seller = findOrCreateSeller(t->sellerID);
-    Buyer* buyer = findOrCreateBuyer(t->buyerID);
+    if (!seller) {
+        releaseTransaction(t);
+        return transactionLog.failed ? CHANGE_LOG_FAILED : CHANGE_UNKNOWN_SELLER;
+    }
     
     t->pricePerKwh = (t->energyAmount <= 300) ? seller->rateBelow300 : seller->rateAbove300;
     t->totalPrice = t->energyAmount * t->pricePerKwh;
+    // Log first, so a failed append leaves memory untouched
+    if (appendTransactionRecord(&transactionLog, t) != 0) {
+        releaseTransaction(t);
+        return CHANGE_LOG_FAILED;
+    }
     // Insert into global transaction tree
     insertTransactionIntoBPTree(&globalTransactionTree, t);
+    insertRecordIntoBPTree(&timeIndexTree, transactionTimeKey(t), t);
+    insertRecordIntoBPTree(&energyIndexTree, transactionEnergyKey(t), t);
+    storeTotals.transactions++;
+    storeTotals.revenue += t->totalPrice;
+    storeTotals.energy += t->energyAmount;
+    adjustRollups(t, 1);
+    // Buyer totals and the leaderboard stay global, with or without shards
+    Buyer* buyer = findOrCreateBuyer(t->buyerID);
+    buyer->numTransactions++;
+    adjustBuyerEnergy(buyer, t->energyAmount);
+    if (shardCount > 0) {
+        addShardedTrade(seller, t);
+        noteWalRecord();
+        return CHANGE_APPLIED;
+    }
+    
     // Also insert references to the same transaction into seller's and buyer's trees
     // Note: We're not creating new transaction objects, just pointing to the same one
     insertTransactionIntoEntityTree(&seller->transactionTree, t);
@@ -574,24 +2282,28 @@ void insertTransaction(Transaction* t) {
     
     seller->numTransactions++;
     seller->totalRevenue += t->totalPrice;
-    buyer->numTransactions++;
-    buyer->totalEnergyPurchased += t->energyAmount;
-    
-    addRegularBuyer(seller, buyer);
     
-    FILE *file = fopen(TRANSACTION_FILE, "a");
-    if (!file) {
-        printf("Error opening transaction file for appending.\n");
-        return;
+    addRegularBuyer(&pairCounter, seller, buyer, adjustPairCount(&pairCounter, t->sellerID, t->buyerID, 1));
+    noteWalRecord();
+    return CHANGE_APPLIED;
+}
+
+void insertTransaction(Transaction* t) {
+    int transactionID = t->transactionID;
+    int sellerID = t->sellerID;
+    switch (applyInsert(t)) {
+        case CHANGE_DUPLICATE_ID:
+            printf("Error: Transaction with ID %d already exists. Cannot create duplicate transactions.\n", transactionID);
+            break;
+        case CHANGE_UNKNOWN_SELLER:
+            printf("Error: Seller ID %d is not registered and new sellers are rejected.\n", sellerID);
+            break;
+        case CHANGE_LOG_FAILED:
+            printf("Error appending transaction %d to the write-ahead log.\n", transactionID);
+            break;
+        default:
+            printf("Transaction added successfully! ID: %d\n", transactionID);
     }
-    
-    fprintf(file, "%d,%d,%d,%.2f,%.2f,%.2f,%s\n", 
-            t->transactionID, t->buyerID, t->sellerID, 
-            t->energyAmount, t->pricePerKwh, t->totalPrice, 
-            t->timestamp);
-    
-    fclose(file);
-    printf("Transaction added successfully! ID: %d\n", t->transactionID);
 }
 
 void insertTransactionIntoEntityTree(BPTreeNode** entityTree, Transaction* t) {
@@ -604,1121 +2316,5351 @@ int isValidDateTimeFormat(const char* dateTime) {
     if (sscanf(dateTime, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second) != 6) {
         return 0;
     }
-    // Check reasonable ranges for date
-    if (year < 1900 || year > 2100 || month < 1 || month > 12 || day < 1 || day > 31) {
-        return 0;
-    }
-    // Check reasonable ranges for time
-    if (hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59) {
-        return 0;
-    }
-    // Additional checks for specific months
-    if ((month == 4 || month == 6 || month == 9 || month == 11) && day > 30) {
-        return 0;
-    }
-    if (month == 2) {
-        // Check for leap year
-        int isLeapYear = (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0));
-        if (day > (isLeapYear ? 29 : 28)) {
-            return 0;
-        }
-    }
-    return 1;
+    return isValidCivilTime(year, month, day, hour, minute, second);
 }
 
-int isDateInRange(const char* date, const char* startDate, const char* endDate) {
-    struct tm tm_date = {0}, tm_start = {0}, tm_end = {0};
-    
-    if (sscanf(date, "%d-%d-%d", &tm_date.tm_year, &tm_date.tm_mon, &tm_date.tm_mday) != 3) {
-        return 0;
-    }
-    if (sscanf(startDate, "%d-%d-%d", &tm_start.tm_year, &tm_start.tm_mon, &tm_start.tm_mday) != 3) {
-        return 0;
-    }
-    if (sscanf(endDate, "%d-%d-%d", &tm_end.tm_year, &tm_end.tm_mon, &tm_end.tm_mday) != 3) {
-        return 0;
-    }
-    tm_date.tm_year -= 1900;
-    tm_start.tm_year -= 1900;
-    tm_end.tm_year -= 1900;
-    tm_date.tm_mon -= 1;
-    tm_start.tm_mon -= 1;
-    tm_end.tm_mon -= 1;
-    time_t t_date = mktime(&tm_date);
-    time_t t_start = mktime(&tm_start);
-    time_t t_end = mktime(&tm_end);
-    return (t_date >= t_start && t_date <= t_end);
+/* Time index keys order by timestamp and then by transaction ID. IDs are kept in
+   [0, TIME_KEY_ID_SPAN), which leaves room for any year isValidCivilTime accepts. */
+#define TIME_KEY_ID_SPAN 2147483648LL
+
+BPKey timeIndexKey(long long epoch, int transactionID) {
+    return (BPKey)epoch * TIME_KEY_ID_SPAN + transactionID;
 }
 
-void findTransactionsByTimeRange(char* startDate, char* endDate) {
-    if (!globalTransactionTree) {
-        printf("No transactions available.\n");
-        return;
-    }
+BPKey transactionIdKey(const Transaction* t) {
+    return t->transactionID;
+}
 
-    printf("\n===== Transactions from %s to %s =====\n", startDate, endDate);
+BPKey transactionTimeKey(const Transaction* t) {
+    return timeIndexKey(t->epoch, t->transactionID);
+}
 
-    Table table;
-    init_table(&table);
-    add_table_column(&table, "Transaction ID");
-    add_table_column(&table, "Buyer ID");
-    add_table_column(&table, "Seller ID");
-    add_table_column(&table, "Energy (kWh)");
-    add_table_column(&table, "Price/kWh");
-    add_table_column(&table, "Total Price");
-    add_table_column(&table, "Timestamp");
-
-    BPTreeNode* cursor = globalTransactionTree;
-    while (!cursor->isLeaf) {
-        cursor = cursor->children[0];
-    }
+/* Energy index keys order by energy in hundredths of a kWh (the precision the
+   transaction file keeps), then by transaction ID. Amounts beyond about 42.9M kWh
+   are clamped so the key cannot overflow. */
+#define ENERGY_KEY_MAX_CENTS 4294967295LL
 
-    int found = 0;
-    while (cursor) {
-        for (int i = 0; i < cursor->numKeys; i++) {
-            Transaction* t = cursor->records[i];
-            
-            if (isDateInRange(t->timestamp, startDate, endDate)) {
-                char id[20], buyer[20], seller[20], energy[20], price[20], total[20];
-                snprintf(id, sizeof(id), "%d", t->transactionID);
-                snprintf(buyer, sizeof(buyer), "%d", t->buyerID);
-                snprintf(seller, sizeof(seller), "%d", t->sellerID);
-                snprintf(energy, sizeof(energy), "%.2f", t->energyAmount);
-                snprintf(price, sizeof(price), "%.2f", t->pricePerKwh);
-                snprintf(total, sizeof(total), "%.2f", t->totalPrice);
-                
-                add_table_row(&table, id, buyer, seller, energy, price, total, t->timestamp);
-                found++;
-            }
-        }
-        cursor = cursor->next;
-    }
+long long energyToCents(double energyAmount) {
+    double cents = energyAmount * 100.0;
+    if (cents > ENERGY_KEY_MAX_CENTS) return ENERGY_KEY_MAX_CENTS;
+    if (cents < -ENERGY_KEY_MAX_CENTS) return -ENERGY_KEY_MAX_CENTS;
+    return (long long)(cents < 0 ? cents - 0.5 : cents + 0.5);
+}
 
-    if (found) {
-        print_table(&table);
-    } else {
-        printf("No transactions found in the specified time period.\n");
-    }
+BPKey energyIndexKey(long long cents, int transactionID) {
+    return (BPKey)cents * TIME_KEY_ID_SPAN + transactionID;
+}
 
-    free_table(&table);
+BPKey transactionEnergyKey(const Transaction* t) {
+    return energyIndexKey(energyToCents(t->energyAmount), t->transactionID);
 }
 
-void calculateTotalRevenueBySellerID(int sellerID) {
-    Seller* seller = seller_head;
-    int found = 0;
-    
-    while (seller) {
-        if (seller->sellerID == sellerID) {
-            // Initialize table
-            Table table;
-            init_table(&table);
-            add_table_column(&table, "Metric");
-            add_table_column(&table, "Value");
-            
-            // Convert all values to strings before adding to table
-            char sid[20], totalRev[50], totalTrans[50], avgRev[50];
-            snprintf(sid, sizeof(sid), "%d", sellerID);
-            snprintf(totalRev, sizeof(totalRev), "$%.2f", seller->totalRevenue);
-            snprintf(totalTrans, sizeof(totalTrans), "%d", seller->numTransactions);
-            
-            // Add rows to table
-            add_table_row(&table, "Seller ID", sid);
-            add_table_row(&table, "Total Revenue", totalRev);
-            add_table_row(&table, "Total Transactions", totalTrans);
-            
-            if (seller->numTransactions > 0) {
-                snprintf(avgRev, sizeof(avgRev), "$%.2f", 
-                        seller->totalRevenue / seller->numTransactions);
-                add_table_row(&table, "Avg Revenue/Transaction", avgRev);
-            }
-            
-            // Print table
-            printf("\n===== Revenue Summary for Seller ID %d =====\n", sellerID);
-            print_table(&table);
-            free_table(&table);
-            
-            found = 1;
-            break;
+/* ============== RESULT OUTPUT ============== */
+/* Query results are written in the format picked with --format:
+     table   boxed tables for reading at the terminal (the menu's default)
+     csv     one line per record, led by its kind: txn, revenue, buyer, pair or window
+     jsonl   one JSON object per record, whose "type" member names its kind
+     binary  per result set, a ResultSetHeader followed by fixed-width records in
+             host byte order, so a reader can map them straight onto the structs below
+   Only table output goes through the Table layer; the others are written straight
+   from the records. Headings and notices go to stderr unless the output is a table. */
+typedef enum { OUTPUT_TABLE, OUTPUT_CSV, OUTPUT_JSONL, OUTPUT_BINARY } OutputFormat;
+typedef enum {
+    RESULT_TRANSACTIONS = 1,
+    RESULT_SELLER_REVENUE = 2,
+    RESULT_BUYER_RANKS = 3,
+    RESULT_PAIRS = 4,
+    RESULT_WINDOW = 5
+} ResultKind;
+
+OutputFormat outputFormat = OUTPUT_TABLE;
+
+#define RESULT_MAGIC "ETRS"
+
+typedef struct {
+    char magic[4];
+    uint16_t kind;         // ResultKind
+    uint16_t recordBytes;  // size of each record that follows
+    uint64_t count;        // records that follow
+} ResultSetHeader;
+
+typedef struct {
+    int64_t epoch;
+    double energyAmount;
+    double pricePerKwh;
+    double totalPrice;
+    int32_t transactionID;
+    int32_t buyerID;
+    int32_t sellerID;
+    int32_t reserved;
+} TransactionResultRecord;
+
+typedef struct {
+    double totalRevenue;
+    int32_t sellerID;
+    int32_t numTransactions;
+} SellerRevenueRecord;
+
+typedef struct {
+    double energyPurchased;
+    int32_t rank;
+    int32_t buyerID;
+    int32_t numTransactions;
+    int32_t reserved;
+} BuyerRankRecord;
+
+typedef struct {
+    int32_t sellerID;
+    int32_t buyerID;
+    int32_t transactionCount;
+    int32_t reserved;
+} PairResultRecord;
+
+typedef struct {
+    int64_t startEpoch;
+    int64_t endEpoch;  // exclusive
+    double revenue;
+    double energy;
+    int32_t entityID;
+    int32_t trades;
+    int32_t isBuyer;
+    int32_t reserved;
+} WindowResultRecord;
+
+_Static_assert(sizeof(ResultSetHeader) == 16, "result set header layout changed");
+_Static_assert(sizeof(TransactionResultRecord) == 48, "transaction record layout changed");
+_Static_assert(sizeof(SellerRevenueRecord) == 16, "seller revenue record layout changed");
+_Static_assert(sizeof(BuyerRankRecord) == 24, "buyer rank record layout changed");
+_Static_assert(sizeof(PairResultRecord) == 16, "pair record layout changed");
+_Static_assert(sizeof(WindowResultRecord) == 48, "window record layout changed");
+
+typedef struct {
+    OutputFormat format;
+    ResultKind kind;
+    long long rows;
+    OutputBuffer* out;    // where csv, jsonl and binary go
+    OutputBuffer stdoutBuffer;
+    Table table;          // table output only
+    const Table* layout;  // scan workers: table rows go to out at these fixed widths
+} ResultWriter;
+
+// Headings and notices around a result; kept off stdout when it carries machine output
+void printNotice(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(outputFormat == OUTPUT_TABLE ? stdout : stderr, format, args);
+    va_end(args);
+}
+
+int parseOutputFormat(const char* text, OutputFormat* format) {
+    static const char* const names[] = { "table", "csv", "jsonl", "binary" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(text, names[i]) == 0) {
+            *format = (OutputFormat)i;
+            return 1;
         }
-        seller = seller->next;
-    }
-    
-    if (!found) {
-        printf("Seller ID %d not found.\n", sellerID);
     }
+    return 0;
 }
 
-void calculateTotalRevenueForAllSellers() {
-    Seller* seller = seller_head;
-    if (!seller) {
-        printf("No sellers found in the system.\n");
+/* Starts a result set of count records in outputFormat. Only binary output uses the
+   count, and it must be exact. out receives machine formats; NULL means stdout. */
+void beginResult(ResultWriter* writer, ResultKind kind, long long count, OutputBuffer* out) {
+    writer->format = outputFormat;
+    writer->kind = kind;
+    writer->rows = 0;
+    writer->out = out;
+    writer->layout = NULL;
+    if (writer->format == OUTPUT_TABLE) {
+        Table* table = &writer->table;
+        init_table(table);
+        if (kind == RESULT_TRANSACTIONS) {
+            add_transaction_table_columns(table);
+        } else if (kind == RESULT_SELLER_REVENUE) {
+            add_table_column(table, "Seller ID", 11);
+            add_table_column(table, "Total Revenue", MAX_COL_WIDTH);
+            add_table_column(table, "Transactions", 11);
+            add_table_column(table, "Avg Revenue", MAX_COL_WIDTH);
+        } else if (kind == RESULT_BUYER_RANKS) {
+            add_table_column(table, "Rank", 11);
+            add_table_column(table, "Buyer ID", 11);
+            add_table_column(table, "Energy Purchased", MAX_COL_WIDTH);
+            add_table_column(table, "Transactions", 11);
+        } else if (kind == RESULT_PAIRS) {
+            add_table_column(table, "Seller ID", 11);
+            add_table_column(table, "Buyer ID", 11);
+            add_table_column(table, "Transaction Count", 11);
+        } else {
+            add_table_column(table, "Role", 6);
+            add_table_column(table, "ID", 11);
+            add_table_column(table, "From", 19);
+            add_table_column(table, "To", 19);
+            add_table_column(table, "Transactions", 11);
+            add_table_column(table, "Energy", MAX_COL_WIDTH);
+            add_table_column(table, "Revenue", MAX_COL_WIDTH);
+        }
         return;
     }
+    if (!writer->out) {
+        initOutputBuffer(&writer->stdoutBuffer, stdout);
+        writer->out = &writer->stdoutBuffer;
+    }
+    if (writer->format == OUTPUT_BINARY) {
+        static const uint16_t recordBytes[] = { 0, sizeof(TransactionResultRecord), sizeof(SellerRevenueRecord),
+                                                sizeof(BuyerRankRecord), sizeof(PairResultRecord),
+                                                sizeof(WindowResultRecord) };
+        ResultSetHeader header;
+        memcpy(header.magic, RESULT_MAGIC, sizeof(header.magic));
+        header.kind = (uint16_t)kind;
+        header.recordBytes = recordBytes[kind];
+        header.count = (uint64_t)(count > 0 ? count : 0);
+        outputWrite(writer->out, &header, sizeof(header));
+    }
+}
 
-    Table table;
-    init_table(&table);
-    add_table_column(&table, "Seller ID");
-    add_table_column(&table, "Total Revenue");
-    add_table_column(&table, "Transactions");
-    add_table_column(&table, "Avg Revenue");
+void resultTransaction(ResultWriter* writer, const Transaction* t) {
+    writer->rows++;
+    if (writer->format == OUTPUT_TABLE) {
+        if (writer->layout) {
+            char cells[TRANSACTION_CELLS][TRANSACTION_CELL_BYTES];
+            const char* row[TRANSACTION_CELLS];
+            format_transaction_cells(t, cells, row);
+            render_table_row(writer->layout, writer->out, row);
+        } else {
+            add_transaction_table_row(&writer->table, t);
+        }
+        return;
+    }
+    if (writer->format == OUTPUT_BINARY) {
+        TransactionResultRecord record = { t->epoch, t->energyAmount, t->pricePerKwh, t->totalPrice,
+                                           t->transactionID, t->buyerID, t->sellerID, 0 };
+        outputWrite(writer->out, &record, sizeof(record));
+        return;
+    }
+    char timestamp[30];
+    formatTimestamp(t->epoch, timestamp, sizeof(timestamp));
+    if (writer->format == OUTPUT_CSV) {
+        outputPrintf(writer->out, "txn,%d,%d,%d,%.2f,%.2f,%.2f,%s\n", t->transactionID, t->buyerID,
+                     t->sellerID, t->energyAmount, t->pricePerKwh, t->totalPrice, timestamp);
+    } else {
+        outputPrintf(writer->out, "{\"type\":\"txn\",\"id\":%d,\"buyer\":%d,\"seller\":%d,\"energy\":%.2f,"
+                     "\"price\":%.2f,\"total\":%.2f,\"timestamp\":\"%s\"}\n", t->transactionID, t->buyerID,
+                     t->sellerID, t->energyAmount, t->pricePerKwh, t->totalPrice, timestamp);
+    }
+}
 
-    double grandTotal = 0.0;
-    int totalTransactions = 0;
-    
-    while (seller) {
-        char id[20], revenue[20], trans[20], avg[20];
+void resultSellerRevenue(ResultWriter* writer, const Seller* seller) {
+    writer->rows++;
+    if (writer->format == OUTPUT_TABLE) {
+        char id[20], revenue[40], trans[20], avg[40];
         snprintf(id, sizeof(id), "%d", seller->sellerID);
         snprintf(revenue, sizeof(revenue), "$%.2f", seller->totalRevenue);
         snprintf(trans, sizeof(trans), "%d", seller->numTransactions);
-        snprintf(avg, sizeof(avg), "$%.2f", 
+        snprintf(avg, sizeof(avg), "$%.2f",
             seller->numTransactions > 0 ? seller->totalRevenue / seller->numTransactions : 0.0);
-        
-        add_table_row(&table, id, revenue, trans, avg);
-        
-        grandTotal += seller->totalRevenue;
-        totalTransactions += seller->numTransactions;
-        seller = seller->next;
+        add_table_row(&writer->table, id, revenue, trans, avg);
+    } else if (writer->format == OUTPUT_BINARY) {
+        SellerRevenueRecord record = { seller->totalRevenue, seller->sellerID, seller->numTransactions };
+        outputWrite(writer->out, &record, sizeof(record));
+    } else if (writer->format == OUTPUT_CSV) {
+        outputPrintf(writer->out, "revenue,%d,%.2f,%d\n", seller->sellerID, seller->totalRevenue,
+                     seller->numTransactions);
+    } else {
+        outputPrintf(writer->out, "{\"type\":\"revenue\",\"seller\":%d,\"total\":%.2f,\"transactions\":%d}\n",
+                     seller->sellerID, seller->totalRevenue, seller->numTransactions);
     }
-
-    // Add summary row
-    char grand[20], totalTrans[20], grandAvg[20];
-    snprintf(grand, sizeof(grand), "$%.2f", grandTotal);
-    snprintf(totalTrans, sizeof(totalTrans), "%d", totalTransactions);
-    snprintf(grandAvg, sizeof(grandAvg), "$%.2f",
-        totalTransactions > 0 ? grandTotal / totalTransactions : 0.0);
-    
-    add_table_row(&table, "TOTAL", grand, totalTrans, grandAvg);
-
-    printf("\n===== Revenue Summary for All Sellers =====\n");
-    print_table(&table);
-    free_table(&table);
 }
 
-void merge(Transaction** arr, int l, int m, int r) {
-    int n1 = m - l + 1;
-    int n2 = r - m;
-    Transaction** L = malloc(n1 * sizeof(Transaction*));
-    Transaction** R = malloc(n2 * sizeof(Transaction*));
-    for (int i = 0; i < n1; i++) L[i] = arr[l + i];
-    for (int i = 0; i < n2; i++) R[i] = arr[m + 1 + i];
-    int i = 0, j = 0, k = l;
-    while (i < n1 && j < n2) {
-        if (L[i]->energyAmount <= R[j]->energyAmount)
-            arr[k++] = L[i++];
-        else
-            arr[k++] = R[j++];
+// rank is 1-based
+void resultBuyerRank(ResultWriter* writer, int rank, const Buyer* buyer) {
+    writer->rows++;
+    if (writer->format == OUTPUT_TABLE) {
+        char position[20], id[20], energy[40], trans[20];
+        snprintf(position, sizeof(position), "%d", rank);
+        snprintf(id, sizeof(id), "%d", buyer->buyerID);
+        snprintf(energy, sizeof(energy), "%.2f kWh", buyer->totalEnergyPurchased);
+        snprintf(trans, sizeof(trans), "%d", buyer->numTransactions);
+        add_table_row(&writer->table, position, id, energy, trans);
+    } else if (writer->format == OUTPUT_BINARY) {
+        BuyerRankRecord record = { buyer->totalEnergyPurchased, rank, buyer->buyerID, buyer->numTransactions, 0 };
+        outputWrite(writer->out, &record, sizeof(record));
+    } else if (writer->format == OUTPUT_CSV) {
+        outputPrintf(writer->out, "buyer,%d,%d,%.2f,%d\n", rank, buyer->buyerID, buyer->totalEnergyPurchased,
+                     buyer->numTransactions);
+    } else {
+        outputPrintf(writer->out, "{\"type\":\"buyer\",\"rank\":%d,\"buyer\":%d,\"energy\":%.2f,\"transactions\":%d}\n",
+                     rank, buyer->buyerID, buyer->totalEnergyPurchased, buyer->numTransactions);
     }
-    while (i < n1) arr[k++] = L[i++];
-    while (j < n2) arr[k++] = R[j++];
-    free(L);
-    free(R);
 }
 
-void mergeSort(Transaction** arr, int l, int r) {
-    if (l < r) {
-        int m = l + (r - l) / 2;
-        mergeSort(arr, l, m);
-        mergeSort(arr, m + 1, r);
-        merge(arr, l, m, r);
+void resultPair(ResultWriter* writer, const SellerBuyerPair* pair) {
+    writer->rows++;
+    if (writer->format == OUTPUT_TABLE) {
+        char seller[20], buyer[20], count[20];
+        snprintf(seller, sizeof(seller), "%d", pair->sellerID);
+        snprintf(buyer, sizeof(buyer), "%d", pair->buyerID);
+        snprintf(count, sizeof(count), "%d", pair->transactionCount);
+        add_table_row(&writer->table, seller, buyer, count);
+    } else if (writer->format == OUTPUT_BINARY) {
+        PairResultRecord record = { pair->sellerID, pair->buyerID, pair->transactionCount, 0 };
+        outputWrite(writer->out, &record, sizeof(record));
+    } else if (writer->format == OUTPUT_CSV) {
+        outputPrintf(writer->out, "pair,%d,%d,%d\n", pair->sellerID, pair->buyerID, pair->transactionCount);
+    } else {
+        outputPrintf(writer->out, "{\"type\":\"pair\",\"seller\":%d,\"buyer\":%d,\"transactions\":%d}\n",
+                     pair->sellerID, pair->buyerID, pair->transactionCount);
     }
 }
 
-void findTransactionsByEnergyRange(double minEnergy, double maxEnergy) {
-    if (!globalTransactionTree) {
-        printf("No transactions available.\n");
+// Table, csv and jsonl show the window's last second as its end; binary keeps it exclusive
+void resultWindow(ResultWriter* writer, const RollupWindow* window) {
+    writer->rows++;
+    const char* role = window->isBuyer ? "buyer" : "seller";
+    if (writer->format == OUTPUT_BINARY) {
+        WindowResultRecord record = { window->startEpoch, window->endEpoch, window->revenue, window->energy,
+                                      window->entityID, (int32_t)window->trades, window->isBuyer, 0 };
+        outputWrite(writer->out, &record, sizeof(record));
         return;
     }
-
-    // Initialize table
-    Table table;
-    init_table(&table);
-    add_table_column(&table, "Transaction ID");
-    add_table_column(&table, "Buyer ID");
-    add_table_column(&table, "Seller ID");
-    add_table_column(&table, "Energy (kWh)");
-    add_table_column(&table, "Price/kWh");
-    add_table_column(&table, "Total Price");
-    add_table_column(&table, "Timestamp");
-
-    printf("\n===== Transactions with Energy Amount between %.2f kWh and %.2f kWh (Ascending Order) =====\n", 
-           minEnergy, maxEnergy);
-
-    TransactionArray transArray;
-    transArray.capacity = 100;  
-    transArray.count = 0;
-    transArray.transactions = (Transaction**)malloc(transArray.capacity * sizeof(Transaction*));
-    if (!transArray.transactions) {
-        printf("Memory allocation failed.\n");
-        return;
+    char from[30], to[30];
+    formatTimestamp(window->startEpoch, from, sizeof(from));
+    formatTimestamp(window->endEpoch - 1, to, sizeof(to));
+    if (writer->format == OUTPUT_TABLE) {
+        char id[20], trades[24], energy[40], revenue[40];
+        snprintf(id, sizeof(id), "%d", window->entityID);
+        snprintf(trades, sizeof(trades), "%lld", window->trades);
+        snprintf(energy, sizeof(energy), "%.2f kWh", window->energy);
+        snprintf(revenue, sizeof(revenue), "$%.2f", window->revenue);
+        add_table_row(&writer->table, role, id, from, to, trades, energy, revenue);
+    } else if (writer->format == OUTPUT_CSV) {
+        outputPrintf(writer->out, "window,%s,%d,%s,%s,%lld,%.2f,%.2f\n", role, window->entityID, from, to,
+                     window->trades, window->energy, window->revenue);
+    } else {
+        outputPrintf(writer->out, "{\"type\":\"window\",\"role\":\"%s\",\"id\":%d,\"from\":\"%s\",\"to\":\"%s\","
+                     "\"transactions\":%lld,\"energy\":%.2f,\"revenue\":%.2f}\n", role, window->entityID, from, to,
+                     window->trades, window->energy, window->revenue);
     }
+}
 
-    // Collect matching transactions
-    BPTreeNode* cursor = globalTransactionTree;
-    while (!cursor->isLeaf) {
-        cursor = cursor->children[0];
-    }
+/* Finishes the result set and returns its record count. Table output is printed here,
+   and nothing is printed for an empty table. */
+long long endResult(ResultWriter* writer) {
+    if (writer->format == OUTPUT_TABLE) {
+        print_table(&writer->table);
+        free_table(&writer->table);
+    } else if (writer->out == &writer->stdoutBuffer) {
+        freeOutputBuffer(&writer->stdoutBuffer);
+    }
+    return writer->rows;
+}
 
-    while (cursor) {
-        for (int i = 0; i < cursor->numKeys; i++) {
-            Transaction* t = cursor->records[i];
-            if (t->energyAmount >= minEnergy && t->energyAmount <= maxEnergy) {
-                if (transArray.count >= transArray.capacity) {
-                    transArray.capacity *= 2;
-                    Transaction** newArray = (Transaction**)realloc(transArray.transactions, 
-                                                                   transArray.capacity * sizeof(Transaction*));
-                    if (!newArray) {
-                        printf("Memory reallocation failed.\n");
-                        free(transArray.transactions);
-                        free_table(&table);
-                        return;
-                    }
-                    transArray.transactions = newArray;
-                }
-                transArray.transactions[transArray.count++] = t;
-            }
+/* Writes the records from the cursor onwards while their keys stay at or below endKey.
+   leaf is the cursor's leaf. energyBounds, when given, skips records outside [min, max] kWh. */
+long long resultTransactionRange(ResultWriter* writer, BPTreeNode* leaf, BPTreeCursor* cursor, BPKey endKey,
+                                 const double* energyBounds) {
+    long long found = 0;
+    for (; leaf; leaf = nextLeafInBPTree(cursor)) {
+        for (int pos = cursor->pos; pos < leaf->numKeys; pos++) {
+            if (leaf->keys[pos] > endKey) return found;
+            const Transaction* t = leaf->records[pos];
+            if (energyBounds && (t->energyAmount < energyBounds[0] || t->energyAmount > energyBounds[1]))
+                continue;
+            if (writer) resultTransaction(writer, t);
+            found++;
         }
-        cursor = cursor->next;
     }
+    return found;
+}
 
-    // Sort transactions by energy amount
-    mergeSort(transArray.transactions, 0, transArray.count - 1);
+/* ============== PARALLEL SCANS ============== */
+/* Large transaction scans are split into key ranges at internal-node boundaries and
+   the ranges are scanned on a pool of worker threads. Each worker formats its range
+   into a private buffer; the calling thread writes the buffers out in key order, so
+   the output is identical to a single-threaded leaf walk. Only a window of ranges is
+   buffered at once, which keeps memory bounded however long the scan is. Workers
+   only read the trees, and every scan finishes before the caller changes them. */
+#define SCAN_MAX_THREADS 64
+#define SCAN_PARALLEL_MIN_ROWS 65536  // smaller scans stay on the calling thread
+#define SCAN_PARTITION_ROWS 16384     // rough size of each scanned range
+#define SCAN_MAX_PARTITIONS 4096
 
-    // Add transactions to table
-    for (int i = 0; i < transArray.count; i++) {
-        Transaction* t = transArray.transactions[i];
-        char id[20], buyer[20], seller[20], energy[20], price[20], total[20];
-        snprintf(id, sizeof(id), "%d", t->transactionID);
-        snprintf(buyer, sizeof(buyer), "%d", t->buyerID);
-        snprintf(seller, sizeof(seller), "%d", t->sellerID);
-        snprintf(energy, sizeof(energy), "%.2f", t->energyAmount);
-        snprintf(price, sizeof(price), "%.2f", t->pricePerKwh);
-        snprintf(total, sizeof(total), "%.2f", t->totalPrice);
-        
-        add_table_row(&table, id, buyer, seller, energy, price, total, t->timestamp);
-    }
+int scanThreads = 0;  // 0 uses one per online CPU
 
-    // Display results
-    if (transArray.count > 0) {
-        print_table(&table);
-    } else {
-        printf("No transactions found in the specified energy range.\n");
-    }
+typedef struct {
+    BPTreeNode* root;
+    const BPKey* starts;  // range p covers [starts[p], starts[p + 1]), the last ends at high
+    int partitions;
+    BPKey high;
+    const double* energyBounds;
+    OutputFormat format;
+    const Table* layout;  // table output past the sample
+    int countOnly;
+    int window;           // ranges buffered at once; range p uses slot p % window
+    OutputBuffer* buffers;
+    long long* rows;
+    unsigned char* done;  // per range
+    int next;             // next range to hand out
+    int emitted;          // ranges the caller has written out
+} ScanJob;
 
-    // Clean up
-    free(transArray.transactions);
-    free_table(&table);
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // a range can be handed out, or the pool is stopping
+    pthread_cond_t progress;  // a range finished
+    pthread_t* threads;
+    int threadCount;          // workers besides the calling thread
+    int stopping;
+    ScanJob* job;
+    pthread_mutex_t jobLock;  // one job at a time, whichever thread starts it
+} ScanPool;
+
+ScanPool scanPool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, NULL,
+                      PTHREAD_MUTEX_INITIALIZER };
+
+int chooseScanThreads() {
+    int threads = scanThreads;
+    if (threads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (int)online : 1;
+    }
+    return threads > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : threads;
 }
 
-int countTransactionsInTree(BPTreeNode* root) {
-    if (!root) return 0;
-    if (root->isLeaf) {
-        return root->numKeys;
+/* Splits keys [low, high] of the tree into ranges that start at child boundaries.
+   Descends level by level through the children overlapping the range until their
+   subtrees are about SCAN_PARTITION_ROWS each, then groups them into ranges.
+   Returns the number of ranges, 0 for an empty range; scans too small to be worth
+   splitting get one. starts receives the first key of each range, and estimatedRows,
+   when given, a rough record count. */
+int planScan(BPTreeNode* root, BPKey low, BPKey high, int threads, BPKey** starts, double* estimatedRows) {
+    *starts = NULL;
+    if (estimatedRows) *estimatedRows = 0;
+    if (!root || low > high) return 0;
+    int levels = 0;  // levels below the current one
+    for (BPTreeNode* node = root; !node->isLeaf; node = node->children[0]) levels++;
+    // Estimated records under one node of the current level
+    double subtreeRows = (ORDER - 1) * 0.75;
+    for (int i = 0; i < levels; i++) subtreeRows *= ORDER * 0.75;
+
+    int count = 1;
+    BPTreeNode** nodes = (BPTreeNode**)malloc(sizeof(BPTreeNode*));
+    BPKey* spans = (BPKey*)malloc(2 * sizeof(BPKey));  // [first, last] key each node can hold
+    if (!nodes || !spans) {
+        printf("Memory allocation failed for scan plan.\n");
+        exit(1);
     }
-    BPTreeNode* cursor = root;
-    while (!cursor->isLeaf) {
-        cursor = cursor->children[0];
+    nodes[0] = root;
+    spans[0] = low;
+    spans[1] = high;
+    while (levels > 0 && threads > 1) {
+        double wanted = count * subtreeRows / SCAN_PARTITION_ROWS;
+        if (count >= wanted || count >= SCAN_MAX_PARTITIONS) break;
+        int nextCount = 0, nextCapacity = count * ORDER;
+        BPTreeNode** nextNodes = (BPTreeNode**)malloc(nextCapacity * sizeof(BPTreeNode*));
+        BPKey* nextSpans = (BPKey*)malloc(2 * (size_t)nextCapacity * sizeof(BPKey));
+        if (!nextNodes || !nextSpans) {
+            printf("Memory allocation failed for scan plan.\n");
+            exit(1);
+        }
+        for (int n = 0; n < count; n++) {
+            BPTreeNode* node = nodes[n];
+            for (int i = 0; i <= node->numKeys; i++) {
+                BPKey first = i > 0 ? node->keys[i - 1] : spans[2 * n];
+                BPKey last = i < node->numKeys ? node->keys[i] - 1 : spans[2 * n + 1];
+                if (first < low) first = low;
+                if (last > high) last = high;
+                if (first > last) continue;
+                nextNodes[nextCount] = node->children[i];
+                nextSpans[2 * nextCount] = first;
+                nextSpans[2 * nextCount + 1] = last;
+                nextCount++;
+            }
+        }
+        free(nodes);
+        free(spans);
+        nodes = nextNodes;
+        spans = nextSpans;
+        count = nextCount;
+        subtreeRows /= ORDER * 0.75;
+        levels--;
     }
-    int count = 0;
-    while (cursor) {
-        count += cursor->numKeys;
-        cursor = cursor->next;
+
+    double estimate = count * subtreeRows;
+    if (estimatedRows) *estimatedRows = estimate;
+    int partitions = 1;
+    if (threads > 1 && estimate >= SCAN_PARALLEL_MIN_ROWS) {
+        double wanted = estimate / SCAN_PARTITION_ROWS;
+        partitions = wanted < threads ? threads : (int)wanted;
+        if (partitions > count) partitions = count;
+    }
+    *starts = (BPKey*)malloc(partitions * sizeof(BPKey));
+    if (!*starts) {
+        printf("Memory allocation failed for scan plan.\n");
+        exit(1);
     }
-    return count;
+    for (int p = 0; p < partitions; p++) {
+        (*starts)[p] = p == 0 ? low : spans[2 * ((long long)p * count / partitions)];
+    }
+    free(nodes);
+    free(spans);
+    return partitions;
 }
 
-int compareBuyersByEnergyDesc(Buyer* a, Buyer* b) {
-    if (a->totalEnergyPurchased < b->totalEnergyPurchased) return 1;
-    if (a->totalEnergyPurchased > b->totalEnergyPurchased) return -1;
-    return 0;
+void scanPartition(ScanJob* job, int p) {
+    int slot = p % job->window;
+    BPKey high = p + 1 < job->partitions ? job->starts[p + 1] - 1 : job->high;
+    BPTreeCursor cursor;
+    BPTreeNode* leaf = seekBPTree(job->root, job->starts[p], &cursor);
+    if (job->countOnly) {
+        job->rows[slot] = resultTransactionRange(NULL, leaf, &cursor, high, job->energyBounds);
+        return;
+    }
+    ResultWriter writer;
+    writer.format = job->format;
+    writer.kind = RESULT_TRANSACTIONS;
+    writer.rows = 0;
+    writer.out = &job->buffers[slot];
+    writer.layout = job->layout;
+    job->rows[slot] = resultTransactionRange(&writer, leaf, &cursor, high, job->energyBounds);
 }
 
-void merge_buyers(Buyer** arr, int left, int mid, int right) {
-    int n1 = mid - left + 1;
-    int n2 = right - mid;
-    Buyer** L = (Buyer**)malloc(n1 * sizeof(Buyer*));
-    Buyer** R = (Buyer**)malloc(n2 * sizeof(Buyer*));
-    for (int i = 0; i < n1; i++) L[i] = arr[left + i];
-    for (int j = 0; j < n2; j++) R[j] = arr[mid + 1 + j];
-    int i = 0, j = 0, k = left;
-    while (i < n1 && j < n2) {
-        if (compareBuyersByEnergyDesc(L[i], R[j]) <= 0)
-            arr[k++] = L[i++];
-        else
-            arr[k++] = R[j++];
-    }
-    while (i < n1) arr[k++] = L[i++];
-    while (j < n2) arr[k++] = R[j++];
-    free(L);
-    free(R);
+static inline int scanHasWork(const ScanJob* job) {
+    return job && job->next < job->partitions && job->next < job->emitted + job->window;
 }
 
-void mergeSortBuyers(Buyer** arr, int left, int right) {
-    if (left < right) {
-        int mid = left + (right - left) / 2;
-        mergeSortBuyers(arr, left, mid);
-        mergeSortBuyers(arr, mid + 1, right);
-        merge_buyers(arr, left, mid, right);
-    }
+void* scanWorker(void* arg) {
+    ScanPool* pool = (ScanPool*)arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && !scanHasWork(pool->job)) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stopping) break;
+        ScanJob* job = pool->job;
+        int p = job->next++;
+        pthread_mutex_unlock(&pool->lock);
+        scanPartition(job, p);
+        pthread_mutex_lock(&pool->lock);
+        job->done[p] = 1;
+        pthread_cond_signal(&pool->progress);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
-void sortBuyersByEnergyBought() {
-    int buyerCount = 0;
-    Buyer* current = buyer_head;
-    while (current) {
-        buyerCount++;
-        current = current->next;
-    }
+void stopScanPool() {
+    if (!scanPool.threads) return;
+    pthread_mutex_lock(&scanPool.lock);
+    scanPool.stopping = 1;
+    pthread_cond_broadcast(&scanPool.work);
+    pthread_mutex_unlock(&scanPool.lock);
+    for (int i = 0; i < scanPool.threadCount; i++) {
+        pthread_join(scanPool.threads[i], NULL);
+    }
+    free(scanPool.threads);
+    scanPool.threads = NULL;
+    scanPool.threadCount = 0;
+    scanPool.stopping = 0;
+}
 
-    if (buyerCount == 0) {
-        printf("No buyers found in the system.\n");
-        return;
+// Starts the workers on first use, or again after scanThreads changed
+void startScanPool(int threads) {
+    if (scanPool.threads && scanPool.threadCount == threads - 1) return;
+    stopScanPool();
+    scanPool.threads = (pthread_t*)malloc((threads - 1) * sizeof(pthread_t));
+    if (!scanPool.threads) {
+        printf("Memory allocation failed for scan threads.\n");
+        exit(1);
     }
-
-    Table table;
-    init_table(&table);
-    add_table_column(&table, "Buyer ID");
-    add_table_column(&table, "Energy Purchased");
-    add_table_column(&table, "Transactions");
-
-    Buyer** buyerArray = (Buyer**)malloc(buyerCount * sizeof(Buyer*));
-    current = buyer_head;
-    for (int i = 0; current; i++) {
-        buyerArray[i] = current;
-        current = current->next;
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&scanPool.threads[i], NULL, scanWorker, &scanPool) != 0) {
+            printf("Error starting scan thread.\n");
+            exit(1);
+        }
+        scanPool.threadCount++;
     }
+}
 
-    // Sort the array (using your existing merge sort functions)
-    mergeSortBuyers(buyerArray, 0, buyerCount - 1);
-
-    double totalEnergy = 0.0;
-    int totalTransactions = 0;
-    for (int i = 0; i < buyerCount; i++) {
-        char id[20], energy[20], trans[20];
-        snprintf(id, sizeof(id), "%d", buyerArray[i]->buyerID);
-        snprintf(energy, sizeof(energy), "%.2f kWh", buyerArray[i]->totalEnergyPurchased);
-        snprintf(trans, sizeof(trans), "%d", buyerArray[i]->numTransactions);
-        
-        add_table_row(&table, id, energy, trans);
-        
-        totalEnergy += buyerArray[i]->totalEnergyPurchased;
-        totalTransactions += buyerArray[i]->numTransactions;
+/* Runs the job's ranges on the pool, helping out from the calling thread, and writes
+   each range's buffer to out in key order. Returns the records found. */
+long long runScanJob(ScanJob* job, OutputBuffer* out) {
+    long long total = 0;
+    pthread_mutex_lock(&scanPool.lock);
+    scanPool.job = job;
+    pthread_cond_broadcast(&scanPool.work);
+    while (job->emitted < job->partitions) {
+        int p = job->emitted;
+        if (job->done[p]) {
+            pthread_mutex_unlock(&scanPool.lock);
+            OutputBuffer* buffer = &job->buffers[p % job->window];
+            total += job->rows[p % job->window];
+            if (out) outputWrite(out, buffer->data, buffer->used);
+            buffer->used = 0;
+            pthread_mutex_lock(&scanPool.lock);
+            job->emitted++;
+            pthread_cond_broadcast(&scanPool.work);
+        } else if (scanHasWork(job)) {
+            int q = job->next++;
+            pthread_mutex_unlock(&scanPool.lock);
+            scanPartition(job, q);
+            pthread_mutex_lock(&scanPool.lock);
+            job->done[q] = 1;
+        } else {
+            pthread_cond_wait(&scanPool.progress, &scanPool.lock);
+        }
     }
+    scanPool.job = NULL;
+    pthread_mutex_unlock(&scanPool.lock);
+    return total;
+}
 
-    // Add summary row
-    char totalE[20], totalT[20];
-    snprintf(totalE, sizeof(totalE), "%.2f kWh", totalEnergy);
-    snprintf(totalT, sizeof(totalT), "%d", totalTransactions);
-    add_table_row(&table, "TOTAL", totalE, totalT);
+/* Scans keys [low, high] of a transaction tree, skipping records outside energyBounds
+   when given. With a writer, the records are written to it (a table writer must
+   already be streaming); without one they are only counted. Returns the count. */
+long long scanTransactions(BPTreeNode* root, BPKey low, BPKey high, const double* energyBounds,
+                           ResultWriter* writer) {
+    int threads = chooseScanThreads();
+    BPKey* starts;
+    int partitions = planScan(root, low, high, threads, &starts, NULL);
+    long long found = 0;
+    if (partitions == 1) {
+        BPTreeCursor cursor;
+        BPTreeNode* leaf = seekBPTree(root, low, &cursor);
+        found = resultTransactionRange(writer, leaf, &cursor, high, energyBounds);
+    } else if (partitions > 1) {
+        pthread_mutex_lock(&scanPool.jobLock);
+        startScanPool(threads);
+        ScanJob job;
+        memset(&job, 0, sizeof(job));
+        job.root = root;
+        job.starts = starts;
+        job.partitions = partitions;
+        job.high = high;
+        job.energyBounds = energyBounds;
+        job.countOnly = writer == NULL;
+        job.format = writer ? writer->format : OUTPUT_CSV;
+        job.layout = writer && writer->format == OUTPUT_TABLE ? &writer->table : NULL;
+        job.window = 2 * threads;
+        job.buffers = (OutputBuffer*)calloc(job.window, sizeof(OutputBuffer));
+        job.rows = (long long*)calloc(job.window, sizeof(long long));
+        job.done = (unsigned char*)calloc(partitions, 1);
+        if (!job.buffers || !job.rows || !job.done) {
+            printf("Memory allocation failed for scan.\n");
+            exit(1);
+        }
+        if (writer) {
+            for (int i = 0; i < job.window; i++) initOutputBuffer(&job.buffers[i], NULL);
+        }
+        OutputBuffer* out = !writer ? NULL : job.layout ? &writer->table.output : writer->out;
+        found = runScanJob(&job, out);
+        pthread_mutex_unlock(&scanPool.jobLock);
+        if (writer) {
+            for (int i = 0; i < job.window; i++) freeOutputBuffer(&job.buffers[i]);
+            writer->rows += found;
+            if (job.layout) writer->table.num_rows += (int)found;
+        }
+        free(job.buffers);
+        free(job.rows);
+        free(job.done);
+    }
+    free(starts);
+    return found;
+}
 
-    printf("\n===== Buyers Sorted by Energy Purchased =====\n");
-    print_table(&table);
-    free_table(&table);
-    free(buyerArray);
+// Rough number of keys in [low, high], from the same descent planScan makes
+double estimateScanRows(BPTreeNode* root, BPKey low, BPKey high) {
+    BPKey* starts;
+    double rows;
+    planScan(root, low, high, SCAN_MAX_THREADS, &starts, &rows);
+    free(starts);
+    return rows;
 }
 
-int compareSellerBuyerPairs(const SellerBuyerPair* a, const SellerBuyerPair* b) {
-    return b->transactionCount - a->transactionCount;  
-}
-
-void mergeSellerBuyerPairs(SellerBuyerPair* arr, int left, int mid, int right) {
-    int n1 = mid - left + 1;
-    int n2 = right - mid;
-    SellerBuyerPair* L = (SellerBuyerPair*)malloc(n1 * sizeof(SellerBuyerPair));
-    SellerBuyerPair* R = (SellerBuyerPair*)malloc(n2 * sizeof(SellerBuyerPair));
-    for (int i = 0; i < n1; i++) L[i] = arr[left + i];
-    for (int j = 0; j < n2; j++) R[j] = arr[mid + 1 + j];
-    int i = 0, j = 0, k = left;
-    while (i < n1 && j < n2) {
-        if (compareSellerBuyerPairs(&L[i], &R[j]) <= 0)
-            arr[k++] = L[i++];
-        else
-            arr[k++] = R[j++];
+/* Writes keys [low, high] of a transaction tree as one result set. count may be -1
+   when unknown; binary output then counts the records first. Table output adds the
+   first rows one by one so they can size the columns, and scans the rest once the
+   widths are fixed. */
+long long writeTransactionScan(BPTreeNode* root, BPKey low, BPKey high, const double* energyBounds,
+                               long long count, OutputBuffer* out) {
+    if (outputFormat == OUTPUT_BINARY && count < 0) count = scanTransactions(root, low, high, energyBounds, NULL);
+    ResultWriter writer;
+    beginResult(&writer, RESULT_TRANSACTIONS, count, out);
+    if (writer.format == OUTPUT_TABLE) {
+        BPTreeCursor cursor;
+        BPTreeNode* leaf = seekBPTree(root, low, &cursor);
+        for (; leaf && !writer.table.streaming; leaf = nextLeafInBPTree(&cursor)) {
+            for (int pos = cursor.pos; pos < leaf->numKeys && !writer.table.streaming; pos++) {
+                if (leaf->keys[pos] > high) return endResult(&writer);
+                low = leaf->keys[pos] + 1;
+                const Transaction* t = leaf->records[pos];
+                if (!energyBounds || (t->energyAmount >= energyBounds[0] && t->energyAmount <= energyBounds[1]))
+                    resultTransaction(&writer, t);
+            }
+        }
+        if (!writer.table.streaming) return endResult(&writer);
     }
-    while (i < n1) arr[k++] = L[i++];
-    while (j < n2) arr[k++] = R[j++];
-    free(L);
-    free(R);
+    scanTransactions(root, low, high, energyBounds, &writer);
+    return endResult(&writer);
 }
 
-void mergeSortSellerBuyerPairs(SellerBuyerPair* arr, int left, int right) {
-    if (left < right) {
-        int mid = left + (right - left) / 2;
-        mergeSortSellerBuyerPairs(arr, left, mid);
-        mergeSortSellerBuyerPairs(arr, mid + 1, right);
-        mergeSellerBuyerPairs(arr, left, mid, right);
-    }
+// Writes every transaction in an ID-keyed tree as one result set
+long long writeTransactionTree(BPTreeNode* root, long long count, OutputBuffer* out) {
+    return writeTransactionScan(root, LLONG_MIN, LLONG_MAX, NULL, count, out);
 }
 
-void sortSellerBuyerPairsByTransactions() {
+void findTransactionsByTimeRange(char* startDate, char* endDate) {
     if (!globalTransactionTree) {
-        printf("No transactions available.\n");
+        printNotice("No transactions available.\n");
         return;
     }
 
-    const int MAX_PAIRS = 1000;
-    SellerBuyerPair* pairs = (SellerBuyerPair*)malloc(MAX_PAIRS * sizeof(SellerBuyerPair));
-    if (!pairs) {
-        printf("Memory allocation failed.\n");
+    long long startEpoch, endEpoch;
+    if (!parseTimestamp(startDate, &startEpoch) || !parseTimestamp(endDate, &endEpoch)) {
+        printNotice("Invalid date range.\n");
         return;
     }
 
-    // Initialize pairs array
-    for (int i = 0; i < MAX_PAIRS; i++) {
-        pairs[i].sellerID = -1;
-        pairs[i].buyerID = -1;
-        pairs[i].transactionCount = 0;
+    printNotice("\n===== Transactions from %s to %s =====\n", startDate, endDate);
+
+    // Seek to the first entry at or after the start second and stop past the end second
+    BPKey endKey = timeIndexKey(endEpoch, (int)(TIME_KEY_ID_SPAN - 1));
+    if (!writeTransactionScan(timeIndexTree, timeIndexKey(startEpoch, 0), endKey, NULL, -1, NULL)) {
+        printNotice("No transactions found in the specified time period.\n");
     }
+}
 
-    // Count transactions for each seller-buyer pair
-    int pairCount = 0;
-    BPTreeNode* cursor = globalTransactionTree;
-    while (!cursor->isLeaf) {
-        cursor = cursor->children[0];
+// Totals from the rollups, over whole hours from the start's hour through the end's
+void showRollupWindow(int isBuyer, int entityID, char* startDate, char* endDate) {
+    const char* role = isBuyer ? "Buyer" : "Seller";
+    if (isBuyer ? !findBuyer(entityID) : !findSeller(entityID)) {
+        printNotice("%s ID %d not found.\n", role, entityID);
+        return;
+    }
+    long long startEpoch, endEpoch;
+    if (!parseTimestamp(startDate, &startEpoch) || !parseTimestamp(endDate, &endEpoch) ||
+        startEpoch > endEpoch) {
+        printNotice("Invalid date range.\n");
+        return;
     }
+    RollupWindow window;
+    sumRollupWindow(&window, isBuyer, entityID, startEpoch, endEpoch);
+    printNotice("\n===== %s ID %d from %s to %s =====\n", role, entityID, startDate, endDate);
+    ResultWriter writer;
+    beginResult(&writer, RESULT_WINDOW, 1, NULL);
+    resultWindow(&writer, &window);
+    endResult(&writer);
+    printNotice("Summed %d hour, day, month and year buckets.\n", window.bucketsRead);
+}
 
+void calculateTotalRevenueBySellerID(int sellerID) {
+    Seller* seller = findSeller(sellerID);
+    if (!seller) {
+        printNotice("Seller ID %d not found.\n", sellerID);
+        return;
+    }
+    if (outputFormat != OUTPUT_TABLE) {
+        ResultWriter writer;
+        beginResult(&writer, RESULT_SELLER_REVENUE, 1, NULL);
+        resultSellerRevenue(&writer, seller);
+        endResult(&writer);
+        return;
+    }
+    
+    printf("\n===== Revenue Summary for Seller ID %d =====\n", sellerID);
+    Table table;
+    init_table(&table);
+    add_table_column(&table, "Metric", 0);
+    add_table_column(&table, "Value", 0);
+    
+    // Convert all values to strings before adding to table
+    char sid[20], totalRev[50], totalTrans[50], avgRev[50];
+    snprintf(sid, sizeof(sid), "%d", sellerID);
+    snprintf(totalRev, sizeof(totalRev), "$%.2f", seller->totalRevenue);
+    snprintf(totalTrans, sizeof(totalTrans), "%d", seller->numTransactions);
+    
+    // Add rows to table
+    add_table_row(&table, "Seller ID", sid);
+    add_table_row(&table, "Total Revenue", totalRev);
+    add_table_row(&table, "Total Transactions", totalTrans);
+    
+    if (seller->numTransactions > 0) {
+        snprintf(avgRev, sizeof(avgRev), "$%.2f", 
+                seller->totalRevenue / seller->numTransactions);
+        add_table_row(&table, "Avg Revenue/Transaction", avgRev);
+    }
+    
+    print_table(&table);
+    free_table(&table);
+}
+
+void calculateTotalRevenueForAllSellers() {
+    if (sellerCount == 0) {
+        printNotice("No sellers found in the system.\n");
+        return;
+    }
+
+    printNotice("\n===== Revenue Summary for All Sellers =====\n");
+    ResultWriter writer;
+    beginResult(&writer, RESULT_SELLER_REVENUE, sellerCount, NULL);
+
+    double grandTotal = 0.0;
+    int totalTransactions = 0;
+    
+    // Seller ID order, as batch revenue lists them
+    Seller* ordered = sellersById(sellers, sellerCount);
+    for (int i = 0; i < sellerCount; i++) {
+        resultSellerRevenue(&writer, &ordered[i]);
+        grandTotal += ordered[i].totalRevenue;
+        totalTransactions += ordered[i].numTransactions;
+    }
+    free(ordered);
+
+    // Add summary row
+    if (writer.format == OUTPUT_TABLE) {
+        char grand[40], totalTrans[20], grandAvg[40];
+        snprintf(grand, sizeof(grand), "$%.2f", grandTotal);
+        snprintf(totalTrans, sizeof(totalTrans), "%d", totalTransactions);
+        snprintf(grandAvg, sizeof(grandAvg), "$%.2f",
+            totalTransactions > 0 ? grandTotal / totalTransactions : 0.0);
+        add_table_row(&writer.table, "TOTAL", grand, totalTrans, grandAvg);
+    }
+    endResult(&writer);
+}
+
+void findTransactionsByEnergyRange(double minEnergy, double maxEnergy) {
+    if (!globalTransactionTree) {
+        printNotice("No transactions available.\n");
+        return;
+    }
+
+    printNotice("\n===== Transactions with Energy Amount between %.2f kWh and %.2f kWh (Ascending Order) =====\n", 
+                minEnergy, maxEnergy);
+
+    // The index is already in (energy, ID) order, so a seek plus a leaf walk needs no sort.
+    // Keys are rounded to hundredths, so the bounds are widened by one hundredth and
+    // each record is checked against the exact amounts.
+    BPKey endKey = energyIndexKey(energyToCents(maxEnergy) + 1, (int)(TIME_KEY_ID_SPAN - 1));
+    double bounds[2] = { minEnergy, maxEnergy };
+    if (!writeTransactionScan(energyIndexTree, energyIndexKey(energyToCents(minEnergy) - 1, 0), endKey,
+                              bounds, -1, NULL)) {
+        printNotice("No transactions found in the specified energy range.\n");
+    }
+}
+
+int getTreeHeight(BPTreeNode* root) {
+    int height = 0;
+    BPTreeNode* cursor = root;
     while (cursor) {
-        for (int i = 0; i < cursor->numKeys; i++) {
-            Transaction* t = cursor->records[i];
-            int pairIndex = -1;
-            
-            // Check if pair already exists
-            for (int j = 0; j < pairCount; j++) {
-                if (pairs[j].sellerID == t->sellerID && pairs[j].buyerID == t->buyerID) {
-                    pairIndex = j;
-                    break;
+        height++;
+        cursor = cursor->isLeaf ? NULL : cursor->children[0];
+    }
+    return height;
+}
+
+int countTransactionsInTree(BPTreeNode* root) {
+    BPTreeCursor cursor;
+    int count = 0;
+    for (BPTreeNode* leaf = seekBPTree(root, LLONG_MIN, &cursor); leaf; leaf = nextLeafInBPTree(&cursor)) {
+        count += leaf->numKeys;
+    }
+    return count;
+}
+
+/* Checks the invariants the tree code relies on below node: keys ascending and inside
+   the parent's separators, the occupancy floors below the root, no node left at the
+   split size, and every leaf at the same depth. Returns 0 on the first violation. */
+int checkBPTreeNode(BPTreeNode* node, int depth, int* leafDepth, BPKey low, BPKey high, int isRoot) {
+    int minKeys = node->isLeaf ? MIN_LEAF_KEYS : MIN_INTERNAL_KEYS;
+    if (node->numKeys >= ORDER - 1 || (!isRoot && node->numKeys < minKeys) || (!node->isLeaf && node->numKeys < 1))
+        return 0;
+    for (int i = 0; i < node->numKeys; i++) {
+        if (node->keys[i] < low || node->keys[i] >= high) return 0;
+        if (i > 0 && node->keys[i] <= node->keys[i - 1]) return 0;
+    }
+    if (node->isLeaf) {
+        if (*leafDepth < 0) *leafDepth = depth;
+        return depth == *leafDepth;
+    }
+    for (int i = 0; i <= node->numKeys; i++) {
+        BPKey childLow = i == 0 ? low : node->keys[i - 1];
+        BPKey childHigh = i == node->numKeys ? high : node->keys[i];
+        if (!checkBPTreeNode(node->children[i], depth + 1, leafDepth, childLow, childHigh, 0)) return 0;
+    }
+    return 1;
+}
+
+int checkBPTree(BPTreeNode* root) {
+    int leafDepth = -1;
+    return !root || checkBPTreeNode(root, 0, &leafDepth, LLONG_MIN, LLONG_MAX, 1);
+}
+
+/* Prints leaderboard positions [offset, offset + limit); limit <= 0 prints through the end
+   with a totals row. Each row is an O(log n) lookup, so pages cost nothing extra. */
+void sortBuyersByEnergyBought(int offset, int limit) {
+    if (buyerCount == 0) {
+        printNotice("No buyers found in the system.\n");
+        return;
+    }
+    if (offset < 0) offset = 0;
+    int end = (limit > 0 && offset + limit < buyerCount) ? offset + limit : buyerCount;
+    if (offset >= end) {
+        printNotice("No buyers at that leaderboard position (%d buyers).\n", buyerCount);
+        return;
+    }
+    int fullList = (offset == 0 && end == buyerCount);
+    if (fullList) {
+        printNotice("\n===== Buyers Sorted by Energy Purchased =====\n");
+    } else {
+        printNotice("\n===== Buyers Sorted by Energy Purchased (ranks %d-%d of %d) =====\n",
+                    offset + 1, end, buyerCount);
+    }
+
+    ResultWriter writer;
+    beginResult(&writer, RESULT_BUYER_RANKS, end - offset, NULL);
+
+    double totalEnergy = 0.0;
+    int totalTransactions = 0;
+    for (int position = offset; position < end; position++) {
+        const Buyer* buyer = &buyers[leaderboardAt(position)];
+        resultBuyerRank(&writer, position + 1, buyer);
+        totalEnergy += buyer->totalEnergyPurchased;
+        totalTransactions += buyer->numTransactions;
+    }
+
+    // Add summary row
+    if (fullList && writer.format == OUTPUT_TABLE) {
+        char totalE[40], totalT[20];
+        snprintf(totalE, sizeof(totalE), "%.2f kWh", totalEnergy);
+        snprintf(totalT, sizeof(totalT), "%d", totalTransactions);
+        add_table_row(&writer.table, "", "TOTAL", totalE, totalT);
+    }
+    endResult(&writer);
+}
+
+void showBuyerRank(int buyerID) {
+    Buyer* buyer = findBuyer(buyerID);
+    if (!buyer) {
+        printNotice("Buyer ID %d not found.\n", buyerID);
+        return;
+    }
+    int rank = leaderboardRank((int)(buyer - buyers));
+    if (outputFormat != OUTPUT_TABLE) {
+        ResultWriter writer;
+        beginResult(&writer, RESULT_BUYER_RANKS, 1, NULL);
+        resultBuyerRank(&writer, rank, buyer);
+        endResult(&writer);
+        return;
+    }
+    printf("Buyer ID %d is ranked %d of %d with %.2f kWh purchased.\n", buyerID,
+           rank, buyerCount, buyer->totalEnergyPurchased);
+}
+
+// Most transactions first, ties by seller ID then buyer ID, so every pair has one place
+int compareSellerBuyerPairs(const SellerBuyerPair* a, const SellerBuyerPair* b) {
+    if (a->transactionCount != b->transactionCount)
+        return a->transactionCount > b->transactionCount ? -1 : 1;
+    if (a->sellerID != b->sellerID) return a->sellerID < b->sellerID ? -1 : 1;
+    return (a->buyerID > b->buyerID) - (a->buyerID < b->buyerID);
+}
+
+int compareSellerBuyerPairEntries(const void* a, const void* b) {
+    return compareSellerBuyerPairs((const SellerBuyerPair*)a, (const SellerBuyerPair*)b);
+}
+
+// Restores the heap below slot i of heap[0..size), whose root is the pair that ranks last
+static void siftDownLastPair(SellerBuyerPair* heap, int size, int i) {
+    for (;;) {
+        int last = i, left = 2 * i + 1, right = left + 1;
+        if (left < size && compareSellerBuyerPairs(&heap[left], &heap[last]) > 0) last = left;
+        if (right < size && compareSellerBuyerPairs(&heap[right], &heap[last]) > 0) last = right;
+        if (last == i) return;
+        SellerBuyerPair swap = heap[i];
+        heap[i] = heap[last];
+        heap[last] = swap;
+        i = last;
+    }
+}
+
+/* Moves the topN most active of count pairs to the front in rank order and returns
+   how many that is; topN <= 0 sorts them all. A bounded heap keeps the selection at
+   O(count log topN) instead of sorting every pair. */
+int selectTopSellerBuyerPairs(SellerBuyerPair* pairs, int count, int topN) {
+    int shown = (topN > 0 && topN < count) ? topN : count;
+    if (shown < count) {
+        for (int i = shown / 2 - 1; i >= 0; i--) siftDownLastPair(pairs, shown, i);
+        for (int i = shown; i < count; i++) {
+            if (compareSellerBuyerPairs(&pairs[i], &pairs[0]) < 0) {
+                pairs[0] = pairs[i];
+                siftDownLastPair(pairs, shown, 0);
+            }
+        }
+    }
+    qsort(pairs, shown, sizeof(SellerBuyerPair), compareSellerBuyerPairEntries);
+    return shown;
+}
+
+/* Copies the live pairs of counter, skipping pairs whose transactions were all deleted,
+   and moves the topN most active to the front in rank order (see
+   selectTopSellerBuyerPairs); *shown is how many that is. Returns NULL if the copy
+   cannot be allocated. */
+SellerBuyerPair* sortedLivePairs(const PairCounter* counter, int topN, int* pairCount, int* shown, int* totalTransactions) {
+    SellerBuyerPair* pairs = (SellerBuyerPair*)malloc((counter->count ? counter->count : 1) * sizeof(SellerBuyerPair));
+    if (!pairs) return NULL;
+    *pairCount = 0;
+    *totalTransactions = 0;
+    for (int i = 0; i < counter->count; i++) {
+        if (counter->pairs[i].transactionCount <= 0) continue;
+        pairs[(*pairCount)++] = counter->pairs[i];
+        *totalTransactions += counter->pairs[i].transactionCount;
+    }
+    *shown = selectTopSellerBuyerPairs(pairs, *pairCount, topN);
+    return pairs;
+}
+
+/* Lists live pairs by transaction count, most active first. topN <= 0 lists them all. */
+void sortSellerBuyerPairsByTransactions(int topN) {
+    if (!globalTransactionTree) {
+        printNotice("No transactions available.\n");
+        return;
+    }
+
+    int pairCount, shown, totalTransactions;
+    SellerBuyerPair* pairs = sortedLivePairs(&pairCounter, topN, &pairCount, &shown, &totalTransactions);
+    if (!pairs) {
+        printf("Memory allocation failed.\n");
+        return;
+    }
+
+    printNotice("\n===== Seller-Buyer Pairs Sorted by Transaction Count =====\n");
+    ResultWriter writer;
+    beginResult(&writer, RESULT_PAIRS, shown, NULL);
+    for (int i = 0; i < shown; i++) {
+        resultPair(&writer, &pairs[i]);
+    }
+    endResult(&writer);
+
+    if (pairCount > 0) {
+        printNotice("\nSummary:\n");
+        if (shown < pairCount) printNotice("Showing top %d pairs\n", shown);
+        printNotice("Total Pairs: %d\n", pairCount);
+        printNotice("Total Transactions: %d\n", totalTransactions);
+    } else {
+        printNotice("No seller-buyer pairs found.\n");
+    }
+    free(pairs);
+}
+
+/* Picks how many nodes a level needs so that each gets about target items while
+   staying within the occupancy bounds that inserts and deletes maintain. */
+int chooseNodeCount(int items, int target, int minPer, int maxPer) {
+    int nodes = (items + target - 1) / target;
+    int fewest = (items + maxPer - 1) / maxPer;
+    int most = items / minPer;
+    if (most < 1) most = 1;
+    if (nodes > most) nodes = most;
+    if (nodes < fewest) nodes = fewest;
+    return nodes;
+}
+
+/* Builds a B+ tree bottom-up from records already sorted by key with no duplicates:
+   leaves are packed to BULK_LOAD_FILL_FACTOR, then each internal level
+   is packed over the one below until a single root remains. */
+BPTreeNode* bulkLoadBPTree(Transaction** sorted, int count, BPKey (*keyOf)(const Transaction*)) {
+    if (count == 0) return NULL;
+    int target = (int)(BULK_LOAD_FILL_FACTOR * (ORDER - 1));
+    if (target < MIN_LEAF_KEYS) target = MIN_LEAF_KEYS;
+    if (target > ORDER - 2) target = ORDER - 2;
+    if (target < 1) target = 1;
+
+    int nodeCount = chooseNodeCount(count, target, MIN_LEAF_KEYS, ORDER - 2);
+    BPTreeNode** level = (BPTreeNode**)malloc(nodeCount * sizeof(BPTreeNode*));
+    BPKey* lowKeys = (BPKey*)malloc(nodeCount * sizeof(BPKey));
+    if (!level || !lowKeys) {
+        printf("Memory allocation failed during bulk load.\n");
+        exit(1);
+    }
+    int pos = 0;
+    for (int i = 0; i < nodeCount; i++) {
+        int take = count / nodeCount + (i < count % nodeCount);
+        BPTreeNode* leaf = createBPTreeNode(1);
+        for (int j = 0; j < take; j++) {
+            leaf->keys[j] = keyOf(sorted[pos + j]);
+            leaf->records[j] = sorted[pos + j];
+        }
+        leaf->numKeys = take;
+        pos += take;
+        level[i] = leaf;
+        lowKeys[i] = leaf->keys[0];
+    }
+
+    // Parents overwrite the front of the same arrays; slot p is never read after parent p is written
+    while (nodeCount > 1) {
+        int parentCount = chooseNodeCount(nodeCount, target + 1, MIN_INTERNAL_KEYS + 1, ORDER - 1);
+        pos = 0;
+        for (int p = 0; p < parentCount; p++) {
+            int take = nodeCount / parentCount + (p < nodeCount % parentCount);
+            BPTreeNode* parent = createBPTreeNode(0);
+            BPKey lowKey = lowKeys[pos];
+            for (int j = 0; j < take; j++) {
+                parent->children[j] = level[pos + j];
+                if (j > 0) parent->keys[j - 1] = lowKeys[pos + j];
+            }
+            parent->numKeys = take - 1;
+            pos += take;
+            level[p] = parent;
+            lowKeys[p] = lowKey;
+        }
+        nodeCount = parentCount;
+    }
+
+    BPTreeNode* root = level[0];
+    free(level);
+    free(lowKeys);
+    return root;
+}
+
+typedef struct {
+    Transaction* t;  // NULL for a tombstone
+    int transactionID;
+    int seq;  // position in the file, so rows for one ID replay in file order
+} LoadedRow;
+
+int compareLoadedRowsById(const void* a, const void* b) {
+    const LoadedRow* x = (const LoadedRow*)a;
+    const LoadedRow* y = (const LoadedRow*)b;
+    if (x->transactionID != y->transactionID)
+        return x->transactionID < y->transactionID ? -1 : 1;
+    return x->seq - y->seq;
+}
+
+/* Stable counting sort of records by registry slot; slotOf[i] is the slot of
+   records[i]. groupStart receives slotCount + 1 offsets into out. */
+void groupBySlot(Transaction** records, const int* slotOf, int count, int slotCount,
+                 Transaction** out, int* groupStart) {
+    memset(groupStart, 0, (slotCount + 1) * sizeof(int));
+    for (int i = 0; i < count; i++)
+        groupStart[slotOf[i] + 1]++;
+    for (int s = 0; s < slotCount; s++)
+        groupStart[s + 1] += groupStart[s];
+    for (int i = 0; i < count; i++)
+        out[groupStart[slotOf[i]]++] = records[i];
+    // The fill loop advanced each start to the next group's; shift them back
+    for (int s = slotCount; s > 0; s--)
+        groupStart[s] = groupStart[s - 1];
+    groupStart[0] = 0;
+}
+
+/* Bulk-builds when the tree is empty; otherwise falls back to one insert per record. */
+void buildBPTreeFromSorted(BPTreeNode** root, Transaction** sorted, int count, BPKey (*keyOf)(const Transaction*)) {
+    if (*root) {
+        for (int i = 0; i < count; i++)
+            insertRecordIntoBPTree(root, keyOf(sorted[i]), sorted[i]);
+        return;
+    }
+    *root = bulkLoadBPTree(sorted, count, keyOf);
+}
+
+typedef struct {
+    BPKey key;
+    Transaction* t;
+} KeyedRecord;
+
+int compareKeyedRecords(const void* a, const void* b) {
+    BPKey x = ((const KeyedRecord*)a)->key;
+    BPKey y = ((const KeyedRecord*)b)->key;
+    return (x > y) - (x < y);
+}
+
+/* Computes each record's index key once, sorts by it, then packs the index. */
+void buildSecondaryIndex(BPTreeNode** root, Transaction** records, int count, BPKey (*keyOf)(const Transaction*)) {
+    KeyedRecord* keyed = (KeyedRecord*)malloc((count ? count : 1) * sizeof(KeyedRecord));
+    Transaction** ordered = (Transaction**)malloc((count ? count : 1) * sizeof(Transaction*));
+    if (!keyed || !ordered) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        keyed[i].key = keyOf(records[i]);
+        keyed[i].t = records[i];
+    }
+    qsort(keyed, count, sizeof(KeyedRecord), compareKeyedRecords);
+    for (int i = 0; i < count; i++)
+        ordered[i] = keyed[i].t;
+    free(keyed);
+    buildBPTreeFromSorted(root, ordered, count, keyOf);
+    free(ordered);
+}
+
+/* ============== PARALLEL FILE LOADER ============== */
+/* The transaction file is mapped read-only and cut at line boundaries into one chunk
+   per parser thread. Each thread parses its chunk into its own row vector and its own
+   transaction pool; the main thread then concatenates the vectors in file order and
+   folds the pools into the global one. */
+#define LOADER_MAX_THREADS 16
+#ifndef LOADER_MIN_CHUNK_BYTES
+#define LOADER_MIN_CHUNK_BYTES (1 << 20)
+#endif
+#define LOADER_MAX_WARNINGS 10
+
+int loaderThreads = 0;  // 0 uses one per online CPU
+
+typedef enum { LINE_RECORD, LINE_TOMBSTONE, LINE_MALFORMED } LineKind;
+
+typedef struct {
+    const char* begin;
+    const char* end;
+    ObjectPool pool;
+    LoadedRow* rows;
+    int count;
+    int capacity;
+    const char** malformed;  // start of each malformed line, for warnings
+    int malformedCount;
+    int malformedCapacity;
+    int tombstones;
+} LoadChunk;
+
+typedef struct {
+    int threads;
+    int lines;
+    double parseSeconds;
+    double buildSeconds;
+} LoadStats;
+
+LoadStats lastLoadStats;
+
+static const double decimalScale[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+// Parses an optionally signed integer ending at sep; leaves *cursor past sep
+static inline int parseIntField(const char** cursor, const char* end, char sep, int* out) {
+    const char* p = *cursor;
+    int negative = 0;
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    const char* digits = p;
+    long long value = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - digits < 10)
+        value = value * 10 + (*p++ - '0');
+    if (p == digits || p >= end || *p != sep || value > 2147483647LL + negative) return 0;
+    *out = (int)(negative ? -value : value);
+    *cursor = p + 1;
+    return 1;
+}
+
+/* Parses digits[.digits] ending at ','. The digits form one exact integer that is
+   divided by a power of ten once, which rounds exactly like strtod. */
+static inline int parseDecimalField(const char** cursor, const char* end, double* out) {
+    const char* p = *cursor;
+    int negative = 0;
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    long long mantissa = 0;
+    int digits = 0, fraction = 0;
+    while (p < end && *p >= '0' && *p <= '9' && digits < 15) {
+        mantissa = mantissa * 10 + (*p++ - '0');
+        digits++;
+    }
+    if (digits == 0) return 0;
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9' && digits < 15 && fraction < 9) {
+            mantissa = mantissa * 10 + (*p++ - '0');
+            digits++;
+            fraction++;
+        }
+    }
+    if (p >= end || *p != ',') return 0;
+    double value = (double)mantissa / decimalScale[fraction];
+    *out = negative ? -value : value;
+    *cursor = p + 1;
+    return 1;
+}
+
+static inline int twoDigits(const char* p) {
+    if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9') return -1;
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+// Parses exactly "YYYY-MM-DD HH:MM:SS" running to the end of the line
+static inline int parseTimestampField(const char* p, const char* end, long long* epoch) {
+    if (end - p != 19 || p[4] != '-' || p[7] != '-' || p[10] != ' ' || p[13] != ':' || p[16] != ':')
+        return 0;
+    int century = twoDigits(p), yearOfCentury = twoDigits(p + 2);
+    int month = twoDigits(p + 5), day = twoDigits(p + 8);
+    int hour = twoDigits(p + 11), minute = twoDigits(p + 14), second = twoDigits(p + 17);
+    if (century < 0 || yearOfCentury < 0 ||
+        !isValidCivilTime(century * 100 + yearOfCentury, month, day, hour, minute, second))
+        return 0;
+    *epoch = daysFromCivil(century * 100 + yearOfCentury, month, day) * 86400LL +
+             hour * 3600LL + minute * 60LL + second;
+    return 1;
+}
+
+/* Classifies one line (without its newline). Lines in the layout the log writer
+   produces take the fast path; anything else goes through sscanf as before. */
+LineKind parseTransactionLine(const char* line, const char* end, Transaction* out) {
+    if (end > line && end[-1] == '\r') end--;
+    const char* p = line;
+    if (p < end && *p == 'D') {
+        p++;
+        if (p < end && *p == ',') {
+            p++;
+            const char* digits = p;
+            long long value = 0;
+            while (p < end && *p >= '0' && *p <= '9' && p - digits < 10)
+                value = value * 10 + (*p++ - '0');
+            if (p > digits && p == end && value <= 2147483647LL) {
+                out->transactionID = (int)value;
+                return LINE_TOMBSTONE;
+            }
+        }
+    } else if (parseIntField(&p, end, ',', &out->transactionID) &&
+               parseIntField(&p, end, ',', &out->buyerID) &&
+               parseIntField(&p, end, ',', &out->sellerID) &&
+               parseDecimalField(&p, end, &out->energyAmount) &&
+               parseDecimalField(&p, end, &out->pricePerKwh) &&
+               parseDecimalField(&p, end, &out->totalPrice) &&
+               parseTimestampField(p, end, &out->epoch)) {
+        return out->transactionID >= 0 ? LINE_RECORD : LINE_MALFORMED;
+    }
+
+    // Slow path, same rules as the original fgets/sscanf loader
+    char text[256];
+    size_t length = (size_t)(end - line);
+    if (length >= sizeof(text)) length = sizeof(text) - 1;
+    memcpy(text, line, length);
+    text[length] = '\0';
+    char timestamp[30];
+    if (sscanf(text, "D,%d", &out->transactionID) == 1 && out->transactionID >= 0)
+        return LINE_TOMBSTONE;
+    if (sscanf(text, "%d,%d,%d,%lf,%lf,%lf,%29[^\n]",
+               &out->transactionID, &out->buyerID, &out->sellerID,
+               &out->energyAmount, &out->pricePerKwh, &out->totalPrice,
+               timestamp) == 7 && out->transactionID >= 0 && parseTimestamp(timestamp, &out->epoch))
+        return LINE_RECORD;
+    return LINE_MALFORMED;
+}
+
+void* parseLoadChunk(void* arg) {
+    LoadChunk* chunk = (LoadChunk*)arg;
+    const char* p = chunk->begin;
+    while (p < chunk->end) {
+        const char* newline = (const char*)memchr(p, '\n', (size_t)(chunk->end - p));
+        const char* lineEnd = newline ? newline : chunk->end;
+        Transaction parsed;
+        LineKind kind = parseTransactionLine(p, lineEnd, &parsed);
+        if (kind == LINE_MALFORMED) {
+            if (chunk->malformedCount == chunk->malformedCapacity) {
+                chunk->malformedCapacity = chunk->malformedCapacity ? chunk->malformedCapacity * 2 : 16;
+                chunk->malformed = (const char**)realloc(chunk->malformed, chunk->malformedCapacity * sizeof(const char*));
+                if (!chunk->malformed) {
+                    printf("Memory allocation failed.\n");
+                    exit(1);
                 }
             }
+            chunk->malformed[chunk->malformedCount++] = p;
+        } else {
+            if (chunk->count == chunk->capacity) {
+                chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 4096;
+                chunk->rows = (LoadedRow*)realloc(chunk->rows, chunk->capacity * sizeof(LoadedRow));
+                if (!chunk->rows) {
+                    printf("Memory allocation failed.\n");
+                    exit(1);
+                }
+            }
+            LoadedRow* row = &chunk->rows[chunk->count++];
+            row->transactionID = parsed.transactionID;
+            row->t = NULL;
+            if (kind == LINE_RECORD) {
+                row->t = (Transaction*)poolAlloc(&chunk->pool);
+                *row->t = parsed;
+            } else {
+                chunk->tombstones++;
+            }
+        }
+        p = lineEnd + 1;
+    }
+    return NULL;
+}
+
+int chooseLoaderThreads(size_t bytes) {
+    int threads = loaderThreads;
+    if (threads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (int)online : 1;
+    }
+    if (threads > LOADER_MAX_THREADS) threads = LOADER_MAX_THREADS;
+    int bySize = (int)(bytes / LOADER_MIN_CHUNK_BYTES);
+    if (threads > bySize) threads = bySize > 0 ? bySize : 1;
+    return threads;
+}
+
+void loadDataFromFile() {
+    loadTransactionFile(TRANSACTION_FILE);
+}
+
+typedef struct {
+    const char* data;  // first mapped byte of interest; NULL when the range is empty
+    size_t size;
+    void* base;        // page-aligned mapping, for munmap
+    size_t mapped;
+} MappedRange;
+
+/* Maps [offset, end of file) read-only. Returns -1 if the file cannot be mapped. */
+int mapFileRange(int fd, off_t offset, MappedRange* range) {
+    struct stat info;
+    memset(range, 0, sizeof(MappedRange));
+    if (fstat(fd, &info) != 0) return -1;
+    if (info.st_size <= offset) return 0;
+    off_t pageStart = offset - offset % sysconf(_SC_PAGESIZE);
+    range->mapped = (size_t)(info.st_size - pageStart);
+    range->base = mmap(NULL, range->mapped, PROT_READ, MAP_PRIVATE, fd, pageStart);
+    if (range->base == MAP_FAILED) {
+        memset(range, 0, sizeof(MappedRange));
+        return -1;
+    }
+    madvise(range->base, range->mapped, MADV_SEQUENTIAL);
+    range->data = (const char*)range->base + (offset - pageStart);
+    range->size = (size_t)(info.st_size - offset);
+    return 0;
+}
+
+void unmapFileRange(MappedRange* range) {
+    if (range->base) munmap(range->base, range->mapped);
+    memset(range, 0, sizeof(MappedRange));
+}
+
+typedef struct {
+    LoadedRow* rows;
+    int count;
+    int malformed;
+    int tombstones;
+    int threads;
+} ParsedRows;
+
+/* End of the i-th of parts roughly equal chunks of the text, moved forward to just
+   after a newline. The chunk starts at begin, where the previous one ended. */
+const char* lineChunkEnd(const char* data, size_t size, int parts, int i, const char* begin) {
+    const char* end = i == parts - 1 ? data + size : data + size / parts * (i + 1);
+    if (end < begin) end = begin;
+    if (end < data + size) {
+        const char* newline = (const char*)memchr(end, '\n', (size_t)(data + size - end));
+        end = newline ? newline + 1 : data + size;
+    }
+    return end;
+}
+
+/* Parses text lines on the loader threads. Rows come back in file order, numbered
+   from firstSeq, with their transactions already in the global pool. */
+void parseTransactionText(const char* data, size_t size, int firstSeq, ParsedRows* out) {
+    // Cut the text into chunks that each end just after a newline
+    int threadCount = chooseLoaderThreads(size);
+    LoadChunk chunks[LOADER_MAX_THREADS];
+    pthread_t threads[LOADER_MAX_THREADS];
+    const char* cursor = data;
+    for (int i = 0; i < threadCount; i++) {
+        memset(&chunks[i], 0, sizeof(LoadChunk));
+        initObjectPool(&chunks[i].pool, "Transaction", sizeof(Transaction), _Alignof(Transaction));
+        chunks[i].begin = cursor;
+        chunks[i].end = cursor = lineChunkEnd(data, size, threadCount, i, cursor);
+    }
+    for (int i = 1; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, parseLoadChunk, &chunks[i]) != 0) {
+            printf("Error starting loader thread.\n");
+            exit(1);
+        }
+    }
+    if (threadCount > 0) parseLoadChunk(&chunks[0]);
+    for (int i = 1; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+
+    // Concatenate in file order; seq is the row's position in the file
+    memset(out, 0, sizeof(ParsedRows));
+    out->threads = threadCount;
+    for (int i = 0; i < threadCount; i++) {
+        out->count += chunks[i].count;
+        out->malformed += chunks[i].malformedCount;
+    }
+    out->rows = (LoadedRow*)malloc((out->count ? out->count : 1) * sizeof(LoadedRow));
+    if (!out->rows) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    int warned = 0;
+    for (int i = 0, next = 0; i < threadCount; i++) {
+        LoadChunk* chunk = &chunks[i];
+        for (int r = 0; r < chunk->count; r++, next++) {
+            out->rows[next] = chunk->rows[r];
+            out->rows[next].seq = firstSeq + next;
+        }
+        for (int m = 0; m < chunk->malformedCount && warned < LOADER_MAX_WARNINGS; m++, warned++) {
+            const char* line = chunk->malformed[m];
+            const char* newline = (const char*)memchr(line, '\n', (size_t)(data + size - line));
+            int length = (int)((newline ? newline : data + size) - line);
+            printf("Warning: Malformed transaction data in file: %.*s\n", length > 200 ? 200 : length, line);
+        }
+        out->tombstones += chunk->tombstones;
+        mergeObjectPool(&transactionPool, &chunk->pool);
+        free(chunk->rows);
+        free(chunk->malformed);
+    }
+    if (out->malformed > warned)
+        printf("Warning: %d more malformed lines not shown.\n", out->malformed - warned);
+}
+
+/* Replays parsed rows into the trees, indexes and aggregates. seq must number the rows
+   0..rowCount-1 in replay order. Takes ownership of rows; returns the live count. */
+int applyLoadedRows(LoadedRow* rows, int rowCount, int* duplicates) {
+    loading_mode = 1;
+    int totalLoaded = 0;
+    *duplicates = 0;
+
+    // Keep the replay order for the aggregates, then sort the rows by (ID, position)
+    TransactionArray parsed;
+    parsed.count = rowCount;
+    parsed.capacity = rowCount;
+    parsed.transactions = (Transaction**)malloc((rowCount ? rowCount : 1) * sizeof(Transaction*));
+    Transaction** sorted = (Transaction**)malloc((rowCount ? rowCount : 1) * sizeof(Transaction*));
+    if (!parsed.transactions || !sorted) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    int inOrder = 1;
+    for (int i = 0; i < rowCount; i++) {
+        parsed.transactions[rows[i].seq] = rows[i].t;
+        if (rows[i].t && rows[i].transactionID >= nextTransactionID)
+            nextTransactionID = rows[i].transactionID + 1;
+        if (i > 0 && compareLoadedRowsById(&rows[i - 1], &rows[i]) > 0) inOrder = 0;
+    }
+    // A snapshot arrives already in ID order
+    if (!inOrder) qsort(rows, rowCount, sizeof(LoadedRow), compareLoadedRowsById);
 
-            if (pairIndex >= 0) {
-                pairs[pairIndex].transactionCount++;
-            } else if (pairCount < MAX_PAIRS) {
-                pairs[pairCount].sellerID = t->sellerID;
-                pairs[pairCount].buyerID = t->buyerID;
-                pairs[pairCount].transactionCount = 1;
-                pairCount++;
+    // Replay each ID's rows in file order: a tombstone cancels the live record, and a
+    // record arriving while another is live is a duplicate
+    int unique = 0;
+    for (int start = 0; start < rowCount; ) {
+        int end = start;
+        Transaction* live = NULL;
+        int liveSeq = -1;
+        for (; end < rowCount && rows[end].transactionID == rows[start].transactionID; end++) {
+            LoadedRow* row = &rows[end];
+            if (!row->t) {
+                if (live) {
+                    parsed.transactions[liveSeq] = NULL;
+                    releaseTransaction(live);
+                    live = NULL;
+                }
+            } else if (live) {
+                printf("Warning: Duplicate transaction ID %d found in file. Skipping.\n", row->transactionID);
+                parsed.transactions[row->seq] = NULL;
+                releaseTransaction(row->t);
+                (*duplicates)++;
             } else {
-                printf("Warning: Too many seller-buyer pairs, some may not be counted.\n");
+                live = row->t;
+                liveSeq = row->seq;
             }
         }
-        cursor = cursor->next;
+        if (live) sorted[unique++] = live;
+        start = end;
+    }
+    free(rows);
+
+    // Aggregates replay in file order so regular-buyer detection sees the same history
+    for (int i = 0; i < parsed.count; i++) {
+        Transaction* t = parsed.transactions[i];
+        if (!t) continue;
+        Seller* seller = findOrCreateSeller(t->sellerID);
+        Buyer* buyer = findOrCreateBuyer(t->buyerID);
+        seller->numTransactions++;
+        seller->totalRevenue += t->totalPrice;
+        buyer->numTransactions++;
+        buyer->totalEnergyPurchased += t->energyAmount;
+        addRegularBuyer(&pairCounter, seller, buyer, adjustPairCount(&pairCounter, t->sellerID, t->buyerID, 1));
+        storeTotals.transactions++;
+        storeTotals.revenue += t->totalPrice;
+        storeTotals.energy += t->energyAmount;
+        adjustRollups(t, 1);
+        totalLoaded++;
+    }
+    rebuildLeaderboard();
+    free(parsed.transactions);
+
+    buildBPTreeFromSorted(&globalTransactionTree, sorted, unique, transactionIdKey);
+
+    // Regroup by seller, then by buyer; a stable counting sort keeps each group in ID order
+    Transaction** grouped = (Transaction**)malloc((unique ? unique : 1) * sizeof(Transaction*));
+    int* slotOf = (int*)calloc(unique ? unique : 1, sizeof(int));
+    int* groupStart = (int*)malloc(((sellerCount > buyerCount ? sellerCount : buyerCount) + 1) * sizeof(int));
+    if (!grouped || !slotOf || !groupStart) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    for (int i = 0; i < unique; i++)
+        slotOf[i] = entityIndexFind(&sellerIndex, sorted[i]->sellerID);
+    groupBySlot(sorted, slotOf, unique, sellerCount, grouped, groupStart);
+    for (int s = 0; s < sellerCount; s++)
+        buildBPTreeFromSorted(&sellers[s].transactionTree, grouped + groupStart[s],
+                              groupStart[s + 1] - groupStart[s], transactionIdKey);
+    for (int i = 0; i < unique; i++)
+        slotOf[i] = entityIndexFind(&buyerIndex, sorted[i]->buyerID);
+    groupBySlot(sorted, slotOf, unique, buyerCount, grouped, groupStart);
+    for (int b = 0; b < buyerCount; b++)
+        buildBPTreeFromSorted(&buyers[b].transactionTree, grouped + groupStart[b],
+                              groupStart[b + 1] - groupStart[b], transactionIdKey);
+    free(grouped);
+    free(slotOf);
+    free(groupStart);
+
+    buildSecondaryIndex(&timeIndexTree, sorted, unique, transactionTimeKey);
+    buildSecondaryIndex(&energyIndexTree, sorted, unique, transactionEnergyKey);
+    free(sorted);
+    
+    loading_mode = 0;
+    return totalLoaded;
+}
+
+void verifyLoadedTree(int totalLoaded) {
+    printf("Verifying B+ tree structure...\n");
+    
+    int treeCount = countTransactionsInTree(globalTransactionTree);
+    printf("Count of transactions in B+ tree: %d\n", treeCount);
+    
+    if (treeCount != totalLoaded) {
+        printf("WARNING: Mismatch between loaded transactions (%d) and tree count (%d)!\n", 
+               totalLoaded, treeCount);
+    }
+}
+
+void loadTransactionFile(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("No existing transactions found. Starting fresh.\n");
+        return;
+    }
+    MappedRange file;
+    if (mapFileRange(fd, 0, &file) != 0) {
+        printf("Error reading %s: %s\n", path, strerror(errno));
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    double began = currentTimeSeconds();
+    ParsedRows parsed;
+    parseTransactionText(file.data, file.size, 0, &parsed);
+    unmapFileRange(&file);
+    double parsedAt = currentTimeSeconds();
+
+    int duplicates;
+    int totalLoaded = applyLoadedRows(parsed.rows, parsed.count, &duplicates);
+    double finishedAt = currentTimeSeconds();
+    lastLoadStats.threads = parsed.threads;
+    lastLoadStats.lines = parsed.count + parsed.malformed;
+    lastLoadStats.parseSeconds = parsedAt - began;
+    lastLoadStats.buildSeconds = finishedAt - parsedAt;
+    printf("Successfully loaded %d transactions from %d lines in %.1f ms (parse %.1f ms on %d thread%s).\n",
+           totalLoaded, lastLoadStats.lines, (finishedAt - began) * 1e3,
+           lastLoadStats.parseSeconds * 1e3, parsed.threads, parsed.threads == 1 ? "" : "s");
+    printf("Skipped %d duplicates and %d malformed lines. Replayed %d deletes.\n",
+           duplicates, parsed.malformed, parsed.tombstones);
+    verifyLoadedTree(totalLoaded);
+}
+
+/* ============== CHECKPOINTS AND RECOVERY ============== */
+/* A checkpoint writes the live state to SNAPSHOT_FILE and then drops the WAL records
+   it covers, so recovery time follows the WAL tail rather than the whole history.
+   The snapshot is column-oriented: a fixed header, the transaction fields as one
+   array each in ID order, the seller rate table, and the buyer IDs in registry order
+   (the order reports list entities in). Every column is padded to 8 bytes so the
+   loader reads it in place from the mapping. Integers are in host byte order.
+   A checkpoint runs in three steps:
+     1. The main thread copies the live state and notes the last LSN and the WAL's end.
+     2. A worker thread writes the copy to a temporary file, syncs it and renames it
+        over the snapshot.
+     3. Back on the main thread, the records appended since step 1 are copied into a
+        new WAL that starts at the next LSN, which is renamed over the old one.
+   A crash between steps 2 and 3 leaves a WAL that still holds records the snapshot
+   covers; recovery skips them by LSN. */
+#define SNAPSHOT_MAGIC "ETSNAPSH"
+#define SNAPSHOT_VERSION 2
+#ifndef CHECKPOINT_EVERY_RECORDS
+#define CHECKPOINT_EVERY_RECORDS 100000
+#endif
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    uint64_t transactionCount;
+    uint64_t sellerCount;
+    uint64_t buyerCount;       // buyers with live transactions
+    uint64_t checkpointLsn;    // last WAL record reflected in the columns
+    uint32_t bodyChecksum;     // CRC-32C of everything after the header
+    uint32_t headerChecksum;   // CRC-32C of the header up to this field
+} SnapshotHeader;
+
+enum {
+    COLUMN_EPOCH, COLUMN_ENERGY, COLUMN_PRICE, COLUMN_TOTAL,
+    COLUMN_TRANSACTION_ID, COLUMN_BUYER_ID, COLUMN_SELLER_ID, TRANSACTION_COLUMNS
+};
+
+size_t snapshotColumnBytes(uint64_t count, size_t width) {
+    return (size_t)((count * width + 7) & ~(uint64_t)7);
+}
+
+size_t transactionColumnWidth(int column) {
+    return column < COLUMN_TRANSACTION_ID ? 8 : 4;
+}
+
+size_t snapshotBodyBytes(uint64_t transactions, uint64_t sellers, uint64_t buyers) {
+    size_t bytes = 0;
+    for (int c = 0; c < TRANSACTION_COLUMNS; c++)
+        bytes += snapshotColumnBytes(transactions, transactionColumnWidth(c));
+    return bytes + snapshotColumnBytes(sellers, 4) + 2 * snapshotColumnBytes(sellers, 8) +
+           snapshotColumnBytes(buyers, 4);
+}
+
+// A private copy of the live state, so the snapshot can be written off the main thread
+typedef struct {
+    Transaction* transactions;  // in ID order
+    int transactionCount;
+    int32_t* sellerIDs;
+    double* ratesBelow300;
+    double* ratesAbove300;
+    int sellerCount;
+    int32_t* buyerIDs;
+    int buyerCount;
+    uint64_t lsn;
+} SnapshotImage;
+
+void freeSnapshotImage(SnapshotImage* image) {
+    free(image->transactions);
+    free(image->sellerIDs);
+    free(image->ratesBelow300);
+    free(image->ratesAbove300);
+    free(image->buyerIDs);
+    memset(image, 0, sizeof(SnapshotImage));
+}
+
+void captureShardedSellers(SnapshotImage* image);
+
+// Returns -1 if the copy does not fit in memory
+int captureSnapshotImage(SnapshotImage* image) {
+    memset(image, 0, sizeof(SnapshotImage));
+    int count = countTransactionsInTree(globalTransactionTree);
+    int sellerTotal = shardCount > 0 ? countShardedSellers() : sellerCount;
+    image->transactions = (Transaction*)malloc((count ? count : 1) * sizeof(Transaction));
+    image->sellerIDs = (int32_t*)malloc((sellerTotal ? sellerTotal : 1) * sizeof(int32_t));
+    image->ratesBelow300 = (double*)malloc((sellerTotal ? sellerTotal : 1) * sizeof(double));
+    image->ratesAbove300 = (double*)malloc((sellerTotal ? sellerTotal : 1) * sizeof(double));
+    image->buyerIDs = (int32_t*)malloc((buyerCount ? buyerCount : 1) * sizeof(int32_t));
+    if (!image->transactions || !image->sellerIDs || !image->ratesBelow300 ||
+        !image->ratesAbove300 || !image->buyerIDs) {
+        freeSnapshotImage(image);
+        return -1;
+    }
+    BPTreeCursor cursor;
+    for (BPTreeNode* leaf = seekBPTree(globalTransactionTree, LLONG_MIN, &cursor); leaf;
+         leaf = nextLeafInBPTree(&cursor))
+        for (int i = 0; i < leaf->numKeys; i++)
+            image->transactions[image->transactionCount++] = *leaf->records[i];
+    if (shardCount > 0) {
+        captureShardedSellers(image);
+    } else {
+        for (int i = 0; i < sellerCount; i++) {
+            image->sellerIDs[i] = sellers[i].sellerID;
+            image->ratesBelow300[i] = sellers[i].rateBelow300;
+            image->ratesAbove300[i] = sellers[i].rateAbove300;
+        }
+        image->sellerCount = sellerCount;
+    }
+    for (int i = 0; i < buyerCount; i++)
+        if (buyers[i].numTransactions > 0)
+            image->buyerIDs[image->buyerCount++] = buyers[i].buyerID;
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint32_t crc;
+    size_t written;
+    size_t used;
+    int failed;
+    unsigned char buffer[64 * 1024];
+} SnapshotWriter;
+
+void snapshotFlush(SnapshotWriter* writer) {
+    for (size_t put = 0; put < writer->used && !writer->failed; ) {
+        ssize_t n = write(writer->fd, writer->buffer + put, writer->used - put);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) writer->failed = 1;
+        else put += (size_t)n;
+    }
+    writer->crc = crc32c(writer->crc, writer->buffer, writer->used);
+    writer->written += writer->used;
+    writer->used = 0;
+}
+
+void snapshotPut(SnapshotWriter* writer, const void* value, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)value;
+    while (length > 0) {
+        if (writer->used == sizeof(writer->buffer)) snapshotFlush(writer);
+        size_t piece = sizeof(writer->buffer) - writer->used;
+        if (piece > length) piece = length;
+        memcpy(writer->buffer + writer->used, bytes, piece);
+        writer->used += piece;
+        bytes += piece;
+        length -= piece;
+    }
+}
+
+void snapshotPad(SnapshotWriter* writer) {
+    static const unsigned char zeros[8];
+    size_t total = writer->written + writer->used;
+    if (total % 8) snapshotPut(writer, zeros, 8 - total % 8);
+}
+
+void snapshotPutTransactionColumn(SnapshotWriter* writer, const SnapshotImage* image, int column) {
+    for (int i = 0; i < image->transactionCount; i++) {
+        const Transaction* t = &image->transactions[i];
+        int32_t id;
+        switch (column) {
+            case COLUMN_EPOCH: { int64_t epoch = t->epoch; snapshotPut(writer, &epoch, 8); break; }
+            case COLUMN_ENERGY: snapshotPut(writer, &t->energyAmount, 8); break;
+            case COLUMN_PRICE: snapshotPut(writer, &t->pricePerKwh, 8); break;
+            case COLUMN_TOTAL: snapshotPut(writer, &t->totalPrice, 8); break;
+            case COLUMN_TRANSACTION_ID: id = t->transactionID; snapshotPut(writer, &id, 4); break;
+            case COLUMN_BUYER_ID: id = t->buyerID; snapshotPut(writer, &id, 4); break;
+            default: id = t->sellerID; snapshotPut(writer, &id, 4); break;
+        }
+    }
+    snapshotPad(writer);
+}
+
+/* Writes the image to path through a temporary file that is synced and renamed into
+   place. Prints nothing, so it can run on the checkpoint thread. Returns 0 on success. */
+int writeSnapshotImage(const char* path, const SnapshotImage* image) {
+    char tempPath[256];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.headerBytes = sizeof(SnapshotHeader);
+    header.transactionCount = (uint64_t)image->transactionCount;
+    header.sellerCount = (uint64_t)image->sellerCount;
+    header.buyerCount = (uint64_t)image->buyerCount;
+    header.checkpointLsn = image->lsn;
+
+    SnapshotWriter* writer = (SnapshotWriter*)malloc(sizeof(SnapshotWriter));
+    if (!writer) return -1;
+    memset(writer, 0, offsetof(SnapshotWriter, buffer));
+    writer->fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+        free(writer);
+        return -1;
+    }
+    // The header goes in last, once the body checksum is known
+    if (lseek(writer->fd, sizeof(SnapshotHeader), SEEK_SET) < 0) writer->failed = 1;
+    for (int c = 0; c < TRANSACTION_COLUMNS; c++)
+        snapshotPutTransactionColumn(writer, image, c);
+    snapshotPut(writer, image->sellerIDs, image->sellerCount * sizeof(int32_t));
+    snapshotPad(writer);
+    snapshotPut(writer, image->ratesBelow300, image->sellerCount * sizeof(double));
+    snapshotPut(writer, image->ratesAbove300, image->sellerCount * sizeof(double));
+    snapshotPut(writer, image->buyerIDs, image->buyerCount * sizeof(int32_t));
+    snapshotPad(writer);
+    snapshotFlush(writer);
+
+    header.bodyChecksum = writer->crc;
+    header.headerChecksum = crc32c(0, &header, offsetof(SnapshotHeader, headerChecksum));
+    int failed = writer->failed ||
+                 pwrite(writer->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+                 fsync(writer->fd) != 0;
+    if (close(writer->fd) != 0) failed = 1;
+    free(writer);
+    if (failed || rename(tempPath, path) != 0) {
+        remove(tempPath);
+        return -1;
+    }
+    syncDirectory();
+    return 0;
+}
+
+typedef struct {
+    long long checkpointEvery;        // WAL records between automatic checkpoints; 0 turns them off
+    long long recordsSinceCheckpoint;
+    uint64_t checkpointLsn;           // last LSN the snapshot on disk covers
+    long long checkpoints;
+    // State of the checkpoint in flight, if any
+    int running;
+    int workerDone;  // guarded by lock
+    int workerFailed;
+    pthread_mutex_t lock;
+    pthread_t worker;
+    SnapshotImage image;
+    off_t walOffset;                  // WAL bytes the image covers
+    long long recordsAtStart;
+} Checkpointer;
+
+Checkpointer checkpointer = { .checkpointEvery = CHECKPOINT_EVERY_RECORDS, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void* checkpointWorker(void* arg) {
+    Checkpointer* c = (Checkpointer*)arg;
+    int failed = writeSnapshotImage(SNAPSHOT_FILE, &c->image) != 0;
+    pthread_mutex_lock(&c->lock);
+    c->workerFailed = failed;
+    c->workerDone = 1;
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+void startCheckpoint() {
+    Checkpointer* c = &checkpointer;
+    if (c->running || transactionLog.fd < 0) return;
+    if (captureSnapshotImage(&c->image) != 0) {
+        printf("Memory allocation failed.\n");
+        return;
+    }
+    // Everything up to this LSN is in the image, and in the WAL before this offset
+    pthread_mutex_lock(&transactionLog.lock);
+    int drained = appendLogDrainLocked(&transactionLog) == 0;
+    c->walOffset = lseek(transactionLog.fd, 0, SEEK_END);
+    c->image.lsn = transactionLog.nextLsn - 1;
+    pthread_mutex_unlock(&transactionLog.lock);
+    if (!drained || c->walOffset < 0) {
+        freeSnapshotImage(&c->image);
+        return;
+    }
+    c->recordsAtStart = c->recordsSinceCheckpoint;
+    c->workerDone = 0;
+    c->workerFailed = 0;
+    c->running = 1;
+    if (pthread_create(&c->worker, NULL, checkpointWorker, c) != 0) {
+        printf("Error starting the checkpoint thread.\n");
+        freeSnapshotImage(&c->image);
+        c->running = 0;
+    }
+}
+
+// Moves the records after the checkpoint into a fresh WAL and swaps it in
+int trimCheckpointedWal(AppendLog* log, Checkpointer* c) {
+    char tempPath[256];
+    snprintf(tempPath, sizeof(tempPath), "%s.new", log->path);
+    int status = -1;
+    int newFd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    int oldFd = open(log->path, O_RDONLY);
+    if (newFd < 0 || oldFd < 0 || walWriteHeader(newFd, c->image.lsn + 1) != 0) goto done;
+
+    pthread_mutex_lock(&log->lock);
+    while (log->syncsInFlight > 0)
+        pthread_cond_wait(&log->syncDone, &log->lock);
+    if (appendLogDrainLocked(log) != 0) goto unlock;
+    char chunk[64 * 1024];
+    off_t offset = c->walOffset;
+    for (;;) {
+        ssize_t got = pread(oldFd, chunk, sizeof(chunk), offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) goto unlock;
+        if (got == 0) break;
+        for (ssize_t put = 0; put < got; ) {
+            ssize_t written = write(newFd, chunk + put, (size_t)(got - put));
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) goto unlock;
+            put += written;
+        }
+        offset += got;
+    }
+    if (fdatasync(newFd) != 0 || rename(tempPath, log->path) != 0) goto unlock;
+    syncDirectory();
+    close(log->fd);
+    log->fd = newFd;
+    newFd = -1;
+    log->pendingRecords = 0;
+    log->writtenBytes = log->syncedBytes = lseek(log->fd, 0, SEEK_END);
+    status = 0;
+unlock:
+    pthread_mutex_unlock(&log->lock);
+done:
+    if (newFd >= 0) {
+        close(newFd);
+        remove(tempPath);
+    }
+    if (oldFd >= 0) close(oldFd);
+    return status;
+}
+
+/* Completes a checkpoint whose worker has finished. With wait set, blocks until it has. */
+void pollCheckpoint(int wait) {
+    Checkpointer* c = &checkpointer;
+    if (!c->running) return;
+    pthread_mutex_lock(&c->lock);
+    int done = c->workerDone;
+    pthread_mutex_unlock(&c->lock);
+    if (!done && !wait) return;
+    pthread_join(c->worker, NULL);
+    c->running = 0;
+    if (c->workerFailed) {
+        printf("Warning: Writing %s failed; the WAL keeps every record.\n", SNAPSHOT_FILE);
+        freeSnapshotImage(&c->image);
+        return;
+    }
+    c->checkpointLsn = c->image.lsn;
+    if (trimCheckpointedWal(&transactionLog, c) != 0) {
+        // The snapshot stands; the covered records are skipped on replay until the next try
+        printf("Warning: Could not trim %s after the checkpoint.\n", transactionLog.path);
+    } else {
+        c->recordsSinceCheckpoint -= c->recordsAtStart;
+        c->checkpoints++;
+    }
+    freeSnapshotImage(&c->image);
+}
+
+// Checkpoints now and waits for it; returns 0 once the snapshot is on disk
+int checkpointNow() {
+    pollCheckpoint(1);
+    startCheckpoint();
+    if (!checkpointer.running) return -1;
+    pollCheckpoint(1);
+    return checkpointer.workerFailed ? -1 : 0;
+}
+
+/* Log segments of a sharded ingest replay after the WAL, so they have to go before
+   the WAL takes another record: a checkpoint covers their trades, then they are
+   removed. Returns -1, keeping them, if the checkpoint fails. */
+int retireShardSegments() {
+    if (checkpointNow() != 0) {
+        printf("Warning: Could not checkpoint the shard log segments; they are replayed again at the next start.\n");
+        return -1;
+    }
+    char path[64];
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        snprintf(path, sizeof(path), SHARD_SEGMENT_FILE, i);
+        remove(path);
+    }
+    syncDirectory();
+    return 0;
+}
+
+// Called after each record reaches the WAL
+void noteWalRecord() {
+    Checkpointer* c = &checkpointer;
+    c->recordsSinceCheckpoint++;
+    pollCheckpoint(0);
+    if (c->checkpointEvery > 0 && c->recordsSinceCheckpoint >= c->checkpointEvery)
+        startCheckpoint();
+}
+
+void printCheckpointStatus() {
+    Checkpointer* c = &checkpointer;
+    printf("Write-ahead log: %lld records since the checkpoint at LSN %llu, next LSN %llu\n",
+           c->recordsSinceCheckpoint, (unsigned long long)c->checkpointLsn,
+           (unsigned long long)transactionLog.nextLsn);
+    if (c->checkpointEvery > 0)
+        printf("Checkpoints run every %lld records; %lld completed%s\n", c->checkpointEvery,
+               c->checkpoints, c->running ? " (one in progress)" : "");
+    else
+        printf("Automatic checkpoints are off; %lld completed\n", c->checkpoints);
+}
+
+/* Reads the snapshot at path: sellers and buyers are registered straight away and the
+   transactions come back as rows in ID order. Returns 0 if there is no usable
+   snapshot, after saying why unless the file is simply missing. */
+int loadSnapshotRows(const char* path, uint64_t* checkpointLsn, LoadedRow** rowsOut, int* countOut) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    MappedRange file;
+    int mapped = mapFileRange(fd, 0, &file);
+    close(fd);
+    const char* problem = NULL;
+    const SnapshotHeader* header = (const SnapshotHeader*)file.data;
+    if (mapped != 0) {
+        problem = "cannot be read";
+    } else if (file.size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0) {
+        problem = "is not a snapshot";
+    } else if (header->version != SNAPSHOT_VERSION || header->headerBytes != sizeof(SnapshotHeader)) {
+        problem = "has an unsupported version";
+    } else if (header->headerChecksum != crc32c(0, header, offsetof(SnapshotHeader, headerChecksum)) ||
+               header->transactionCount > (uint64_t)INT_MAX || header->sellerCount > (uint64_t)INT_MAX ||
+               header->buyerCount > (uint64_t)INT_MAX ||
+               file.size != sizeof(SnapshotHeader) +
+                            snapshotBodyBytes(header->transactionCount, header->sellerCount, header->buyerCount) ||
+               header->bodyChecksum != crc32c(0, file.data + sizeof(SnapshotHeader), file.size - sizeof(SnapshotHeader))) {
+        problem = "is damaged";
+    }
+    if (problem) {
+        printf("Snapshot %s %s; ignoring it.\n", path, problem);
+        unmapFileRange(&file);
+        return 0;
+    }
+
+    int count = (int)header->transactionCount;
+    int sellerTotal = (int)header->sellerCount;
+    const char* column = file.data + sizeof(SnapshotHeader);
+    const void* columns[TRANSACTION_COLUMNS];
+    for (int c = 0; c < TRANSACTION_COLUMNS; c++) {
+        columns[c] = column;
+        column += snapshotColumnBytes(count, transactionColumnWidth(c));
+    }
+    const int32_t* sellerIDs = (const int32_t*)column;
+    column += snapshotColumnBytes(sellerTotal, 4);
+    const double* ratesBelow300 = (const double*)column;
+    column += snapshotColumnBytes(sellerTotal, 8);
+    const double* ratesAbove300 = (const double*)column;
+    column += snapshotColumnBytes(sellerTotal, 8);
+    const int32_t* buyerIDs = (const int32_t*)column;
+
+    for (int i = 0; i < sellerTotal; i++) {
+        Seller* seller = findSeller(sellerIDs[i]);
+        if (seller) {
+            seller->rateBelow300 = ratesBelow300[i];
+            seller->rateAbove300 = ratesAbove300[i];
+        } else {
+            addSeller(sellerIDs[i], ratesBelow300[i], ratesAbove300[i]);
+        }
+    }
+    // Registering the buyers up front keeps their order; the leaderboard is rebuilt later
+    loading_mode = 1;
+    for (int i = 0; i < (int)header->buyerCount; i++)
+        if (!findBuyer(buyerIDs[i])) addBuyer(buyerIDs[i]);
+    loading_mode = 0;
+
+    LoadedRow* rows = (LoadedRow*)malloc((count ? count : 1) * sizeof(LoadedRow));
+    if (!rows) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    const int64_t* epochs = (const int64_t*)columns[COLUMN_EPOCH];
+    const double* energies = (const double*)columns[COLUMN_ENERGY];
+    const double* prices = (const double*)columns[COLUMN_PRICE];
+    const double* totals = (const double*)columns[COLUMN_TOTAL];
+    const int32_t* transactionIDs = (const int32_t*)columns[COLUMN_TRANSACTION_ID];
+    const int32_t* rowBuyerIDs = (const int32_t*)columns[COLUMN_BUYER_ID];
+    const int32_t* rowSellerIDs = (const int32_t*)columns[COLUMN_SELLER_ID];
+    for (int i = 0; i < count; i++) {
+        Transaction* t = (Transaction*)poolAlloc(&transactionPool);
+        t->epoch = epochs[i];
+        t->energyAmount = energies[i];
+        t->pricePerKwh = prices[i];
+        t->totalPrice = totals[i];
+        t->transactionID = transactionIDs[i];
+        t->buyerID = rowBuyerIDs[i];
+        t->sellerID = rowSellerIDs[i];
+        rows[i].t = t;
+        rows[i].transactionID = t->transactionID;
+        rows[i].seq = i;
+    }
+    *checkpointLsn = header->checkpointLsn;
+    *rowsOut = rows;
+    *countOut = count;
+    unmapFileRange(&file);
+    return 1;
+}
+
+typedef struct {
+    uint64_t firstLsn;
+    uint64_t lastLsn;       // of the last intact record; firstLsn - 1 if there is none
+    long long replayed;     // records after the checkpoint
+    long long skipped;      // records the checkpoint already covers
+    long long tornBytes;    // cut from the end of the file
+} WalReplayStats;
+
+/* Replays the WAL at path on top of a snapshot ending at checkpointLsn. Inserts and
+   deletes become rows appended to *rows, numbered on from *count; seller rates are
+   applied at once. If inputOffsets is not NULL, (*inputOffsets)[i] gets the input
+   offset of a shard insert in row i (0 for other rows). Replay stops at the first record that is cut short, fails its
+   checksum or breaks the LSN sequence, and the file is truncated there: that is the
+   write a crash interrupted. Returns -1, leaving the file alone, if it is not a WAL. */
+int replayWal(const char* path, uint64_t checkpointLsn, LoadedRow** rows, int* count, uint64_t** inputOffsets,
+              WalReplayStats* stats) {
+    memset(stats, 0, sizeof(WalReplayStats));
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return -1;
+    MappedRange file;
+    if (mapFileRange(fd, 0, &file) != 0) {
+        close(fd);
+        return -1;
+    }
+    const WalFileHeader* header = (const WalFileHeader*)file.data;
+    if (file.size < sizeof(WalFileHeader) || memcmp(header->magic, WAL_MAGIC, 8) != 0 ||
+        header->version != WAL_VERSION || header->headerBytes != sizeof(WalFileHeader) ||
+        header->checksum != crc32c(0, header, offsetof(WalFileHeader, checksum))) {
+        unmapFileRange(&file);
+        close(fd);
+        return -1;
+    }
+    stats->firstLsn = header->firstLsn;
+    stats->lastLsn = header->firstLsn - 1;
+
+    int capacity = *count;
+    size_t offset = sizeof(WalFileHeader);
+    while (offset + sizeof(WalRecordHeader) <= file.size) {
+        WalRecordHeader record;
+        memcpy(&record, file.data + offset, sizeof(record));
+        size_t length = walPayloadBytes(record.type);
+        if (length == 0 || record.length != length || offset + sizeof(record) + length > file.size) break;
+        const char* payload = file.data + offset + sizeof(record);
+        if (record.checksum != walRecordChecksum(&record, payload) || record.lsn != stats->lastLsn + 1) break;
+        offset += sizeof(record) + length;
+        stats->lastLsn = record.lsn;
+        if (record.lsn <= checkpointLsn) {
+            stats->skipped++;
+            continue;
+        }
+        stats->replayed++;
+        if (record.type == WAL_SELLER_RATES) {
+            WalSellerRates rates;
+            memcpy(&rates, payload, sizeof(rates));
+            Seller* seller = findSeller(rates.sellerID);
+            if (seller) {
+                seller->rateBelow300 = rates.rateBelow300;
+                seller->rateAbove300 = rates.rateAbove300;
+            } else {
+                addSeller(rates.sellerID, rates.rateBelow300, rates.rateAbove300);
+            }
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            *rows = (LoadedRow*)realloc(*rows, capacity * sizeof(LoadedRow));
+            if (inputOffsets) *inputOffsets = (uint64_t*)realloc(*inputOffsets, capacity * sizeof(uint64_t));
+            if (!*rows || (inputOffsets && !*inputOffsets)) {
+                printf("Memory allocation failed.\n");
+                exit(1);
+            }
+        }
+        if (inputOffsets) {
+            (*inputOffsets)[*count] = 0;
+            if (record.type == WAL_SHARD_INSERT)
+                memcpy(&(*inputOffsets)[*count], payload + offsetof(WalShardInsert, inputOffset), sizeof(uint64_t));
+        }
+        LoadedRow* row = &(*rows)[*count];
+        row->seq = (*count)++;
+        row->t = NULL;
+        if (record.type == WAL_INSERT || record.type == WAL_SHARD_INSERT) {
+            WalInsert insert;
+            memcpy(&insert, payload, sizeof(insert));
+            Transaction* t = (Transaction*)poolAlloc(&transactionPool);
+            t->epoch = insert.epoch;
+            t->energyAmount = insert.energyAmount;
+            t->pricePerKwh = insert.pricePerKwh;
+            t->totalPrice = insert.totalPrice;
+            t->transactionID = insert.transactionID;
+            t->buyerID = insert.buyerID;
+            t->sellerID = insert.sellerID;
+            row->t = t;
+            row->transactionID = insert.transactionID;
+        } else {
+            WalDelete del;
+            memcpy(&del, payload, sizeof(del));
+            row->transactionID = del.transactionID;
+        }
+    }
+    if (offset < file.size) {
+        stats->tornBytes = (long long)(file.size - offset);
+        if (ftruncate(fd, (off_t)offset) != 0 || fsync(fd) != 0)
+            printf("Error truncating %s: %s\n", path, strerror(errno));
+    }
+    unmapFileRange(&file);
+    close(fd);
+    return 0;
+}
+
+typedef struct {
+    uint64_t inputOffset;
+    LoadedRow row;
+} SegmentRow;
+
+int compareSegmentRows(const void* a, const void* b) {
+    const SegmentRow* x = (const SegmentRow*)a;
+    const SegmentRow* y = (const SegmentRow*)b;
+    if (x->inputOffset != y->inputOffset) return x->inputOffset < y->inputOffset ? -1 : 1;
+    return x->row.seq - y->row.seq;
+}
+
+/* Replays the log segments a sharded ingest left behind after the WAL rows. Their rows
+   are put in input file order, so an ID two shards took goes to the earlier line, as
+   it did when the ingest ran. Returns how many segments there were, or -1 if one is
+   not a WAL. */
+int replayShardSegments(LoadedRow** rows, int* count) {
+    int segments = 0, first = *count;
+    uint64_t* inputOffsets = NULL;
+    char path[64];
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        snprintf(path, sizeof(path), SHARD_SEGMENT_FILE, i);
+        if (access(path, F_OK) != 0) continue;
+        WalReplayStats stats;
+        if (replayWal(path, 0, rows, count, &inputOffsets, &stats) != 0) {
+            printf("Error: %s is not a readable write-ahead log.\n", path);
+            free(inputOffsets);
+            return -1;
+        }
+        if (stats.tornBytes > 0)
+            printf("Discarded a torn write: %lld bytes cut from the end of %s.\n", stats.tornBytes, path);
+        segments++;
+    }
+    int segmentRows = *count - first;
+    if (segmentRows > 1) {
+        SegmentRow* ordered = (SegmentRow*)malloc(segmentRows * sizeof(SegmentRow));
+        if (!ordered) {
+            printf("Memory allocation failed.\n");
+            exit(1);
+        }
+        for (int i = 0; i < segmentRows; i++) {
+            ordered[i].inputOffset = inputOffsets[first + i];
+            ordered[i].row = (*rows)[first + i];
+        }
+        qsort(ordered, segmentRows, sizeof(SegmentRow), compareSegmentRows);
+        for (int i = 0; i < segmentRows; i++) {
+            (*rows)[first + i] = ordered[i].row;
+            (*rows)[first + i].seq = first + i;
+        }
+        free(ordered);
+    }
+    free(inputOffsets);
+    return segments;
+}
+
+int pendingShardSegments = 0;  // replayed at startup, retired once the WAL is open
+
+/* First start without a WAL or snapshot: the text files are read once and written as
+   the first snapshot, after which the WAL takes over. The import counts as LSN 1, so
+   losing that snapshot later shows up as a gap before the WAL's first record. */
+int importLegacyFiles() {
+    uint64_t importLsn = 0;
+    loadSellerPrices();
+    loadDataFromFile();
+    if (access(TRANSACTION_FILE, F_OK) == 0 || sellerCount > 0) {
+        SnapshotImage image;
+        importLsn = 1;
+        if (captureSnapshotImage(&image) != 0) {
+            printf("Memory allocation failed.\n");
+            return -1;
+        }
+        image.lsn = importLsn;
+        int failed = writeSnapshotImage(SNAPSHOT_FILE, &image) != 0;
+        freeSnapshotImage(&image);
+        if (failed) {
+            printf("Error: Could not write %s; the text files are still the only copy.\n", SNAPSHOT_FILE);
+            return -1;
+        }
+        printf("Imported %s and %s into %s.\n", TRANSACTION_FILE, SELLER_PRICES_FILE, SNAPSHOT_FILE);
+    }
+    if (walCreate(WAL_FILE, importLsn + 1) != 0) {
+        printf("Error creating %s: %s\n", WAL_FILE, strerror(errno));
+        return -1;
+    }
+    transactionLog.nextLsn = importLsn + 1;
+    checkpointer.checkpointLsn = importLsn;
+    return 0;
+}
+
+/* Rebuilds the in-memory state at startup from the snapshot and the WAL records after
+   it. Returns -1 if the WAL is unusable; the files are then left as they are. */
+int recoverState() {
+    int haveWal = access(WAL_FILE, F_OK) == 0;
+    double began = currentTimeSeconds();
+    uint64_t checkpointLsn = 0;
+    LoadedRow* rows = NULL;
+    int count = 0;
+    int restored = loadSnapshotRows(SNAPSHOT_FILE, &checkpointLsn, &rows, &count);
+    if (!haveWal && !restored) return importLegacyFiles();
+    int snapshotRows = count;
+
+    WalReplayStats stats;
+    if (!haveWal) {
+        // The crash came after the first snapshot but before its WAL was created
+        if (walCreate(WAL_FILE, checkpointLsn + 1) != 0) {
+            printf("Error creating %s: %s\n", WAL_FILE, strerror(errno));
+            return -1;
+        }
+        memset(&stats, 0, sizeof(stats));
+        stats.firstLsn = checkpointLsn + 1;
+        stats.lastLsn = checkpointLsn;
+    } else if (replayWal(WAL_FILE, checkpointLsn, &rows, &count, NULL, &stats) != 0) {
+        printf("Error: %s is not a readable write-ahead log.\n", WAL_FILE);
+        return -1;
+    }
+    if (stats.firstLsn > checkpointLsn + 1)
+        printf("Warning: %s starts at LSN %llu but the snapshot only reaches LSN %llu; the changes in between are lost.\n",
+               WAL_FILE, (unsigned long long)stats.firstLsn, (unsigned long long)checkpointLsn);
+    if (stats.tornBytes > 0)
+        printf("Discarded a torn write: %lld bytes cut from the end of %s.\n", stats.tornBytes, WAL_FILE);
+    int walRows = count;
+    pendingShardSegments = replayShardSegments(&rows, &count);
+    if (pendingShardSegments < 0) return -1;
+    if (pendingShardSegments > 0)
+        printf("Replayed %d trades from %d log segment%s of an interrupted sharded ingest.\n",
+               count - walRows, pendingShardSegments, pendingShardSegments == 1 ? "" : "s");
+    double readAt = currentTimeSeconds();
+
+    int duplicates;
+    int totalLoaded = applyLoadedRows(rows, count, &duplicates);
+    uint64_t lastLsn = stats.lastLsn > checkpointLsn ? stats.lastLsn : checkpointLsn;
+    transactionLog.nextLsn = lastLsn + 1;
+    checkpointer.checkpointLsn = checkpointLsn;
+    checkpointer.recordsSinceCheckpoint = stats.replayed;
+    double finishedAt = currentTimeSeconds();
+    lastLoadStats.threads = 1;
+    lastLoadStats.lines = (int)stats.replayed;
+    lastLoadStats.parseSeconds = readAt - began;
+    lastLoadStats.buildSeconds = finishedAt - readAt;
+    if (restored)
+        printf("Recovered %d transactions in %.1f ms: %d from the snapshot at LSN %llu, then %lld WAL records up to LSN %llu.\n",
+               totalLoaded, (finishedAt - began) * 1e3, snapshotRows, (unsigned long long)checkpointLsn,
+               stats.replayed, (unsigned long long)lastLsn);
+    else
+        printf("Recovered %d transactions in %.1f ms from %lld WAL records up to LSN %llu.\n",
+               totalLoaded, (finishedAt - began) * 1e3, stats.replayed, (unsigned long long)lastLsn);
+    if (duplicates > 0)
+        printf("Skipped %d duplicate inserts.\n", duplicates);
+    verifyLoadedTree(totalLoaded);
+    return 0;
+}
+
+/* Writes path through a temporary file that is synced and renamed over it. */
+int replaceTextFile(const char* path, int (*writeBody)(FILE* out)) {
+    char tempPath[256];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    FILE* out = fopen(tempPath, "w");
+    if (!out) return -1;
+    int failed = writeBody(out) != 0 || fflush(out) != 0 || fsync(fileno(out)) != 0;
+    if (fclose(out) != 0) failed = 1;
+    if (failed || rename(tempPath, path) != 0) {
+        remove(tempPath);
+        return -1;
+    }
+    syncDirectory();
+    return 0;
+}
+
+int writeTransactionsText(FILE* out) {
+    BPTreeCursor cursor;
+    for (BPTreeNode* leaf = seekBPTree(globalTransactionTree, LLONG_MIN, &cursor); leaf;
+         leaf = nextLeafInBPTree(&cursor)) {
+        for (int i = 0; i < leaf->numKeys; i++) {
+            const Transaction* t = leaf->records[i];
+            char timestamp[30];
+            formatTimestamp(t->epoch, timestamp, sizeof(timestamp));
+            if (fprintf(out, "%d,%d,%d,%.2f,%.2f,%.2f,%s\n", t->transactionID, t->buyerID, t->sellerID,
+                        t->energyAmount, t->pricePerKwh, t->totalPrice, timestamp) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int writeSellerPricesText(FILE* out) {
+    for (int i = 0; i < sellerCount; i++) {
+        if (fprintf(out, "%d %.2lf %.2lf\n", sellers[i].sellerID, sellers[i].rateBelow300, sellers[i].rateAbove300) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Mirrors the live state into the text files, for reading or for another tool. They
+   are not read back while the WAL exists. */
+void exportTextFiles() {
+    if (replaceTextFile(TRANSACTION_FILE, writeTransactionsText) != 0 ||
+        replaceTextFile(SELLER_PRICES_FILE, writeSellerPricesText) != 0) {
+        printf("Error exporting the text files: %s\n", strerror(errno));
+        return;
+    }
+    printf("Exported %d transactions to %s and %d sellers to %s.\n",
+           countTransactionsInTree(globalTransactionTree), TRANSACTION_FILE, sellerCount, SELLER_PRICES_FILE);
+}
+
+/* Positions cursor at the first key >= key and returns its leaf, or NULL for an empty
+   tree. The slot may equal numKeys, in which case the scan continues at the next leaf. */
+BPTreeNode* seekBPTree(BPTreeNode* root, BPKey key, BPTreeCursor* cursor) {
+    cursor->path.depth = 0;
+    cursor->pos = 0;
+    if (!root) return NULL;
+    BPTreeNode* leaf = findLeafWithPath(root, key, &cursor->path);
+    cursor->pos = key == LLONG_MIN ? 0 : nodeUpperBound(leaf->keys, leaf->numKeys, key - 1);
+    return leaf;
+}
+
+/* Moves the cursor to the first slot of the next leaf and returns that leaf, or NULL
+   after the last one. */
+BPTreeNode* nextLeafInBPTree(BPTreeCursor* cursor) {
+    BPTreePath* path = &cursor->path;
+    int level = path->depth - 2;
+    while (level >= 0 && path->childIdx[level] == path->nodes[level]->numKeys) level--;
+    if (level < 0) return NULL;
+    BPTreeNode* node = path->nodes[level]->children[++path->childIdx[level]];
+    for (level++; !node->isLeaf; level++) {
+        path->nodes[level] = node;
+        path->childIdx[level] = 0;
+        node = node->children[0];
+    }
+    path->nodes[level] = node;
+    cursor->pos = 0;
+    return node;
+}
+
+Transaction* findTransactionById(BPTreeNode* root, int id) {
+    if (!root) return NULL;
+    BPTreeNode* cursor = root;
+    while (!cursor->isLeaf) {
+        cursor = cursor->children[nodeUpperBound(cursor->keys, cursor->numKeys, id)];
+    }
+    int pos = nodeFindKey(cursor, id);
+    return pos >= 0 ? cursor->records[pos] : NULL;
+}
+
+void add_transaction_table_columns(Table* table) {
+    add_table_column(table, "Transaction ID", 11);
+    add_table_column(table, "Buyer ID", 11);
+    add_table_column(table, "Seller ID", 11);
+    add_table_column(table, "Energy (kWh)", MAX_COL_WIDTH);
+    add_table_column(table, "Price/kWh", MAX_COL_WIDTH);
+    add_table_column(table, "Total Price", MAX_COL_WIDTH);
+    add_table_column(table, "Timestamp", 19);
+}
+
+// Fills the seven cells of a transaction row; row points at each cell
+void format_transaction_cells(const Transaction* t, char cells[][TRANSACTION_CELL_BYTES], const char** row) {
+    snprintf(cells[0], TRANSACTION_CELL_BYTES, "%d", t->transactionID);
+    snprintf(cells[1], TRANSACTION_CELL_BYTES, "%d", t->buyerID);
+    snprintf(cells[2], TRANSACTION_CELL_BYTES, "%d", t->sellerID);
+    snprintf(cells[3], TRANSACTION_CELL_BYTES, "%.2f", t->energyAmount);
+    snprintf(cells[4], TRANSACTION_CELL_BYTES, "%.2f", t->pricePerKwh);
+    snprintf(cells[5], TRANSACTION_CELL_BYTES, "%.2f", t->totalPrice);
+    formatTimestamp(t->epoch, cells[6], TRANSACTION_CELL_BYTES);
+    for (int i = 0; i < TRANSACTION_CELLS; i++) row[i] = cells[i];
+}
+
+void add_transaction_table_row(Table* table, const Transaction* t) {
+    char cells[TRANSACTION_CELLS][TRANSACTION_CELL_BYTES];
+    const char* row[TRANSACTION_CELLS];
+    format_transaction_cells(t, cells, row);
+    add_table_row(table, row[0], row[1], row[2], row[3], row[4], row[5], row[6]);
+}
+
+void displayTransactionsFromTree(BPTreeNode* root) {
+    if (!root) {
+        printNotice("No transactions to display.\n");
+        return;
+    }
+    // Rows print as the leaves are walked, so the count heading comes from a cheap leaf pass
+    int count = countTransactionsInTree(root);
+    printNotice("\n===== All Transactions (%d) =====\n", count);
+    writeTransactionTree(root, count, NULL);
+}
+
+void freeTransactions() {
+    releaseShards();
+    // Tree nodes and transactions live in the pools, torn down in bulk below
+    globalTransactionTree = NULL;
+    timeIndexTree = NULL;
+    energyIndexTree = NULL;
+    // Free seller data
+    for (int i = 0; i < sellerCount; i++) {
+        // Free regular buyers list
+        RegularBuyer* rb = sellers[i].regularBuyers;
+        while (rb) {
+            RegularBuyer* tempRb = rb;
+            rb = rb->next;
+            free(tempRb);
+        }
+    }
+    free(sellers);
+    sellers = NULL;
+    sellerCount = sellerCapacity = 0;
+    freeEntityIndex(&sellerIndex);
+    
+    // Free buyer data
+    free(buyers);
+    buyers = NULL;
+    buyerCount = buyerCapacity = 0;
+    freeEntityIndex(&buyerIndex);
+    free(leaderboardNodes);
+    leaderboardNodes = NULL;
+    leaderboardCapacity = 0;
+    leaderboardRoot = -1;
+    freePairCounter(&pairCounter);
+    freeRollupTable(&rollups);
+    memset(&storeTotals, 0, sizeof(storeTotals));
+    // Retired objects live in the pools too; any snapshots are gone by now
+    free(retiredObjects);
+    retiredObjects = NULL;
+    retiredCount = retiredCapacity = 0;
+
+    destroyObjectPool(&nodePool);
+    destroyObjectPool(&transactionPool);
+}
+
+void createSetOfTransactionsForSeller(int sellerID) {
+    printNotice("\n===== Transactions for Seller ID %d =====\n", sellerID);
+    
+    Seller* seller = findSeller(sellerID);
+    
+    if (!seller) {
+        printNotice("Seller ID %d not found.\n", sellerID);
+        return;
+    }
+    
+    if (!writeTransactionTree(seller->transactionTree, seller->numTransactions, NULL)) {
+        printNotice("No transactions found for Seller ID %d.\n", sellerID);
+    }
+}
+
+void createSetOfTransactionsForBuyer(int buyerID) {
+    printNotice("\n===== Transactions for Buyer ID %d =====\n", buyerID);
+    
+    Buyer* buyer = findBuyer(buyerID);
+    
+    if (!buyer) {
+        printNotice("Buyer ID %d not found.\n", buyerID);
+        return;
+    }
+    
+    if (!writeTransactionTree(buyer->transactionTree, buyer->numTransactions, NULL)) {
+        printNotice("No transactions found for Buyer ID %d.\n", buyerID);
+    }
+}
+
+ChangeStatus applyDelete(int transactionID) {
+    Transaction* t = findTransactionById(globalTransactionTree, transactionID);
+    if (!t) {
+        return CHANGE_NOT_FOUND;
+    }
+    // Record the delete in the write-ahead log before anything is removed
+    if (appendTombstone(&transactionLog, transactionID) != 0) {
+        return CHANGE_LOG_FAILED;
+    }
+    
+    int buyerID = t->buyerID;
+    int sellerID = t->sellerID;
+    double energyAmount = t->energyAmount;
+    double totalPrice = t->totalPrice;
+    
+    // Delete from global transaction tree
+    deleteTransactionFromBPTree(&globalTransactionTree, transactionID);
+    removeKeyFromBPTree(&timeIndexTree, transactionTimeKey(t));
+    removeKeyFromBPTree(&energyIndexTree, transactionEnergyKey(t));
+    
+    if (shardCount > 0) {
+        removeShardedTrade(t);
+        Buyer* buyer = findBuyer(buyerID);
+        buyer->numTransactions--;
+        adjustBuyerEnergy(buyer, -energyAmount);
+    } else {
+        // Find the seller and buyer
+        Seller* seller = findSeller(sellerID);
+        Buyer* buyer = findBuyer(buyerID);
+        
+        // Delete from seller's transaction tree if it exists
+        if (seller && seller->transactionTree) {
+            deleteTransactionFromBPTree(&seller->transactionTree, transactionID);
+            seller->numTransactions--;
+            seller->totalRevenue -= totalPrice;
+        }
+        
+        // Delete from buyer's transaction tree if it exists
+        if (buyer && buyer->transactionTree) {
+            deleteTransactionFromBPTree(&buyer->transactionTree, transactionID);
+            buyer->numTransactions--;
+            adjustBuyerEnergy(buyer, -energyAmount);
+        }
+        adjustPairCount(&pairCounter, sellerID, buyerID, -1);
+    }
+    
+    storeTotals.transactions--;
+    storeTotals.revenue -= totalPrice;
+    storeTotals.energy -= energyAmount;
+    adjustRollups(t, -1);
+    discardTransaction(t);
+    noteWalRecord();
+    return CHANGE_APPLIED;
+}
+
+void deleteTransaction(int transactionID) {
+    switch (applyDelete(transactionID)) {
+        case CHANGE_NOT_FOUND:
+            printf("Error: Transaction with ID %d does not exist.\n", transactionID);
+            break;
+        case CHANGE_LOG_FAILED:
+            printf("Error appending the delete of transaction %d to the write-ahead log.\n", transactionID);
+            break;
+        default:
+            printf("Transaction with ID %d successfully deleted.\n", transactionID);
+    }
+}
+
+void removeFromLeaf(BPTreeNode* node, int idx) {
+    for (int i = idx; i < node->numKeys - 1; i++) {
+        node->keys[i] = node->keys[i + 1];
+        node->records[i] = node->records[i + 1];
+    }
+    node->numKeys--;
+}
+
+void borrowFromNext(BPTreeNode* node, int idx) {
+    BPTreeNode* child = node->children[idx];
+    BPTreeNode* sibling = writableChild(node, idx + 1);
+    if (child->isLeaf) {
+        child->keys[child->numKeys] = sibling->keys[0];
+        child->records[child->numKeys] = sibling->records[0];
+        for (int i = 0; i < sibling->numKeys - 1; i++) {
+            sibling->keys[i] = sibling->keys[i + 1];
+            sibling->records[i] = sibling->records[i + 1];
+        }
+        node->keys[idx] = sibling->keys[0];
+    } else {
+        child->keys[child->numKeys] = node->keys[idx];
+        child->children[child->numKeys + 1] = sibling->children[0];
+        node->keys[idx] = sibling->keys[0];
+        for (int i = 0; i < sibling->numKeys - 1; i++)
+            sibling->keys[i] = sibling->keys[i + 1];
+        for (int i = 0; i < sibling->numKeys; i++)
+            sibling->children[i] = sibling->children[i + 1];
+    }
+    child->numKeys++;
+    sibling->numKeys--;
+}
+
+void borrowFromPrev(BPTreeNode* node, int idx) {
+    BPTreeNode* child = node->children[idx];
+    BPTreeNode* sibling = writableChild(node, idx - 1);
+    for (int i = child->numKeys - 1; i >= 0; i--) {
+        child->keys[i + 1] = child->keys[i];
+        if (child->isLeaf)
+            child->records[i + 1] = child->records[i];
+    }
+    if (child->isLeaf) {
+        child->keys[0] = sibling->keys[sibling->numKeys - 1];
+        child->records[0] = sibling->records[sibling->numKeys - 1];
+        node->keys[idx - 1] = child->keys[0];
+    } else {
+        for (int i = child->numKeys; i >= 0; i--)
+            child->children[i + 1] = child->children[i];
+        child->keys[0] = node->keys[idx - 1];
+        child->children[0] = sibling->children[sibling->numKeys];
+        node->keys[idx - 1] = sibling->keys[sibling->numKeys - 1];
+    }
+    child->numKeys++;
+    sibling->numKeys--;
+}
+
+/* Folds children[idx + 1] into children[idx] and drops their separator from node.
+   Returns the emptied right child, which the caller discards. */
+BPTreeNode* mergeNodes(BPTreeNode* node, int idx) {
+    BPTreeNode* leftChild = writableChild(node, idx);
+    BPTreeNode* rightChild = node->children[idx + 1];
+    if (leftChild->isLeaf) {
+        for (int i = 0; i < rightChild->numKeys; i++) {
+            leftChild->keys[leftChild->numKeys + i] = rightChild->keys[i];
+            leftChild->records[leftChild->numKeys + i] = rightChild->records[i];
+        }
+        leftChild->numKeys += rightChild->numKeys;
+    } else {
+        leftChild->keys[leftChild->numKeys] = node->keys[idx];
+        for (int i = 0; i < rightChild->numKeys; i++) {
+            leftChild->keys[leftChild->numKeys + 1 + i] = rightChild->keys[i];
+            leftChild->children[leftChild->numKeys + 1 + i] = rightChild->children[i];
+        }
+        leftChild->children[leftChild->numKeys + 1 + rightChild->numKeys] = rightChild->children[rightChild->numKeys];
+        leftChild->numKeys += 1 + rightChild->numKeys;
+    }
+    for (int i = idx; i < node->numKeys - 1; i++) {
+        node->keys[i] = node->keys[i + 1];
+        node->children[i + 1] = node->children[i + 2];
+    }
+    node->numKeys--;
+    return rightChild;
+}
+
+/* Removes the key from the tree without freeing its record; the global, entity and
+   index trees share Transaction objects, so the caller owns the record's lifetime.
+   Returns 0 when the key is not present. */
+int removeKeyFromBPTree(BPTreeNode** root, BPKey key) {
+    if (!*root) return 0;
+    BPTreePath path;
+    BPTreeNode* cursor = findLeafWithPath(*root, key, &path);
+    int keyIdx = nodeFindKey(cursor, key);
+    if (keyIdx == -1) return 0;
+    makePathWritable(root, &path);
+    removeFromLeaf(path.nodes[path.depth - 1], keyIdx);
+    BPTreeNode* dropped[BPTREE_MAX_HEIGHT];
+    int droppedCount = rebalancePath(root, &path, dropped);
+    for (int i = 0; i < droppedCount; i++)
+        discardBPTreeNode(dropped[i]);
+    return 1;
+}
+
+/* Restores the occupancy floors bottom-up along path after its leaf lost a key, and
+   collapses an emptied root. The nodes left unreachable go to dropped; returns how many. */
+int rebalancePath(BPTreeNode** root, BPTreePath* path, BPTreeNode** dropped) {
+    int droppedCount = 0;
+    for (int level = path->depth - 1; level > 0; level--) {
+        BPTreeNode* node = path->nodes[level];
+        int minKeys = node->isLeaf ? MIN_LEAF_KEYS : MIN_INTERNAL_KEYS;
+        if (node->numKeys >= minKeys)
+            return droppedCount;
+        BPTreeNode* parent = path->nodes[level - 1];
+        int idx = path->childIdx[level - 1];
+        if (idx < parent->numKeys && parent->children[idx + 1]->numKeys > minKeys) {
+            borrowFromNext(parent, idx);
+            return droppedCount;
+        }
+        if (idx > 0 && parent->children[idx - 1]->numKeys > minKeys) {
+            borrowFromPrev(parent, idx);
+            return droppedCount;
+        }
+        if (idx < parent->numKeys)
+            dropped[droppedCount++] = mergeNodes(parent, idx);
+        else
+            dropped[droppedCount++] = mergeNodes(parent, idx - 1);
+    }
+
+    BPTreeNode* oldRoot = *root;
+    if (oldRoot->numKeys == 0) {
+        *root = oldRoot->isLeaf ? NULL : oldRoot->children[0];
+        dropped[droppedCount++] = oldRoot;
+    }
+    return droppedCount;
+}
+
+void deleteTransactionFromBPTree(BPTreeNode** root, int transactionID) {
+    if (!*root) {
+        printf("Tree is empty. Nothing to delete.\n");
+        return;
+    }
+    if (!removeKeyFromBPTree(root, transactionID)) {
+        printf("Transaction with ID %d not found in the tree.\n", transactionID);
+    }
+}
+
+/* ============== CONCURRENT B+ TREE ============== */
+/* A variant of insert, lookup and remove that many threads can run on the same tree
+   at once, using optimistic lock coupling. Every node carries a version latch: bit 0
+   marks a node merged out of the tree, bit 1 is the write latch, and the rest counts
+   changes. Readers take no latches. They note each node's version, read it, and
+   check the version again before trusting what they read, restarting the descent if
+   a writer got in. Writers descend the same way and then latch only the nodes they
+   change: the leaf, plus the nodes a split or merge reaches and the siblings it
+   borrows from. A writer latches by compare-and-swap against the version it already
+   read and never waits while holding a latch, so writers cannot deadlock. The splits and rebalancing are
+   the single-threaded ones run on the latched path, so the trees keep the same shape
+   and occupancy floors and every other function can read them afterwards.
+   Merged-out nodes stay allocated until the writers are joined, because an optimistic
+   reader may still be looking at one. The variant does not copy on write, so it must
+   not run on trees a snapshot is pinned on. */
+#define LATCH_OBSOLETE 1ULL
+#define LATCH_LOCKED 2ULL
+#define LATCH_SPINS 64  // spins on a latched node before yielding the CPU
+
+/* Per-thread state of a concurrent writer. Call finishConcurrentWriter once no
+   thread uses the tree any more. */
+typedef struct {
+    ObjectPool nodes;       // nodes this writer splits off
+    BPTreeNode** dropped;   // nodes merged out of the tree
+    int droppedCount;
+    int droppedCapacity;
+    long long restarts;     // descents repeated after losing a race
+} ConcurrentWriter;
+
+void initConcurrentWriter(ConcurrentWriter* writer) {
+    memset(writer, 0, sizeof(ConcurrentWriter));
+    initObjectPool(&writer->nodes, "B+ tree node", sizeof(BPTreeNode), CACHE_LINE_SIZE);
+}
+
+void finishConcurrentWriter(ConcurrentWriter* writer) {
+    mergeObjectPool(&nodePool, &writer->nodes);
+    for (int i = 0; i < writer->droppedCount; i++)
+        releaseBPTreeNode(writer->dropped[i]);
+    free(writer->dropped);
+    writer->dropped = NULL;
+    writer->droppedCount = writer->droppedCapacity = 0;
+}
+
+// Version of an unlatched node, or 0 when it was merged out and the caller must restart
+static inline int readLatch(BPTreeNode* node, uint64_t* version) {
+    for (int spins = 0;; spins++) {
+        uint64_t v = __atomic_load_n(&node->latch, __ATOMIC_ACQUIRE);
+        if (v & LATCH_OBSOLETE) return 0;
+        if (!(v & LATCH_LOCKED)) {
+            *version = v;
+            return 1;
+        }
+        if (spins >= LATCH_SPINS) sched_yield();
+    }
+}
+
+// Whether nothing changed node since its version was read
+static inline int validateLatch(BPTreeNode* node, uint64_t version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&node->latch, __ATOMIC_RELAXED) == version;
+}
+
+static inline int upgradeLatch(BPTreeNode* node, uint64_t version) {
+    return __atomic_compare_exchange_n(&node->latch, &version, version + LATCH_LOCKED, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// Clears the write latch and bumps the version; obsolete also marks the node merged out
+static inline void releaseLatch(BPTreeNode* node, int obsolete) {
+    __atomic_fetch_add(&node->latch, LATCH_LOCKED + (obsolete ? LATCH_OBSOLETE : 0), __ATOMIC_RELEASE);
+}
+
+/* Descends to the leaf for key without latching, filling path and the version each
+   node had when it was read; path->depth is 0 for an empty tree. Returns 0 when a
+   writer changed a node on the way and the caller must restart. */
+int descendOptimistically(BPTreeNode** root, BPKey key, BPTreePath* path, uint64_t* versions) {
+    path->depth = 0;
+    BPTreeNode* node = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+    if (!node) return 1;
+    uint64_t version;
+    if (!readLatch(node, &version) || node != __atomic_load_n(root, __ATOMIC_ACQUIRE)) return 0;
+    for (;;) {
+        path->nodes[path->depth] = node;
+        versions[path->depth] = version;
+        if (node->isLeaf) {
+            path->childIdx[path->depth++] = -1;
+            return 1;
+        }
+        int i = nodeUpperBound(node->keys, node->numKeys, key);
+        BPTreeNode* child = node->children[i];
+        // The child pointer may be torn until the parent is known to be unchanged, and
+        // the child's version only covers key once the parent still routes key to it
+        if (!validateLatch(node, version)) return 0;
+        path->childIdx[path->depth++] = i;
+        uint64_t childVersion;
+        if (!readLatch(child, &childVersion) || !validateLatch(node, version)) return 0;
+        node = child;
+        version = childVersion;
+    }
+}
+
+/* Latches the path from level top down to its leaf, then the extra nodes, each at the
+   version it was read at. On a conflict releases what it took and returns 0. */
+int latchForWrite(BPTreePath* path, const uint64_t* versions, int top,
+                  BPTreeNode** extra, const uint64_t* extraVersions, int extraCount) {
+    for (int level = top; level < path->depth; level++) {
+        if (!upgradeLatch(path->nodes[level], versions[level])) {
+            while (--level >= top) releaseLatch(path->nodes[level], 0);
+            return 0;
+        }
+    }
+    for (int i = 0; i < extraCount; i++) {
+        if (!upgradeLatch(extra[i], extraVersions[i])) {
+            while (--i >= 0) releaseLatch(extra[i], 0);
+            for (int level = top; level < path->depth; level++) releaseLatch(path->nodes[level], 0);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Releases what latchForWrite took, marking the dropped nodes obsolete
+void releaseWriteLatches(BPTreePath* path, int top, BPTreeNode** extra, int extraCount,
+                         BPTreeNode** dropped, int droppedCount) {
+    for (int n = 0; n < path->depth - top + extraCount; n++) {
+        BPTreeNode* node = n < path->depth - top ? path->nodes[top + n] : extra[n - (path->depth - top)];
+        int obsolete = 0;
+        for (int i = 0; i < droppedCount; i++)
+            if (dropped[i] == node) obsolete = 1;
+        releaseLatch(node, obsolete);
+    }
+}
+
+/* Finds key with no latches. Returns 0 when it is absent; otherwise stores its record
+   when record is not NULL. */
+int concurrentLookup(BPTreeNode** root, BPKey key, Transaction** record) {
+    BPTreePath path;
+    uint64_t versions[BPTREE_MAX_HEIGHT];
+    for (;;) {
+        if (!descendOptimistically(root, key, &path, versions)) continue;
+        if (path.depth == 0) return 0;
+        BPTreeNode* leaf = path.nodes[path.depth - 1];
+        int pos = nodeFindKey(leaf, key);
+        Transaction* found = pos >= 0 ? leaf->records[pos] : NULL;
+        if (!validateLatch(leaf, versions[path.depth - 1])) continue;
+        if (pos < 0) return 0;
+        if (record) *record = found;
+        return 1;
+    }
+}
+
+/* Adds key unless the tree already holds it; returns whether it was added. Only the
+   leaf is latched unless it is full, in which case so is every ancestor the split
+   reaches, up to the first one with room for the separator. */
+int concurrentInsert(BPTreeNode** root, BPKey key, Transaction* record, ConcurrentWriter* writer) {
+    BPTreePath path;
+    uint64_t versions[BPTREE_MAX_HEIGHT];
+    ObjectPool* savedPool = threadNodePool;
+    threadNodePool = &writer->nodes;
+    int inserted;
+    for (;; writer->restarts++) {
+        if (!descendOptimistically(root, key, &path, versions)) continue;
+        if (path.depth == 0) {
+            BPTreeNode* leaf = createBPTreeNode(1);
+            leaf->keys[0] = key;
+            leaf->records[0] = record;
+            leaf->numKeys = 1;
+            BPTreeNode* empty = NULL;
+            if (__atomic_compare_exchange_n(root, &empty, leaf, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                inserted = 1;
+                break;
+            }
+            poolFree(&writer->nodes, leaf);
+            continue;
+        }
+        // Numbers read here are only trusted once the latches confirm the versions
+        int top = path.depth - 1;
+        while (top > 0 && path.nodes[top]->numKeys >= ORDER - 2) top--;
+        if (!latchForWrite(&path, versions, top, NULL, NULL, 0)) continue;
+        if (nodeFindKey(path.nodes[path.depth - 1], key) >= 0) {
+            inserted = 0;
+        } else {
+            BPTreeNode* newRoot = path.nodes[0];
+            insertIntoLeafOnPath(&newRoot, &path, key, record);
+            // Only a split of the latched root replaces it
+            if (newRoot != path.nodes[0]) __atomic_store_n(root, newRoot, __ATOMIC_RELEASE);
+            inserted = 1;
+        }
+        releaseWriteLatches(&path, top, NULL, 0, NULL, 0);
+        break;
+    }
+    threadNodePool = savedPool;
+    return inserted;
+}
+
+/* Removes key; returns 0 when it is absent. Like rebalancePath, which does the actual
+   work, it plans bottom-up which nodes will borrow or merge, then latches the path
+   from the topmost changed node down together with every sibling the plan reads. */
+int concurrentRemove(BPTreeNode** root, BPKey key, ConcurrentWriter* writer) {
+    BPTreePath path;
+    uint64_t versions[BPTREE_MAX_HEIGHT];
+    BPTreeNode* siblings[2 * BPTREE_MAX_HEIGHT];
+    uint64_t siblingVersions[2 * BPTREE_MAX_HEIGHT];
+    BPTreeNode* dropped[BPTREE_MAX_HEIGHT];
+    for (;; writer->restarts++) {
+        if (!descendOptimistically(root, key, &path, versions)) continue;
+        if (path.depth == 0) return 0;
+        BPTreeNode* leaf = path.nodes[path.depth - 1];
+        int present = nodeFindKey(leaf, key) >= 0;
+        int remaining = leaf->numKeys - 1;
+        if (!validateLatch(leaf, versions[path.depth - 1])) continue;
+        if (!present) return 0;
+
+        int top = path.depth - 1, siblingCount = 0, conflict = 0;
+        while (top > 0 && !conflict) {
+            int minKeys = path.nodes[top]->isLeaf ? MIN_LEAF_KEYS : MIN_INTERNAL_KEYS;
+            if (remaining >= minKeys) break;
+            BPTreeNode* parent = path.nodes[top - 1];
+            int idx = path.childIdx[top - 1];
+            int parentKeys = parent->numKeys;
+            int borrows = 0;
+            for (int side = 0; side < 2 && !borrows && !conflict; side++) {
+                int at = side == 0 ? idx + 1 : idx - 1;
+                if (at < 0 || at > parentKeys) continue;
+                BPTreeNode* sibling = parent->children[at];
+                if (!validateLatch(parent, versions[top - 1]) ||
+                    !readLatch(sibling, &siblingVersions[siblingCount])) {
+                    conflict = 1;
+                    break;
+                }
+                siblings[siblingCount++] = sibling;
+                borrows = sibling->numKeys > minKeys;
+            }
+            top--;
+            if (borrows) break;
+            remaining = parentKeys - 1;  // a merge takes a separator from the parent
+        }
+        if (conflict || !latchForWrite(&path, versions, top, siblings, siblingVersions, siblingCount)) continue;
+
+        int keyIdx = nodeFindKey(leaf, key);
+        removeFromLeaf(leaf, keyIdx);
+        BPTreeNode* newRoot = path.nodes[0];
+        int droppedCount = rebalancePath(&newRoot, &path, dropped);
+        if (newRoot != path.nodes[0]) __atomic_store_n(root, newRoot, __ATOMIC_RELEASE);
+        releaseWriteLatches(&path, top, siblings, siblingCount, dropped, droppedCount);
+        if (writer->droppedCount + droppedCount > writer->droppedCapacity) {
+            writer->droppedCapacity = writer->droppedCapacity ? writer->droppedCapacity * 2 : 256;
+            writer->dropped = (BPTreeNode**)realloc(writer->dropped, writer->droppedCapacity * sizeof(BPTreeNode*));
+            if (!writer->dropped) {
+                printf("Memory allocation failed for dropped nodes.\n");
+                exit(1);
+            }
+        }
+        for (int i = 0; i < droppedCount; i++)
+            writer->dropped[writer->droppedCount++] = dropped[i];
+        return 1;
+    }
+}
+
+/* ============== INGEST QUEUE ============== */
+/* Many producer threads hand trades to one writer thread through a bounded lock-free
+   queue, Dmitry Vyukov's array queue cut down to one consumer. Every slot carries a
+   sequence number. A producer claims a position with one compare-and-swap on the
+   enqueue counter, copies its trade into the slot and publishes it by advancing the
+   slot's sequence. The writer is the only consumer, so it needs no atomic
+   read-modify-write at all. A producer that finds the queue full spins and then yields
+   until a slot frees up; that wait is the backpressure, and no lock is ever taken. The
+   writer applies up to INGEST_BATCH trades at a time and, when per-record syncs are
+   deferred, makes each batch durable with one fdatasync. */
+#ifndef INGEST_QUEUE_SLOTS
+#define INGEST_QUEUE_SLOTS 65536  // must be a power of two
+#endif
+#define INGEST_BATCH 4096
+#define INGEST_FULL_SPINS 64         // spins on a full queue before yielding the CPU
+#define INGEST_IDLE_SLEEP_NS 50000   // writer's nap while the queue is empty
+#define LATENCY_BUCKETS 512
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) uint64_t sequence;  // position + 1 once filled, + slots once free again
+    Transaction trade;
+    uint64_t inputOffset;  // where the trade's line starts in the input
+} IngestSlot;
+
+/* Latencies in buckets an eighth of a power of two wide, so percentiles come out
+   within 12.5% without keeping every sample. */
+typedef struct {
+    long long counts[LATENCY_BUCKETS];
+    long long samples;
+    uint64_t maxNs;
+} LatencyHistogram;
+
+typedef struct {
+    LatencyHistogram latency;  // time spent in ingestSubmit, waits included
+    long long fullWaits;       // submissions that found the queue full
+} IngestProducerStats;
+
+typedef struct IngestQueue {
+    IngestSlot* slots;
+    uint64_t mask;
+    _Alignas(CACHE_LINE_SIZE) uint64_t enqueuePos;  // claimed by producers
+    _Alignas(CACHE_LINE_SIZE) uint64_t dequeuePos;  // moved only by the writer
+    int closing;     // every producer is done; the writer drains and exits
+    AppendLog* log;  // synced after each batch while its per-record syncs are deferred
+    void (*apply)(struct IngestQueue* queue, const Transaction* trade, uint64_t inputOffset);
+    void* context;
+    pthread_t writer;
+    long long outcomes[CHANGE_LOG_FAILED + 1];  // applied trades by ChangeStatus
+    long long batches;
+    int syncFailed;
+} IngestQueue;
+
+static inline void recordLatency(LatencyHistogram* histogram, uint64_t ns) {
+    int bucket = (int)ns;
+    if (ns >= 8) {
+        int top = 63 - __builtin_clzll(ns);
+        bucket = top * 8 + (int)((ns >> (top - 3)) & 7);
+    }
+    histogram->counts[bucket]++;
+    histogram->samples++;
+    if (ns > histogram->maxNs) histogram->maxNs = ns;
+}
+
+// Upper edge of the bucket holding the given fraction of the samples
+uint64_t latencyPercentile(const LatencyHistogram* histogram, double fraction) {
+    long long rank = (long long)(fraction * histogram->samples), seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen > rank && histogram->counts[bucket] > 0) {
+            if (bucket < 8) return (uint64_t)bucket;
+            uint64_t edge = ((uint64_t)(8 + bucket % 8 + 1) << (bucket / 8 - 3)) - 1;
+            return edge < histogram->maxNs ? edge : histogram->maxNs;
+        }
+    }
+    return histogram->maxNs;
+}
+
+void mergeLatency(LatencyHistogram* into, const LatencyHistogram* from) {
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) into->counts[bucket] += from->counts[bucket];
+    into->samples += from->samples;
+    if (from->maxNs > into->maxNs) into->maxNs = from->maxNs;
+}
+
+// Copies trade into the queue; returns 0 when the queue is full
+int ingestTryEnqueue(IngestQueue* queue, const Transaction* trade, uint64_t inputOffset) {
+    uint64_t position = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+    IngestSlot* slot;
+    for (;;) {
+        slot = &queue->slots[position & queue->mask];
+        int64_t lag = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqueuePos, &position, position + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (lag < 0) {
+            return 0;  // the writer has not freed this slot from the previous lap
+        } else {
+            position = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->trade = *trade;
+    slot->inputOffset = inputOffset;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Enqueues trade, waiting while the queue is full. inputOffset orders trades that
+   share an ID: the one from the earliest line is kept. */
+void ingestSubmit(IngestQueue* queue, const Transaction* trade, uint64_t inputOffset, IngestProducerStats* stats) {
+    double began = currentTimeSeconds();
+    if (!ingestTryEnqueue(queue, trade, inputOffset)) {
+        stats->fullWaits++;
+        for (int spins = 1; !ingestTryEnqueue(queue, trade, inputOffset); spins++)
+            if (spins >= INGEST_FULL_SPINS) sched_yield();
+    }
+    recordLatency(&stats->latency, (uint64_t)((currentTimeSeconds() - began) * 1e9));
+}
+
+void* ingestWriter(void* arg) {
+    IngestQueue* queue = (IngestQueue*)arg;
+    for (;;) {
+        // Read before draining: once closing is seen, every trade is already in a slot
+        int closing = __atomic_load_n(&queue->closing, __ATOMIC_ACQUIRE);
+        int drained = 0;
+        while (drained < INGEST_BATCH) {
+            IngestSlot* slot = &queue->slots[queue->dequeuePos & queue->mask];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != queue->dequeuePos + 1) break;
+            queue->apply(queue, &slot->trade, slot->inputOffset);
+            __atomic_store_n(&slot->sequence, queue->dequeuePos + queue->mask + 1, __ATOMIC_RELEASE);
+            queue->dequeuePos++;
+            drained++;
+        }
+        if (drained > 0) {
+            queue->batches++;
+            if (queue->log && queue->log->deferSyncs && appendLogSync(queue->log) != 0) queue->syncFailed = 1;
+            continue;
+        }
+        if (closing) return NULL;
+        struct timespec nap = { 0, INGEST_IDLE_SLEEP_NS };
+        nanosleep(&nap, NULL);
+    }
+}
+
+/* Sets up an empty queue whose writer passes every trade to apply. The caller runs
+   ingestWriter on it, on a thread of its own. */
+void initIngestQueue(IngestQueue* queue, AppendLog* log, void (*apply)(IngestQueue*, const Transaction*, uint64_t),
+                     void* context) {
+    memset(queue, 0, sizeof(IngestQueue));
+    queue->slots = (IngestSlot*)aligned_alloc(CACHE_LINE_SIZE, INGEST_QUEUE_SLOTS * sizeof(IngestSlot));
+    if (!queue->slots) {
+        printf("Memory allocation failed for the ingest queue.\n");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < INGEST_QUEUE_SLOTS; i++) queue->slots[i].sequence = i;
+    queue->mask = INGEST_QUEUE_SLOTS - 1;
+    queue->log = log;
+    queue->apply = apply;
+    queue->context = context;
+}
+
+/* Starts a writer thread for the queue. Only the writer touches the store until
+   stopIngestQueue returns. */
+void startIngestQueue(IngestQueue* queue, AppendLog* log, void (*apply)(IngestQueue*, const Transaction*, uint64_t),
+                      void* context) {
+    initIngestQueue(queue, log, apply, context);
+    if (pthread_create(&queue->writer, NULL, ingestWriter, queue) != 0) {
+        printf("Error starting the ingest writer thread.\n");
+        exit(1);
+    }
+}
+
+// Call once every producer has returned: the writer applies what is left and returns
+void closeIngestQueue(IngestQueue* queue) {
+    __atomic_store_n(&queue->closing, 1, __ATOMIC_RELEASE);
+}
+
+/* Frees the queue once its writer has returned. Returns -1 if a batch could not be
+   made durable. */
+int finishIngestQueue(IngestQueue* queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+    return queue->syncFailed ? -1 : 0;
+}
+
+int stopIngestQueue(IngestQueue* queue) {
+    closeIngestQueue(queue);
+    pthread_join(queue->writer, NULL);
+    return finishIngestQueue(queue);
+}
+
+#define NO_INPUT_OFFSET UINT64_MAX
+
+// Input offset of the line each ID an ingest has taken came from
+typedef struct {
+    EntityIndex index;  // transaction ID to slot in offsets
+    uint64_t* offsets;
+    int count;
+    int capacity;
+} IngestOffsets;
+
+// NO_INPUT_OFFSET if the ingest has not taken this ID
+uint64_t ingestOffsetOf(const IngestOffsets* taken, int transactionID) {
+    int slot = entityIndexFind(&taken->index, transactionID);
+    return slot >= 0 ? taken->offsets[slot] : NO_INPUT_OFFSET;
+}
+
+void noteIngestOffset(IngestOffsets* taken, int transactionID, uint64_t inputOffset) {
+    int slot = entityIndexFind(&taken->index, transactionID);
+    if (slot < 0) {
+        if (taken->count == taken->capacity) {
+            taken->capacity = taken->capacity ? taken->capacity * 2 : 4096;
+            taken->offsets = (uint64_t*)realloc(taken->offsets, taken->capacity * sizeof(uint64_t));
+            if (!taken->offsets) {
+                printf("Memory allocation failed.\n");
+                exit(1);
+            }
+        }
+        slot = taken->count++;
+        entityIndexInsert(&taken->index, transactionID, slot);
+    }
+    taken->offsets[slot] = inputOffset;
+}
+
+void freeIngestOffsets(IngestOffsets* taken) {
+    freeEntityIndex(&taken->index);
+    free(taken->offsets);
+    memset(taken, 0, sizeof(IngestOffsets));
+}
+
+/* Producers finish their shares of the file at different times, so a line can arrive
+   after a later one with the same ID. The earlier line still takes the ID, as it would
+   in a single-threaded read: the trade from the later line is deleted again. */
+void applyIngestedTrade(IngestQueue* queue, const Transaction* trade, uint64_t inputOffset) {
+    IngestOffsets* taken = (IngestOffsets*)queue->context;
+    uint64_t takenAt = ingestOffsetOf(taken, trade->transactionID);
+    if (takenAt != NO_INPUT_OFFSET && takenAt > inputOffset) {
+        if (!findSeller(trade->sellerID) && unknownSellerPolicy == UNKNOWN_SELLER_REJECT) {
+            queue->outcomes[CHANGE_UNKNOWN_SELLER]++;
+            return;
+        }
+        ChangeStatus status = applyDelete(trade->transactionID);
+        if (status != CHANGE_APPLIED) {
+            queue->outcomes[status]++;
+            return;
+        }
+        queue->outcomes[CHANGE_APPLIED]--;
+        queue->outcomes[CHANGE_DUPLICATE_ID]++;
+    }
+    // The price comes from the seller's rates, as for a trade added by hand
+    Transaction* t = createTransaction(trade->transactionID, trade->buyerID, trade->sellerID,
+                                       trade->energyAmount, 0.0, trade->epoch);
+    ChangeStatus status = applyInsert(t);
+    if (status == CHANGE_APPLIED) noteIngestOffset(taken, trade->transactionID, inputOffset);
+    queue->outcomes[status]++;
+}
+
+typedef struct {
+    IngestQueue* queues;  // one per shard, or just the live store's
+    int queueCount;
+    const char* data;     // start of the mapped file, for input offsets
+    const char* begin;
+    const char* end;
+    IngestProducerStats stats;
+    long long trades;
+    long long skipped;  // malformed lines and tombstones
+} IngestProducer;
+
+void* ingestFileChunk(void* arg) {
+    IngestProducer* producer = (IngestProducer*)arg;
+    const char* p = producer->begin;
+    while (p < producer->end) {
+        const char* newline = (const char*)memchr(p, '\n', (size_t)(producer->end - p));
+        const char* lineEnd = newline ? newline : producer->end;
+        Transaction trade;
+        if (lineEnd > p && parseTransactionLine(p, lineEnd, &trade) == LINE_RECORD) {
+            IngestQueue* queue = &producer->queues[shardOfSeller(trade.sellerID, producer->queueCount)];
+            ingestSubmit(queue, &trade, (uint64_t)(p - producer->data), &producer->stats);
+            producer->trades++;
+        } else if (lineEnd > p) {
+            producer->skipped++;
+        }
+        p = lineEnd + 1;
+    }
+    return NULL;
+}
+
+int startShardIngest(IngestQueue* queues, const char* segmentFormat);
+int stopShardIngest(IngestQueue* queues);
+void gatherShardIngest(IngestQueue* queues);
+
+/* --ingest: adds every trade in a text file in the transactions.txt layout to the live
+   store. One producer thread per CPU (or --load-threads) parses a share of the file and
+   submits its trades. Without --shards one writer applies them to the store, so
+   duplicate IDs and unknown sellers are handled as for single adds; otherwise each
+   shard's worker applies its sellers' trades, and the new IDs are gathered into the
+   global indexes at the end. Either way an ID that several lines carry is kept from
+   the earliest one. Returns 0 on success. */
+int ingestFile(const char* path) {
+    int fd = open(path, O_RDONLY);
+    MappedRange range;
+    if (fd < 0 || mapFileRange(fd, 0, &range) != 0) {
+        printf("Error reading %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int producerCount = chooseLoaderThreads(range.size);
+    int queueCount = shardCount > 0 ? shardCount : 1;
+    IngestProducer producers[LOADER_MAX_THREADS];
+    pthread_t threads[LOADER_MAX_THREADS];
+    IngestQueue queues[MAX_SHARDS];
+    IngestOffsets taken;
+    memset(&taken, 0, sizeof(taken));
+    double began = currentTimeSeconds();
+    if (shardCount == 0) {
+        startIngestQueue(&queues[0], &transactionLog, applyIngestedTrade, &taken);
+    } else if (startShardIngest(queues, SHARD_SEGMENT_FILE) != 0) {
+        unmapFileRange(&range);
+        close(fd);
+        return -1;
+    }
+    const char* cursor = range.data;
+    for (int i = 0; i < producerCount; i++) {
+        memset(&producers[i], 0, sizeof(IngestProducer));
+        producers[i].queues = queues;
+        producers[i].queueCount = queueCount;
+        producers[i].data = range.data;
+        producers[i].begin = cursor;
+        producers[i].end = cursor = lineChunkEnd(range.data, range.size, producerCount, i, cursor);
+        if (pthread_create(&threads[i], NULL, ingestFileChunk, &producers[i]) != 0) {
+            printf("Error starting an ingest producer thread.\n");
+            exit(1);
+        }
+    }
+    IngestProducerStats total;
+    memset(&total, 0, sizeof(total));
+    long long trades = 0, skipped = 0;
+    for (int i = 0; i < producerCount; i++) {
+        pthread_join(threads[i], NULL);
+        mergeLatency(&total.latency, &producers[i].stats.latency);
+        total.fullWaits += producers[i].stats.fullWaits;
+        trades += producers[i].trades;
+        skipped += producers[i].skipped;
+    }
+    int status = shardCount == 0 ? stopIngestQueue(&queues[0]) : stopShardIngest(queues);
+    freeIngestOffsets(&taken);
+    double elapsed = currentTimeSeconds() - began;
+    unmapFileRange(&range);
+    close(fd);
+    double gatherSeconds = 0.0;
+    if (shardCount > 0) {
+        gatherShardIngest(queues);
+        gatherSeconds = currentTimeSeconds() - began - elapsed;
+    }
+    long long outcomes[CHANGE_LOG_FAILED + 1] = { 0 }, batches = 0;
+    for (int q = 0; q < queueCount; q++) {
+        for (int o = 0; o <= CHANGE_LOG_FAILED; o++) outcomes[o] += queues[q].outcomes[o];
+        batches += queues[q].batches;
+    }
+
+    printf("Ingest: %lld trades from %d producer%s in %.3f s (%.0f trades/s, %lld batches)\n", trades,
+           producerCount, producerCount == 1 ? "" : "s", elapsed, elapsed > 0 ? trades / elapsed : 0.0, batches);
+    if (shardCount > 0)
+        printf("  %d shard%s, gathered into the store in %.3f s\n", shardCount, shardCount == 1 ? "" : "s",
+               gatherSeconds);
+    printf("  %lld added, %lld duplicate IDs, %lld unknown sellers, %lld lines skipped\n",
+           outcomes[CHANGE_APPLIED], outcomes[CHANGE_DUPLICATE_ID], outcomes[CHANGE_UNKNOWN_SELLER], skipped);
+    printf("  enqueue latency p50 %.2f us, p99 %.2f us, max %.2f us; %lld submissions waited on a full queue\n",
+           latencyPercentile(&total.latency, 0.50) / 1e3, latencyPercentile(&total.latency, 0.99) / 1e3,
+           total.latency.maxNs / 1e3, total.fullWaits);
+    if (outcomes[CHANGE_LOG_FAILED] > 0 || status != 0) {
+        printf("Error: the write-ahead log could not be written or synced, so some trades are not durable.\n");
+        return -1;
+    }
+    // The segments replay after the WAL, so they must be folded in before it takes another record
+    if (shardCount > 0) retireShardSegments();
+    return 0;
+}
+
+/* ============== SHARDED STORE ============== */
+/* --shards=N splits the store N ways by a hash of the seller ID (shardOfSeller). A
+   shard owns its sellers outright: their rates, trade trees, revenue and regular
+   buyers. It also owns a partial record for every buyer of those sellers, holding the
+   buyer's trades with them and their energy and count, and the pair counts of its
+   sellers. Each shard has a worker thread and node and transaction pools of its own.
+   What needs every trade in one place stays global: the ID, time and energy indexes
+   (so IDs stay unique and get, all, time and energy read one tree), the store totals,
+   the rollups, the buyers' totals with the leaderboard, and the WAL. Batch changes
+   still run on the main thread in log order, so applyInsert and applyDelete keep the
+   global buyers and rollups current, and findSeller and addSeller go to the owning
+   shard, so pricing, rates, seller listings and windows work as before. top-buyers
+   and rank read the leaderboard as they do unsharded. Other whole-store queries
+   scatter to the workers and gather on the main thread: revenue merges the shards'
+   sellers by seller ID, and top-pairs merges each shard's own top pairs in
+   compareSellerBuyerPairs order, so each answer is the same for any shard count. A
+   buyer listing merges the buyer's partial trees in ID order.
+   Regular buyers are judged on the trades a buyer has with the shard's sellers.
+   During --ingest each worker drains its own queue into its shard and logs to its own
+   segment (SHARD_SEGMENT_FILE), reading the live store only to spot IDs it already
+   holds. At the end the new IDs are merged: an ID two shards took is kept from the
+   earlier input line, as a replay of the segments would keep it, and the trades kept
+   go into the global indexes. A checkpoint then covers the segments and they are
+   removed; segments left by a crash are replayed after the WAL at the next start (see
+   recoverState). */
+typedef struct Shard Shard;
+typedef void (*ShardTask)(Shard* shard, void* arg);
+
+struct Shard {
+    int index;
+    Seller* sellers;
+    int sellerCount;
+    int sellerCapacity;
+    EntityIndex sellerIndex;
+    Buyer* buyers;  // partial: only the trades with this shard's sellers
+    int buyerCount;
+    int buyerCapacity;
+    EntityIndex buyerIndex;
+    PairCounter pairs;
+    ObjectPool nodes;
+    ObjectPool transactions;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // a task was handed over or finished, or the worker should stop
+    ShardTask task;          // NULL while the worker is idle
+    void* taskArg;
+    int stopping;
+    // Only while an ingest runs
+    char segmentPath[64];
+    AppendLog log;
+    BPTreeNode* byId;     // trades this ingest added
+    IngestOffsets taken;  // input offset of each of them
+};
+
+Shard* shards = NULL;
+
+Seller* shardFindSeller(Shard* shard, int sellerID) {
+    int i = entityIndexFind(&shard->sellerIndex, sellerID);
+    return i >= 0 ? &shard->sellers[i] : NULL;
+}
+
+Buyer* shardFindBuyer(Shard* shard, int buyerID) {
+    int i = entityIndexFind(&shard->buyerIndex, buyerID);
+    return i >= 0 ? &shard->buyers[i] : NULL;
+}
+
+// Takes over a copy of seller, trade tree and regular buyers included
+Seller* shardAddSeller(Shard* shard, const Seller* seller) {
+    if (shard->sellerCount == shard->sellerCapacity) {
+        shard->sellerCapacity = shard->sellerCapacity ? shard->sellerCapacity * 2 : 16;
+        shard->sellers = (Seller*)realloc(shard->sellers, shard->sellerCapacity * sizeof(Seller));
+        if (!shard->sellers) {
+            printf("Memory allocation failed for seller.\n");
+            exit(1);
+        }
+    }
+    shard->sellers[shard->sellerCount] = *seller;
+    entityIndexInsert(&shard->sellerIndex, seller->sellerID, shard->sellerCount);
+    return &shard->sellers[shard->sellerCount++];
+}
+
+Buyer* shardFindOrAddBuyer(Shard* shard, int buyerID) {
+    Buyer* buyer = shardFindBuyer(shard, buyerID);
+    if (buyer) return buyer;
+    if (shard->buyerCount == shard->buyerCapacity) {
+        shard->buyerCapacity = shard->buyerCapacity ? shard->buyerCapacity * 2 : 16;
+        shard->buyers = (Buyer*)realloc(shard->buyers, shard->buyerCapacity * sizeof(Buyer));
+        if (!shard->buyers) {
+            printf("Memory allocation failed for buyer.\n");
+            exit(1);
+        }
+    }
+    buyer = &shard->buyers[shard->buyerCount];
+    memset(buyer, 0, sizeof(Buyer));
+    buyer->buyerID = buyerID;
+    entityIndexInsert(&shard->buyerIndex, buyerID, shard->buyerCount++);
+    return buyer;
+}
+
+Seller* findShardedSeller(int sellerID) {
+    return shardFindSeller(&shards[shardOfSeller(sellerID, shardCount)], sellerID);
+}
+
+Seller* addShardedSeller(int sellerID, double rateBelow300, double rateAbove300) {
+    Seller seller;
+    memset(&seller, 0, sizeof(seller));
+    seller.sellerID = sellerID;
+    seller.rateBelow300 = rateBelow300;
+    seller.rateAbove300 = rateAbove300;
+    return shardAddSeller(&shards[shardOfSeller(sellerID, shardCount)], &seller);
+}
+
+// seller is the shard's record for t's seller
+void shardAddTrade(Shard* shard, Seller* seller, Transaction* t) {
+    Buyer* buyer = shardFindOrAddBuyer(shard, t->buyerID);
+    insertTransactionIntoEntityTree(&seller->transactionTree, t);
+    insertTransactionIntoEntityTree(&buyer->transactionTree, t);
+    seller->numTransactions++;
+    seller->totalRevenue += t->totalPrice;
+    buyer->numTransactions++;
+    buyer->totalEnergyPurchased += t->energyAmount;
+    addRegularBuyer(&shard->pairs, seller, buyer, adjustPairCount(&shard->pairs, t->sellerID, t->buyerID, 1));
+}
+
+void shardRemoveTrade(Shard* shard, Transaction* t) {
+    Seller* seller = shardFindSeller(shard, t->sellerID);
+    Buyer* buyer = shardFindBuyer(shard, t->buyerID);
+    deleteTransactionFromBPTree(&seller->transactionTree, t->transactionID);
+    seller->numTransactions--;
+    seller->totalRevenue -= t->totalPrice;
+    deleteTransactionFromBPTree(&buyer->transactionTree, t->transactionID);
+    buyer->numTransactions--;
+    buyer->totalEnergyPurchased -= t->energyAmount;
+    adjustPairCount(&shard->pairs, t->sellerID, t->buyerID, -1);
+}
+
+void addShardedTrade(Seller* seller, Transaction* t) {
+    shardAddTrade(&shards[shardOfSeller(t->sellerID, shardCount)], seller, t);
+}
+
+void removeShardedTrade(Transaction* t) {
+    shardRemoveTrade(&shards[shardOfSeller(t->sellerID, shardCount)], t);
+}
+
+void* shardWorker(void* arg) {
+    Shard* shard = (Shard*)arg;
+    threadNodePool = &shard->nodes;
+    pthread_mutex_lock(&shard->lock);
+    for (;;) {
+        while (!shard->task && !shard->stopping) {
+            pthread_cond_wait(&shard->changed, &shard->lock);
+        }
+        if (!shard->task) break;
+        pthread_mutex_unlock(&shard->lock);
+        shard->task(shard, shard->taskArg);
+        pthread_mutex_lock(&shard->lock);
+        shard->task = NULL;
+        pthread_cond_broadcast(&shard->changed);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+}
+
+/* Hands task to every worker without waiting for it. The shards are the workers'
+   until waitForShards returns. */
+void dispatchToShards(ShardTask task, void* arg) {
+    for (int i = 0; i < shardCount; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        shards[i].task = task;
+        shards[i].taskArg = arg;
+        pthread_cond_broadcast(&shards[i].changed);
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+void waitForShards() {
+    for (int i = 0; i < shardCount; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        while (shards[i].task) {
+            pthread_cond_wait(&shards[i].changed, &shards[i].lock);
+        }
+        pthread_mutex_unlock(&shards[i].lock);
     }
+}
 
-    // Sort pairs by transaction count
-    mergeSortSellerBuyerPairs(pairs, 0, pairCount - 1);
-
-    // Initialize table
-    Table table;
-    init_table(&table);
-    add_table_column(&table, "Seller ID");
-    add_table_column(&table, "Buyer ID");
-    add_table_column(&table, "Transaction Count");
+void runOnShards(ShardTask task, void* arg) {
+    dispatchToShards(task, arg);
+    waitForShards();
+}
 
-    // Add pairs to table
-    int totalTransactions = 0;
-    for (int i = 0; i < pairCount; i++) {
-        char seller[20], buyer[20], count[20];
-        snprintf(seller, sizeof(seller), "%d", pairs[i].sellerID);
-        snprintf(buyer, sizeof(buyer), "%d", pairs[i].buyerID);
-        snprintf(count, sizeof(count), "%d", pairs[i].transactionCount);
-        
-        add_table_row(&table, seller, buyer, count);
-        totalTransactions += pairs[i].transactionCount;
+// Hands what the workers allocated to the global pools, so the main thread can free it
+void mergeShardPools() {
+    for (int i = 0; i < shardCount; i++) {
+        mergeObjectPool(&nodePool, &shards[i].nodes);
+        mergeObjectPool(&transactionPool, &shards[i].transactions);
     }
+}
 
-    // Print results
-    printf("\n===== Seller-Buyer Pairs Sorted by Transaction Count =====\n");
-    if (pairCount > 0) {
-        print_table(&table);
-        printf("\nSummary:\n");
-        printf("Total Pairs: %d\n", pairCount);
-        printf("Total Transactions: %d\n", totalTransactions);
-    } else {
-        printf("No seller-buyer pairs found.\n");
+// Creates count empty shards and starts their workers
+void createShards(int count) {
+    shards = (Shard*)calloc(count, sizeof(Shard));
+    if (!shards) {
+        printf("Memory allocation failed for shards.\n");
+        exit(1);
     }
+    for (int i = 0; i < count; i++) {
+        Shard* shard = &shards[i];
+        shard->index = i;
+        initObjectPool(&shard->nodes, "B+ tree node", sizeof(BPTreeNode), CACHE_LINE_SIZE);
+        initObjectPool(&shard->transactions, "Transaction", sizeof(Transaction), _Alignof(Transaction));
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->changed, NULL);
+        if (pthread_create(&shard->worker, NULL, shardWorker, shard) != 0) {
+            printf("Error starting a shard worker thread.\n");
+            exit(1);
+        }
+    }
+    shardCount = count;
+}
 
-    // Clean up
-    free(pairs);
-    free_table(&table);
+// Builds the shard's partial buyers from its sellers' trades, given in ID order
+void buildShardBuyers(Shard* shard, void* arg) {
+    TransactionArray* trades = &((TransactionArray*)arg)[shard->index];
+    int count = trades->count;
+    int* slotOf = (int*)malloc((count ? count : 1) * sizeof(int));
+    Transaction** grouped = (Transaction**)malloc((count ? count : 1) * sizeof(Transaction*));
+    if (!slotOf || !grouped) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        Transaction* t = trades->transactions[i];
+        Buyer* buyer = shardFindOrAddBuyer(shard, t->buyerID);
+        buyer->numTransactions++;
+        buyer->totalEnergyPurchased += t->energyAmount;
+        slotOf[i] = (int)(buyer - shard->buyers);
+    }
+    int* groupStart = (int*)malloc((shard->buyerCount + 1) * sizeof(int));
+    if (!groupStart) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    groupBySlot(trades->transactions, slotOf, count, shard->buyerCount, grouped, groupStart);
+    for (int b = 0; b < shard->buyerCount; b++)
+        buildBPTreeFromSorted(&shard->buyers[b].transactionTree, grouped + groupStart[b],
+                              groupStart[b + 1] - groupStart[b], transactionIdKey);
+    free(slotOf);
+    free(grouped);
+    free(groupStart);
 }
 
-void loadDataFromFile() {
-    FILE *file = fopen(TRANSACTION_FILE, "r");
-    if (!file) {
-        printf("No existing transactions found. Starting fresh.\n");
-        return;
+/* Splits the recovered store across count shards: the sellers and pair counts move to
+   their shards, and the workers build the partial buyers. The global buyers keep their
+   totals and leaderboard places but hand their trade trees over to the partials. Call
+   before any change. */
+void startShards(int count) {
+    createShards(count);
+    for (int s = 0; s < sellerCount; s++)
+        shardAddSeller(&shards[shardOfSeller(sellers[s].sellerID, count)], &sellers[s]);
+    free(sellers);
+    sellers = NULL;
+    sellerCount = sellerCapacity = 0;
+    freeEntityIndex(&sellerIndex);
+    for (int p = 0; p < pairCounter.count; p++) {
+        const SellerBuyerPair* pair = &pairCounter.pairs[p];
+        PairCounter* counter = &shards[shardOfSeller(pair->sellerID, count)].pairs;
+        int moved = adjustPairCount(counter, pair->sellerID, pair->buyerID, pair->transactionCount);
+        counter->regular[moved] = pairCounter.regular[p];
+    }
+    freePairCounter(&pairCounter);
+
+    TransactionArray* trades = (TransactionArray*)calloc(count, sizeof(TransactionArray));
+    if (!trades) {
+        printf("Memory allocation failed.\n");
+        exit(1);
     }
-    
-    char line[256];
-    loading_mode = 1;
-    int totalLoaded = 0;
-    int duplicates = 0;
-    
-    while (fgets(line, sizeof(line), file)) {
-        int transactionID, buyerID, sellerID;
-        double energyAmount, pricePerKwh, totalPrice;
-        char timestamp[30];
-        
-        if (sscanf(line, "%d,%d,%d,%lf,%lf,%lf,%[^\n]", 
-                  &transactionID, &buyerID, &sellerID, 
-                  &energyAmount, &pricePerKwh, &totalPrice, 
-                  timestamp) == 7) {
-            
-            if (findTransactionInBPTree(globalTransactionTree, transactionID)) {
-                printf("Warning: Duplicate transaction ID %d found in file. Skipping.\n", transactionID);
-                duplicates++;
-                continue;
-            }
-            
-            Transaction* t = createTransaction(transactionID, buyerID, sellerID, 
-                                             energyAmount, pricePerKwh, timestamp);
-            t->totalPrice = totalPrice;
-            
-            Seller* seller = findOrCreateSeller(t->sellerID);
-            Buyer* buyer = findOrCreateBuyer(t->buyerID);
-            
-            // Insert into global transaction tree
-            insertTransactionIntoBPTree(&globalTransactionTree, t);
-            
-            // Also insert into seller's and buyer's trees
-            insertTransactionIntoEntityTree(&seller->transactionTree, t);
-            insertTransactionIntoEntityTree(&buyer->transactionTree, t);
-            
-            seller->numTransactions++;
-            seller->totalRevenue += t->totalPrice;
-            buyer->numTransactions++;
-            buyer->totalEnergyPurchased += t->energyAmount;
-            
-            addRegularBuyer(seller, buyer);
-            printf("Loaded transaction: ID %d\n", transactionID);
-            totalLoaded++;
-        } else {
-            printf("Warning: Malformed transaction data in file: %s", line);
+    for (int i = 0; i < count; i++) {
+        for (int s = 0; s < shards[i].sellerCount; s++)
+            trades[i].capacity += shards[i].sellers[s].numTransactions;
+        trades[i].transactions = (Transaction**)malloc((trades[i].capacity ? trades[i].capacity : 1) *
+                                                       sizeof(Transaction*));
+        if (!trades[i].transactions) {
+            printf("Memory allocation failed.\n");
+            exit(1);
         }
     }
-    
-    loading_mode = 0;
-    fclose(file);
-    printf("Successfully loaded %d transactions. Skipped %d duplicates.\n", totalLoaded, duplicates);
-    printf("Verifying B+ tree structure...\n");
-    
-    int treeCount = countTransactionsInTree(globalTransactionTree);
-    printf("Count of transactions in B+ tree: %d\n", treeCount);
-    
-    if (treeCount != totalLoaded) {
-        printf("WARNING: Mismatch between loaded transactions (%d) and tree count (%d)!\n", 
-               totalLoaded, treeCount);
+    BPTreeCursor cursor;
+    for (BPTreeNode* leaf = seekBPTree(globalTransactionTree, LLONG_MIN, &cursor); leaf;
+         leaf = nextLeafInBPTree(&cursor)) {
+        for (int i = 0; i < leaf->numKeys; i++) {
+            TransactionArray* shardTrades = &trades[shardOfSeller(leaf->records[i]->sellerID, count)];
+            shardTrades->transactions[shardTrades->count++] = leaf->records[i];
+        }
+    }
+    runOnShards(buildShardBuyers, trades);
+    mergeShardPools();
+    for (int i = 0; i < count; i++) free(trades[i].transactions);
+    free(trades);
+
+    for (int b = 0; b < buyerCount; b++) {
+        releaseBPTree(buyers[b].transactionTree);
+        buyers[b].transactionTree = NULL;
     }
 }
 
-Transaction* findTransactionById(BPTreeNode* root, int id) {
-    if (!root) return NULL;
-    BPTreeNode* cursor = root;
-    while (!cursor->isLeaf) {
-        int i;
-        for (i = 0; i < cursor->numKeys; i++) {
-            if (id < cursor->keys[i]) {
-                break;
+/* Stops the workers and frees the shards. Their trees and transactions go to the
+   global pools with everything else. */
+void releaseShards() {
+    for (int i = 0; i < shardCount; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        shards[i].stopping = 1;
+        pthread_cond_broadcast(&shards[i].changed);
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    for (int i = 0; i < shardCount; i++) pthread_join(shards[i].worker, NULL);
+    mergeShardPools();
+    for (int i = 0; i < shardCount; i++) {
+        Shard* shard = &shards[i];
+        pthread_mutex_destroy(&shard->lock);
+        pthread_cond_destroy(&shard->changed);
+        for (int s = 0; s < shard->sellerCount; s++) {
+            RegularBuyer* rb = shard->sellers[s].regularBuyers;
+            while (rb) {
+                RegularBuyer* next = rb->next;
+                free(rb);
+                rb = next;
             }
         }
-        cursor = cursor->children[i];
+        free(shard->sellers);
+        freeEntityIndex(&shard->sellerIndex);
+        free(shard->buyers);
+        freeEntityIndex(&shard->buyerIndex);
+        freePairCounter(&shard->pairs);
+        freeIngestOffsets(&shard->taken);
+    }
+    free(shards);
+    shards = NULL;
+    shardCount = 0;
+}
+
+int countShardedSellers() {
+    int total = 0;
+    for (int i = 0; i < shardCount; i++) total += shards[i].sellerCount;
+    return total;
+}
+
+// The snapshot's sellers, taken from the shards; arrays sized by countShardedSellers
+void captureShardedSellers(SnapshotImage* image) {
+    for (int i = 0; i < shardCount; i++) {
+        for (int s = 0; s < shards[i].sellerCount; s++) {
+            const Seller* seller = &shards[i].sellers[s];
+            image->sellerIDs[image->sellerCount] = seller->sellerID;
+            image->ratesBelow300[image->sellerCount] = seller->rateBelow300;
+            image->ratesAbove300[image->sellerCount++] = seller->rateAbove300;
+        }
     }
-    for (int i = 0; i < cursor->numKeys; i++) {
-        if (cursor->keys[i] == id) {
-            return cursor->records[i];
+}
+
+// Cursor on the lowest key among count cursors, or -1 once they are all done
+static inline int lowestCursor(BPTreeNode* const* leaves, const BPTreeCursor* cursors, int count) {
+    int lowest = -1;
+    for (int i = 0; i < count; i++)
+        if (leaves[i] && (lowest < 0 || leaves[i]->keys[cursors[i].pos] < leaves[lowest]->keys[cursors[lowest].pos]))
+            lowest = i;
+    return lowest;
+}
+
+/* Writes a buyer's trades from every shard, merged in ID order, and returns how many
+   there were; -1, with nothing written, if no shard knows the buyer. */
+long long writeShardedBuyerTrades(int buyerID, OutputBuffer* out) {
+    BPTreeCursor cursors[MAX_SHARDS];
+    BPTreeNode* leaves[MAX_SHARDS];
+    long long count = 0;
+    int known = 0;
+    for (int i = 0; i < shardCount; i++) {
+        Buyer* buyer = shardFindBuyer(&shards[i], buyerID);
+        leaves[i] = buyer ? seekBPTree(buyer->transactionTree, LLONG_MIN, &cursors[i]) : NULL;
+        if (buyer) {
+            known = 1;
+            count += buyer->numTransactions;
         }
     }
-    return NULL;
+    if (!known) return -1;
+    ResultWriter writer;
+    beginResult(&writer, RESULT_TRANSACTIONS, count, out);
+    for (;;) {
+        int i = lowestCursor(leaves, cursors, shardCount);
+        if (i < 0) break;
+        resultTransaction(&writer, leaves[i]->records[cursors[i].pos]);
+        if (++cursors[i].pos == leaves[i]->numKeys) leaves[i] = nextLeafInBPTree(&cursors[i]);
+    }
+    return endResult(&writer);
 }
 
-void displayTransactionsFromTree(BPTreeNode* root) {
-    if (!root) {
-        printf("No transactions to display.\n");
-        return;
+// What one worker hands back from a whole-store query
+typedef struct {
+    int limit;               // rows the query wants, all if <= 0
+    Seller* sellers;         // the shard's sellers by seller ID
+    SellerBuyerPair* pairs;  // the shard's top live pairs, most active first
+    int count;               // sellers or pairs
+    int totalTransactions;
+} ShardAnswer;
+
+ShardAnswer* newShardAnswers() {
+    ShardAnswer* answers = (ShardAnswer*)calloc(shardCount, sizeof(ShardAnswer));
+    if (!answers) {
+        printf("Memory allocation failed.\n");
+        exit(1);
     }
-    
-    Table table;
-    init_table(&table);
-    add_table_column(&table, "Transaction ID");
-    add_table_column(&table, "Buyer ID");
-    add_table_column(&table, "Seller ID");
-    add_table_column(&table, "Energy (kWh)");
-    add_table_column(&table, "Price/kWh");
-    add_table_column(&table, "Total Price");
-    add_table_column(&table, "Timestamp");
+    return answers;
+}
 
-    BPTreeNode* cursor = root;
-    while (!cursor->isLeaf) {
-        cursor = cursor->children[0];
+void freeShardAnswers(ShardAnswer* answers) {
+    for (int i = 0; i < shardCount; i++) {
+        free(answers[i].sellers);
+        free(answers[i].pairs);
     }
-    
-    int count = 0;
-    while (cursor) {
-        for (int i = 0; i < cursor->numKeys; i++) {
-            Transaction* t = cursor->records[i];
-            if (t) {
-                char id[20], buyer[20], seller[20], energy[20], price[20], total[20];
-                snprintf(id, sizeof(id), "%d", t->transactionID);
-                snprintf(buyer, sizeof(buyer), "%d", t->buyerID);
-                snprintf(seller, sizeof(seller), "%d", t->sellerID);
-                snprintf(energy, sizeof(energy), "%.2f", t->energyAmount);
-                snprintf(price, sizeof(price), "%.2f", t->pricePerKwh);
-                snprintf(total, sizeof(total), "%.2f", t->totalPrice);
-                
-                add_table_row(&table, id, buyer, seller, energy, price, total, t->timestamp);
-                count++;
-            }
-        }
-        cursor = cursor->next;
+    free(answers);
+}
+
+void collectShardSellers(Shard* shard, void* arg) {
+    ShardAnswer* answer = &((ShardAnswer*)arg)[shard->index];
+    answer->sellers = sellersById(shard->sellers, shard->sellerCount);
+    answer->count = shard->sellerCount;
+}
+
+// Revenue of every seller, merged across the shards in seller ID order; returns the row count
+long long writeShardedRevenue(OutputBuffer* out) {
+    ShardAnswer* answers = newShardAnswers();
+    runOnShards(collectShardSellers, answers);
+    long long total = 0;
+    for (int i = 0; i < shardCount; i++) total += answers[i].count;
+    int* next = (int*)calloc(shardCount, sizeof(int));
+    if (!next) {
+        printf("Memory allocation failed.\n");
+        exit(1);
     }
+    ResultWriter writer;
+    beginResult(&writer, RESULT_SELLER_REVENUE, total, out);
+    for (;;) {
+        // A seller lives in exactly one shard, so IDs never tie
+        int lowest = -1;
+        for (int i = 0; i < shardCount; i++)
+            if (next[i] < answers[i].count &&
+                (lowest < 0 || answers[i].sellers[next[i]].sellerID < answers[lowest].sellers[next[lowest]].sellerID))
+                lowest = i;
+        if (lowest < 0) break;
+        resultSellerRevenue(&writer, &answers[lowest].sellers[next[lowest]++]);
+    }
+    free(next);
+    freeShardAnswers(answers);
+    return endResult(&writer);
+}
 
-    printf("\n===== All Transactions (%d) =====\n", count);
-    print_table(&table);
-    free_table(&table);
+void collectShardPairs(Shard* shard, void* arg) {
+    ShardAnswer* answer = &((ShardAnswer*)arg)[shard->index];
+    int pairCount;
+    answer->pairs = sortedLivePairs(&shard->pairs, answer->limit, &pairCount, &answer->count,
+                                    &answer->totalTransactions);
+    if (!answer->pairs) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
 }
 
-void freeBPTree(BPTreeNode* node) {
-    if (!node) return;
-    if (node->isLeaf) {
-        for (int i = 0; i < node->numKeys; i++) {
-            free(node->records[i]);
-        }
-    } else {
-        for (int i = 0; i <= node->numKeys; i++) {
-            freeBPTree(node->children[i]);
+/* The limit most active pairs (all if limit <= 0) across the shards; returns the row
+   count. A pair lives in one shard, so each shard only has to send its own top limit. */
+long long writeShardedTopPairs(int limit, OutputBuffer* out) {
+    ShardAnswer* answers = newShardAnswers();
+    for (int i = 0; i < shardCount; i++) answers[i].limit = limit;
+    runOnShards(collectShardPairs, answers);
+    int pairCount = 0;
+    for (int i = 0; i < shardCount; i++) pairCount += answers[i].count;
+    int shown = (limit > 0 && limit < pairCount) ? limit : pairCount;
+    int* next = (int*)calloc(shardCount, sizeof(int));
+    if (!next) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    ResultWriter writer;
+    beginResult(&writer, RESULT_PAIRS, shown, out);
+    for (int row = 0; row < shown; row++) {
+        int best = -1;
+        for (int i = 0; i < shardCount; i++)
+            if (next[i] < answers[i].count &&
+                (best < 0 || compareSellerBuyerPairs(&answers[i].pairs[next[i]], &answers[best].pairs[next[best]]) < 0))
+                best = i;
+        resultPair(&writer, &answers[best].pairs[next[best]++]);
+    }
+    free(next);
+    freeShardAnswers(answers);
+    return endResult(&writer);
+}
+
+// The shard's seller, registered at the default rates if it is new and the policy allows
+Seller* shardIngestSeller(Shard* shard, int sellerID) {
+    Seller* seller = shardFindSeller(shard, sellerID);
+    if (seller || unknownSellerPolicy != UNKNOWN_SELLER_DEFAULT) return seller;
+    if (appendSellerRatesRecord(&shard->log, sellerID, defaultRateBelow300, defaultRateAbove300) != 0) return NULL;
+    Seller added;
+    memset(&added, 0, sizeof(added));
+    added.sellerID = sellerID;
+    added.rateBelow300 = defaultRateBelow300;
+    added.rateAbove300 = defaultRateAbove300;
+    return shardAddSeller(shard, &added);
+}
+
+/* Runs on the shard's worker. A line that arrives after a later one with the same ID
+   replaces it, so the shard keeps the earliest line of each ID. Both stay in the
+   segment; its replay orders them by input offset. */
+void applyShardTrade(IngestQueue* queue, const Transaction* trade, uint64_t inputOffset) {
+    Shard* shard = (Shard*)queue->context;
+    uint64_t takenAt = ingestOffsetOf(&shard->taken, trade->transactionID);
+    if (findTransactionInBPTree(globalTransactionTree, trade->transactionID) ||
+        (takenAt != NO_INPUT_OFFSET && takenAt < inputOffset)) {
+        queue->outcomes[CHANGE_DUPLICATE_ID]++;
+        return;
+    }
+    Seller* seller = shardIngestSeller(shard, trade->sellerID);
+    if (!seller) {
+        queue->outcomes[shard->log.failed ? CHANGE_LOG_FAILED : CHANGE_UNKNOWN_SELLER]++;
+        return;
+    }
+    Transaction* t = (Transaction*)poolAlloc(&shard->transactions);
+    *t = *trade;
+    t->pricePerKwh = (t->energyAmount <= 300) ? seller->rateBelow300 : seller->rateAbove300;
+    t->totalPrice = t->energyAmount * t->pricePerKwh;
+    if (appendShardInsertRecord(&shard->log, t, inputOffset) != 0) {
+        poolFree(&shard->transactions, t);
+        queue->outcomes[CHANGE_LOG_FAILED]++;
+        return;
+    }
+    if (takenAt != NO_INPUT_OFFSET) {
+        Transaction* later = findTransactionById(shard->byId, t->transactionID);
+        shardRemoveTrade(shard, later);
+        deleteTransactionFromBPTree(&shard->byId, t->transactionID);
+        poolFree(&shard->transactions, later);
+        queue->outcomes[CHANGE_APPLIED]--;
+        queue->outcomes[CHANGE_DUPLICATE_ID]++;
+    }
+    insertTransactionIntoBPTree(&shard->byId, t);
+    noteIngestOffset(&shard->taken, t->transactionID, inputOffset);
+    shardAddTrade(shard, seller, t);
+    queue->outcomes[CHANGE_APPLIED]++;
+}
+
+void drainShardQueue(Shard* shard, void* arg) {
+    ingestWriter(&((IngestQueue*)arg)[shard->index]);
+}
+
+/* Creates an empty log segment per shard, named by segmentFormat, and sets each
+   worker draining queues[i] into its shard. Returns -1, with nothing started, if a
+   segment cannot be created. */
+int startShardIngest(IngestQueue* queues, const char* segmentFormat) {
+    for (int i = 0; i < shardCount; i++) {
+        Shard* shard = &shards[i];
+        snprintf(shard->segmentPath, sizeof(shard->segmentPath), segmentFormat, i);
+        if (walCreate(shard->segmentPath, 1) != 0 ||
+            appendLogOpen(&shard->log, shard->segmentPath, transactionLog.policy,
+                          transactionLog.syncEveryRecords, transactionLog.syncIntervalMs) != 0) {
+            printf("Error creating %s: %s\n", shard->segmentPath, strerror(errno));
+            while (i-- > 0) appendLogClose(&shards[i].log);
+            return -1;
         }
+        shard->log.nextLsn = 1;
+        // The workers sync once per batch
+        shard->log.deferSyncs = transactionLog.policy == SYNC_PER_RECORD;
+        initIngestQueue(&queues[i], &shard->log, applyShardTrade, shard);
     }
-    free(node);
+    dispatchToShards(drainShardQueue, queues);
+    return 0;
 }
 
-void freeBPTreeNodesOnly(BPTreeNode* node) {
-    if (!node) return;
-    if (!node->isLeaf) {
-        for (int i = 0; i <= node->numKeys; i++) {
-            freeBPTreeNodesOnly(node->children[i]);
+/* Call once every producer has returned: drains the queues and closes the segments.
+   Returns -1 if a batch could not be made durable. */
+int stopShardIngest(IngestQueue* queues) {
+    int status = 0;
+    for (int i = 0; i < shardCount; i++) closeIngestQueue(&queues[i]);
+    waitForShards();
+    for (int i = 0; i < shardCount; i++) {
+        if (finishIngestQueue(&queues[i]) != 0) status = -1;
+        appendLogClose(&shards[i].log);
+    }
+    return status;
+}
+
+/* Settles the IDs that more than one shard took, keeping the earliest input line,
+   then adds the trades kept to the global indexes, totals, rollups and buyers. */
+void gatherShardIngest(IngestQueue* queues) {
+    mergeShardPools();
+    long long total = 0;
+    for (int i = 0; i < shardCount; i++) total += countTransactionsInTree(shards[i].byId);
+    Transaction** kept = (Transaction**)malloc((total ? total : 1) * sizeof(Transaction*));
+    BPTreeCursor cursors[MAX_SHARDS];
+    BPTreeNode* leaves[MAX_SHARDS];
+    if (!kept) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    for (int i = 0; i < shardCount; i++)
+        leaves[i] = seekBPTree(shards[i].byId, LLONG_MIN, &cursors[i]);
+    int count = 0;
+    for (;;) {
+        int lowest = lowestCursor(leaves, cursors, shardCount);
+        if (lowest < 0) break;
+        BPKey id = leaves[lowest]->keys[cursors[lowest].pos];
+        int earliest = lowest;
+        for (int i = lowest + 1; i < shardCount; i++)
+            if (leaves[i] && leaves[i]->keys[cursors[i].pos] == id &&
+                ingestOffsetOf(&shards[i].taken, (int)id) < ingestOffsetOf(&shards[earliest].taken, (int)id))
+                earliest = i;
+        for (int i = lowest; i < shardCount; i++) {
+            if (!leaves[i] || leaves[i]->keys[cursors[i].pos] != id) continue;
+            Transaction* t = leaves[i]->records[cursors[i].pos];
+            if (++cursors[i].pos == leaves[i]->numKeys) leaves[i] = nextLeafInBPTree(&cursors[i]);
+            if (i == earliest) {
+                kept[count++] = t;
+                continue;
+            }
+            shardRemoveTrade(&shards[i], t);
+            releaseTransaction(t);
+            queues[i].outcomes[CHANGE_APPLIED]--;
+            queues[i].outcomes[CHANGE_DUPLICATE_ID]++;
         }
     }
-    free(node);
+    for (int i = 0; i < shardCount; i++) {
+        releaseBPTree(shards[i].byId);
+        shards[i].byId = NULL;
+        freeIngestOffsets(&shards[i].taken);
+    }
+    for (int i = 0; i < count; i++) {
+        Transaction* t = kept[i];
+        storeTotals.transactions++;
+        storeTotals.revenue += t->totalPrice;
+        storeTotals.energy += t->energyAmount;
+        adjustRollups(t, 1);
+        Buyer* buyer = findOrCreateBuyer(t->buyerID);
+        buyer->numTransactions++;
+        buyer->totalEnergyPurchased += t->energyAmount;
+        if (t->transactionID >= nextTransactionID) nextTransactionID = t->transactionID + 1;
+    }
+    rebuildLeaderboard();
+    buildBPTreeFromSorted(&globalTransactionTree, kept, count, transactionIdKey);
+    buildSecondaryIndex(&timeIndexTree, kept, count, transactionTimeKey);
+    buildSecondaryIndex(&energyIndexTree, kept, count, transactionEnergyKey);
+    free(kept);
 }
 
-void freeTransactions() {
-    // Free global transaction tree
-    freeBPTree(globalTransactionTree);
-    // Free seller data
-    Seller* s = seller_head;
-    while (s) {
-        Seller* temp = s;
-        // Free seller's transaction tree if it exists
-        if (s->transactionTree) {
-            freeBPTreeNodesOnly(s->transactionTree);
+double currentTimeSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fills a scratch tree with scrambled keys, then deletes them all again, reporting
+   the cost per operation for each tenth of the run. Flat numbers mean splits and
+   merges stay O(log n) as the tree grows. */
+void benchmarkBPTreeInserts(int totalKeys) {
+    if (totalKeys < 10) {
+        printf("Benchmark needs at least 10 keys.\n");
+        return;
+    }
+    BPTreeNode* tree = NULL;
+    int block = totalKeys / 10;
+    printf("\n===== B+ Tree Insert Benchmark (%d keys, order %d) =====\n", totalKeys, ORDER);
+    for (int phase = 0; phase < 2; phase++) {
+        for (int start = 0; start < totalKeys; start += block) {
+            int end = start + block < totalKeys ? start + block : totalKeys;
+            double began = currentTimeSeconds();
+            for (int i = start; i < end; i++) {
+                // Multiplying by an odd constant permutes [0, 2^31), so keys stay unique
+                int key = (int)(((unsigned int)i * 2654435761u) & 0x7fffffffu);
+                if (phase == 0)
+                    insertRecordIntoBPTree(&tree, key, NULL);
+                else
+                    deleteTransactionFromBPTree(&tree, key);
+            }
+            double elapsed = currentTimeSeconds() - began;
+            printf("%s keys %9d-%9d: %7.1f ns/op, height %d\n", phase == 0 ? "insert" : "delete",
+                   start, end - 1, elapsed * 1e9 / (end - start), getTreeHeight(tree));
         }
-        // Free regular buyers list
-        RegularBuyer* rb = s->regularBuyers;
-        while (rb) {
-            RegularBuyer* tempRb = rb;
-            rb = rb->next;
-            free(tempRb);
+        if (phase == 0)
+            printf("Keys in tree after inserts: %d\n", countTransactionsInTree(tree));
+    }
+    printf("Tree empty after deletes: %s\n", tree == NULL ? "yes" : "no");
+}
+
+/* Times the original linear scan, the branchless binary search and each vector kernel
+   this CPU can run on full random nodes, checking that they all agree. */
+void benchmarkNodeSearch(int searches) {
+    if (searches < 1) {
+        printf("Benchmark needs at least one search.\n");
+        return;
+    }
+    const int nodeCount = 1024;
+    BPTreeNode** nodes = (BPTreeNode**)malloc(nodeCount * sizeof(BPTreeNode*));
+    BPKey* queries = (BPKey*)malloc(searches * sizeof(BPKey));
+    int* targets = (int*)malloc(searches * sizeof(int));
+    if (!nodes || !queries || !targets) {
+        printf("Memory allocation failed.\n");
+        free(nodes); free(queries); free(targets);
+        return;
+    }
+    srand(12345);
+    for (int n = 0; n < nodeCount; n++) {
+        nodes[n] = createBPTreeNode(0);
+        BPKey key = rand() % 16;
+        for (int i = 0; i < ORDER - 1; i++) {
+            key += 1 + rand() % 16;
+            nodes[n]->keys[i] = key;
         }
-        s = s->next;
-        free(temp);
+        nodes[n]->numKeys = ORDER - 1;
     }
-    
-    // Free buyer data
-    Buyer* b = buyer_head;
-    while (b) {
-        Buyer* temp = b;
-        // Free buyer's transaction tree if it exists
-        if (b->transactionTree) {
-            freeBPTreeNodesOnly(b->transactionTree);
+    for (int q = 0; q < searches; q++) {
+        targets[q] = rand() % nodeCount;
+        queries[q] = rand() % (nodes[targets[q]]->keys[ORDER - 2] + 16);
+    }
+
+    const char* names[4] = { "linear loop", "branchless binary" };
+    int (*kernels[4])(const BPKey*, int, BPKey) = { nodeUpperBoundLinear, nodeUpperBoundBinary };
+    int kernelCount = 2;
+#ifdef NODE_SEARCH_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        names[kernelCount] = "SSE4.2";
+        kernels[kernelCount++] = nodeUpperBoundSse42;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        names[kernelCount] = "AVX2";
+        kernels[kernelCount++] = nodeUpperBoundAvx2;
+    }
+#endif
+    long long checksums[4];
+    int match = 1;
+    printf("\n===== Node Search Benchmark (%d searches, %d keys per node) =====\n", searches, ORDER - 1);
+    printf("Tree searches use: %s\n", nodeSearchKernel);
+    for (int k = 0; k < kernelCount; k++) {
+        long long sum = 0;
+        double began = currentTimeSeconds();
+        for (int q = 0; q < searches; q++) {
+            const BPTreeNode* node = nodes[targets[q]];
+            sum += kernels[k](node->keys, node->numKeys, queries[q]);
         }
-        b = b->next;
-        free(temp);
+        double elapsed = currentTimeSeconds() - began;
+        checksums[k] = sum;
+        if (checksums[k] != checksums[0]) match = 0;
+        printf("%-20s %7.2f ns/search\n", names[k], elapsed * 1e9 / searches);
     }
+    printf("Results match: %s\n", match ? "yes" : "NO");
+
+    for (int n = 0; n < nodeCount; n++) releaseBPTreeNode(nodes[n]);
+    free(nodes);
+    free(queries);
+    free(targets);
 }
 
-void createSetOfTransactionsForSeller(int sellerID) {
-    printf("\n===== Transactions for Seller ID %d =====\n", sellerID);
-    
-    Seller* seller = NULL;
-    Seller* current = seller_head;
-    
-    while (current) {
-        if (current->sellerID == sellerID) {
-            seller = current;
-            break;
-        }
-        current = current->next;
+/* Appends the same records to a scratch file under each sync policy. The time
+   includes the final sync at close, so every run ends with all records durable. */
+void benchmarkAppendLog(int records) {
+    if (records < 1) {
+        printf("Benchmark needs at least one record.\n");
+        return;
     }
-    
-    if (!seller) {
-        printf("Seller ID %d not found.\n", sellerID);
+    const char* scratchPath = "append_log_benchmark.tmp";
+    const SyncPolicy policies[] = { SYNC_PER_RECORD, SYNC_EVERY_N, SYNC_EVERY_N, SYNC_EVERY_N, SYNC_INTERVAL, SYNC_INTERVAL };
+    const int everyRecords[] = { 1, 8, 64, 512, 1, 1 };
+    const int intervalMs[] = { 1, 1, 1, 1, 10, 100 };
+    const int policyCount = (int)(sizeof(policies) / sizeof(policies[0]));
+    // Static because an AppendLog carries its 64 KB buffer inline
+    static AppendLog scratch;
+    Transaction sample;
+    memset(&sample, 0, sizeof(sample));
+
+    printf("\n===== Append Log Benchmark (%d records) =====\n", records);
+    printf("%-18s %12s %10s %10s %10s\n", "Policy", "records/s", "us/record", "writes", "syncs");
+    for (int p = 0; p < policyCount; p++) {
+        if (walCreate(scratchPath, 1) != 0 ||
+            appendLogOpen(&scratch, scratchPath, policies[p], everyRecords[p], intervalMs[p]) != 0) return;
+        scratch.nextLsn = 1;
+        double began = currentTimeSeconds();
+        for (int i = 0; i < records; i++) {
+            sample.transactionID = i + 1;
+            sample.buyerID = 100 + i % 50;
+            sample.sellerID = 200 + i % 10;
+            sample.energyAmount = 50 + i % 500;
+            sample.pricePerKwh = 5.0;
+            sample.totalPrice = sample.energyAmount * sample.pricePerKwh;
+            sample.epoch = 1700000000LL + i;
+            if (appendTransactionRecord(&scratch, &sample) != 0) break;
+        }
+        appendLogClose(&scratch);
+        double elapsed = currentTimeSeconds() - began;
+        char name[32];
+        describeSyncPolicy(&scratch, name, sizeof(name));
+        printf("%-18s %12.0f %10.2f %10lld %10lld\n", name, records / elapsed,
+               elapsed * 1e6 / records, scratch.writeCalls, scratch.syncCalls);
+    }
+    remove(scratchPath);
+}
+
+/* Lists every transaction as csv into /dev/null and counts a full time-index range,
+   with 1, 2, 4, ... threads up to the --scan-threads setting, to show how the
+   parallel scans scale on the loaded data. */
+void benchmarkScans() {
+    int total = countTransactionsInTree(globalTransactionTree);
+    if (total == 0) {
+        printf("Load some transactions before benchmarking scans.\n");
         return;
     }
-    
-    if (!seller->transactionTree) {
-        printf("No transactions found for Seller ID %d.\n", sellerID);
+    FILE* sink = fopen("/dev/null", "w");
+    if (!sink) {
+        printf("Error opening /dev/null.\n");
         return;
     }
-    
-    Table table;
-    init_table(&table);
-    add_table_column(&table, "Transaction ID");
-    add_table_column(&table, "Buyer ID");
-    add_table_column(&table, "Seller ID");
-    add_table_column(&table, "Energy (kWh)");
-    add_table_column(&table, "Price/kWh");
-    add_table_column(&table, "Total Price");
-    add_table_column(&table, "Timestamp");
-    
-    BPTreeNode* cursor = seller->transactionTree;
-    
-    while (!cursor->isLeaf) {
-        cursor = cursor->children[0];
+    int maxThreads = chooseScanThreads();
+    int savedThreads = scanThreads;
+    OutputFormat savedFormat = outputFormat;
+    outputFormat = OUTPUT_CSV;
+    printf("\n===== Scan Benchmark (%d transactions) =====\n", total);
+    printf("%-8s %14s %14s %14s\n", "Threads", "List (s)", "Rows/s", "Count (s)");
+    double baseline = 0;
+    for (int threads = 1;; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+        scanThreads = threads;
+        OutputBuffer out;
+        initOutputBuffer(&out, sink);
+        double began = currentTimeSeconds();
+        long long listed = writeTransactionTree(globalTransactionTree, total, &out);
+        freeOutputBuffer(&out);
+        double listSeconds = currentTimeSeconds() - began;
+        began = currentTimeSeconds();
+        long long counted = scanTransactions(timeIndexTree, LLONG_MIN, LLONG_MAX, NULL, NULL);
+        double countSeconds = currentTimeSeconds() - began;
+        if (threads == 1) baseline = listSeconds;
+        printf("%-8d %14.3f %14.0f %14.3f", threads, listSeconds, listed / listSeconds, countSeconds);
+        if (threads > 1) printf("  (%.2fx)", baseline / listSeconds);
+        if (listed != total || counted != total) printf("  MISMATCH");
+        printf("\n");
+        if (threads >= maxThreads) break;
     }
-    
-    int found = 0;
-    while (cursor) {
-        for (int i = 0; i < cursor->numKeys; i++) {
-            Transaction* t = cursor->records[i];
-            if (t) {
-                char id[20], buyer[20], seller[20], energy[20], price[20], total[20];
-                snprintf(id, sizeof(id), "%d", t->transactionID);
-                snprintf(buyer, sizeof(buyer), "%d", t->buyerID);
-                snprintf(seller, sizeof(seller), "%d", t->sellerID);
-                snprintf(energy, sizeof(energy), "%.2f", t->energyAmount);
-                snprintf(price, sizeof(price), "%.2f", t->pricePerKwh);
-                snprintf(total, sizeof(total), "%.2f", t->totalPrice);
-                
-                add_table_row(&table, id, buyer, seller, energy, price, total, t->timestamp);
-                found++;
+    outputFormat = savedFormat;
+    scanThreads = savedThreads;
+    fclose(sink);
+}
+
+#define TREE_BENCH_MAX_THREADS 32
+
+typedef struct {
+    BPTreeNode** root;
+    pthread_barrier_t* start;
+    ConcurrentWriter writer;
+    int operations;
+    unsigned int seed;
+    BPKey keySpace;
+    long long hits;
+    long long inserted;
+    long long removed;
+} TreeBenchWorker;
+
+/* The worker's share of the mix: 60% lookups, 30% inserts and 10% removes of keys
+   drawn uniformly from the key space, through either the concurrent or the plain
+   single-threaded functions. */
+void runTreeBenchOps(TreeBenchWorker* worker, int concurrent) {
+    unsigned int state = worker->seed;
+    for (int i = 0; i < worker->operations; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int choice = state % 100;
+        BPKey key = (state / 100) % worker->keySpace;
+        if (choice < 60) {
+            worker->hits += concurrent ? concurrentLookup(worker->root, key, NULL)
+                                       : findTransactionInBPTree(*worker->root, (int)key);
+        } else if (choice < 90) {
+            if (concurrent) {
+                worker->inserted += concurrentInsert(worker->root, key, NULL, &worker->writer);
+            } else if (!findTransactionInBPTree(*worker->root, (int)key)) {
+                insertRecordIntoBPTree(worker->root, key, NULL);
+                worker->inserted++;
             }
+        } else {
+            worker->removed += concurrent ? concurrentRemove(worker->root, key, &worker->writer)
+                                          : removeKeyFromBPTree(worker->root, key);
         }
-        cursor = cursor->next;
     }
-    
-    if (found) {
-        print_table(&table);
-    } else {
-        printf("No transactions found for Seller ID %d.\n", sellerID);
-    }
-    
-    free_table(&table);
 }
 
-void createSetOfTransactionsForBuyer(int buyerID) {
-    printf("\n===== Transactions for Buyer ID %d =====\n", buyerID);
-    
-    Buyer* buyer = NULL;
-    Buyer* current = buyer_head;
-    
-    while (current) {
-        if (current->buyerID == buyerID) {
-            buyer = current;
-            break;
+void* treeBenchWorker(void* arg) {
+    TreeBenchWorker* worker = (TreeBenchWorker*)arg;
+    pthread_barrier_wait(worker->start);
+    runTreeBenchOps(worker, 1);
+    return NULL;
+}
+
+/* Runs the same operation mix on a freshly preloaded tree with the plain functions on
+   one thread, then with the concurrent ones on 1 to 32 threads sharing the tree, and
+   checks that every run leaves a valid tree holding exactly the keys it should. */
+void benchmarkConcurrentTree(int operations) {
+    if (operations < 1000) {
+        printf("Benchmark needs at least 1000 operations.\n");
+        return;
+    }
+    int preload = operations / 2;
+    static TreeBenchWorker workers[TREE_BENCH_MAX_THREADS];
+    pthread_t threads[TREE_BENCH_MAX_THREADS];
+    printf("\n===== Concurrent B+ Tree Benchmark (%d operations, %d keys preloaded) =====\n", operations, preload);
+    printf("Mix: 60%% lookups, 30%% inserts, 10%% removes of keys in [0, %d)\n", 2 * preload);
+    printf("%-8s %12s %10s %12s %8s\n", "Threads", "Mops/s", "Speedup", "Restarts/op", "Check");
+    double baseline = 0;
+    for (int threadCount = 0; threadCount <= TREE_BENCH_MAX_THREADS; threadCount = threadCount ? threadCount * 2 : 1) {
+        // threadCount 0 is the single-threaded baseline; the preload holds every even key
+        BPTreeNode* tree = NULL;
+        for (int i = 0; i < preload; i++)
+            insertRecordIntoBPTree(&tree, 2 * (BPKey)((i * 2654435761ULL) % preload), NULL);
+        int workerCount = threadCount ? threadCount : 1;
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, workerCount + 1);
+        for (int t = 0; t < workerCount; t++) {
+            TreeBenchWorker* worker = &workers[t];
+            memset(worker, 0, sizeof(TreeBenchWorker));
+            worker->root = &tree;
+            worker->start = &start;
+            initConcurrentWriter(&worker->writer);
+            worker->operations = operations / workerCount + (t < operations % workerCount);
+            worker->seed = 2463534242u + 7919u * t;
+            worker->keySpace = 2 * (BPKey)preload;
+        }
+        double began = currentTimeSeconds();
+        if (threadCount == 0) {
+            runTreeBenchOps(&workers[0], 0);
+        } else {
+            for (int t = 0; t < workerCount; t++) {
+                if (pthread_create(&threads[t], NULL, treeBenchWorker, &workers[t]) != 0) {
+                    printf("Error starting benchmark thread.\n");
+                    exit(1);
+                }
+            }
+            began = currentTimeSeconds();
+            pthread_barrier_wait(&start);
+            for (int t = 0; t < workerCount; t++) pthread_join(threads[t], NULL);
+        }
+        double elapsed = currentTimeSeconds() - began;
+        pthread_barrier_destroy(&start);
+
+        long long expected = preload, restarts = 0;
+        for (int t = 0; t < workerCount; t++) {
+            expected += workers[t].inserted - workers[t].removed;
+            restarts += workers[t].writer.restarts;
+            finishConcurrentWriter(&workers[t].writer);
         }
-        current = current->next;
+        int valid = checkBPTree(tree) && countTransactionsInTree(tree) == expected;
+        double rate = operations / elapsed / 1e6;
+        if (threadCount == 1) baseline = rate;
+        if (threadCount == 0)
+            printf("%-8s %12.2f %10s %12s %8s\n", "plain", rate, "-", "-", valid ? "ok" : "FAILED");
+        else
+            printf("%-8d %12.2f %9.2fx %12.4f %8s\n", threadCount, rate, rate / baseline,
+                   (double)restarts / operations, valid ? "ok" : "FAILED");
+        releaseBPTree(tree);
     }
-    
-    if (!buyer) {
-        printf("Buyer ID %d not found.\n", buyerID);
-        return;
+}
+
+#define INGEST_BENCH_MAX_PRODUCERS 16
+
+// Scratch store for the ingest benchmark: the three main indexes and a log
+typedef struct {
+    BPTreeNode* byId;
+    BPTreeNode* byTime;
+    BPTreeNode* byEnergy;
+    AppendLog* log;
+} IngestScratch;
+
+typedef struct {
+    IngestQueue* queues;  // trades go to the queue of their seller's shard
+    int queueCount;
+    pthread_barrier_t* start;
+    IngestProducerStats stats;
+    int first;   // IDs first, first + stride, ...
+    int stride;
+    int trades;
+} IngestBenchProducer;
+
+void applyScratchTrade(IngestQueue* queue, const Transaction* trade, uint64_t inputOffset) {
+    (void)inputOffset;  // the generated IDs are unique
+    IngestScratch* scratch = (IngestScratch*)queue->context;
+    Transaction* t = (Transaction*)poolAlloc(&transactionPool);
+    *t = *trade;
+    insertRecordIntoBPTree(&scratch->byId, transactionIdKey(t), t);
+    insertRecordIntoBPTree(&scratch->byTime, transactionTimeKey(t), t);
+    insertRecordIntoBPTree(&scratch->byEnergy, transactionEnergyKey(t), t);
+    queue->outcomes[appendTransactionRecord(scratch->log, t) == 0 ? CHANGE_APPLIED : CHANGE_LOG_FAILED]++;
+}
+
+void* ingestBenchProducer(void* arg) {
+    IngestBenchProducer* producer = (IngestBenchProducer*)arg;
+    Transaction trade;
+    memset(&trade, 0, sizeof(trade));
+    pthread_barrier_wait(producer->start);
+    for (int i = 0; i < producer->trades; i++) {
+        int id = producer->first + i * producer->stride;
+        trade.transactionID = id;
+        trade.buyerID = 100 + id % 5000;
+        trade.sellerID = 1 + id % 300;
+        trade.energyAmount = 1 + id % 900;
+        trade.pricePerKwh = 5.0;
+        trade.totalPrice = trade.energyAmount * trade.pricePerKwh;
+        trade.epoch = 1600000000LL + (long long)(id * 2654435761u % 315360000u);
+        ingestSubmit(&producer->queues[shardOfSeller(trade.sellerID, producer->queueCount)], &trade, (uint64_t)id,
+                     &producer->stats);
     }
-    
-    if (!buyer->transactionTree) {
-        printf("No transactions found for Buyer ID %d.\n", buyerID);
+    return NULL;
+}
+
+/* Pushes generated trades through the ingest queue from 1, 2, 4, ... 16 producer
+   threads into scratch ID, time and energy trees and a scratch log synced once per
+   batch, reporting throughput and the enqueue latency the producers saw. */
+void benchmarkIngestQueue(int trades) {
+    if (trades < 1) {
+        printf("Benchmark needs at least one trade.\n");
         return;
     }
-    
-    Table table;
-    init_table(&table);
-    add_table_column(&table, "Transaction ID");
-    add_table_column(&table, "Buyer ID");
-    add_table_column(&table, "Seller ID");
-    add_table_column(&table, "Energy (kWh)");
-    add_table_column(&table, "Price/kWh");
-    add_table_column(&table, "Total Price");
-    add_table_column(&table, "Timestamp");
-    
-    BPTreeNode* cursor = buyer->transactionTree;
-    
-    while (!cursor->isLeaf) {
-        cursor = cursor->children[0];
+    const char* scratchPath = "ingest_benchmark.tmp";
+    // Static because an AppendLog carries its 64 KB buffer inline
+    static AppendLog scratchLog;
+    static IngestBenchProducer producers[INGEST_BENCH_MAX_PRODUCERS];
+    pthread_t threads[INGEST_BENCH_MAX_PRODUCERS];
+    printf("\n===== Ingest Queue Benchmark (%d trades, %d slots, batches of up to %d) =====\n",
+           trades, INGEST_QUEUE_SLOTS, INGEST_BATCH);
+    printf("%-10s %12s %8s %10s %10s %12s %12s\n", "Producers", "Trades/s", "Batches", "p50 (us)", "p99 (us)",
+           "Max (us)", "Full waits");
+    for (int producerCount = 1; producerCount <= INGEST_BENCH_MAX_PRODUCERS; producerCount *= 2) {
+        if (walCreate(scratchPath, 1) != 0 || appendLogOpen(&scratchLog, scratchPath, SYNC_PER_RECORD, 1, 1) != 0) return;
+        scratchLog.nextLsn = 1;
+        scratchLog.deferSyncs = 1;
+        IngestScratch scratch = { NULL, NULL, NULL, &scratchLog };
+        IngestQueue queue;
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, producerCount + 1);
+        startIngestQueue(&queue, &scratchLog, applyScratchTrade, &scratch);
+        for (int p = 0; p < producerCount; p++) {
+            memset(&producers[p], 0, sizeof(IngestBenchProducer));
+            producers[p].queues = &queue;
+            producers[p].queueCount = 1;
+            producers[p].start = &start;
+            producers[p].first = 1 + p;
+            producers[p].stride = producerCount;
+            producers[p].trades = trades / producerCount + (p < trades % producerCount);
+            if (pthread_create(&threads[p], NULL, ingestBenchProducer, &producers[p]) != 0) {
+                printf("Error starting benchmark thread.\n");
+                exit(1);
+            }
+        }
+        pthread_barrier_wait(&start);
+        double began = currentTimeSeconds();
+        IngestProducerStats total;
+        memset(&total, 0, sizeof(total));
+        for (int p = 0; p < producerCount; p++) {
+            pthread_join(threads[p], NULL);
+            mergeLatency(&total.latency, &producers[p].stats.latency);
+            total.fullWaits += producers[p].stats.fullWaits;
+        }
+        int status = stopIngestQueue(&queue);
+        double elapsed = currentTimeSeconds() - began;
+        pthread_barrier_destroy(&start);
+        appendLogClose(&scratchLog);
+
+        printf("%-10d %12.0f %8lld %10.2f %10.2f %12.2f %12lld", producerCount, trades / elapsed, queue.batches,
+               latencyPercentile(&total.latency, 0.50) / 1e3, latencyPercentile(&total.latency, 0.99) / 1e3,
+               total.latency.maxNs / 1e3, total.fullWaits);
+        if (status != 0 || queue.outcomes[CHANGE_APPLIED] != trades || countTransactionsInTree(scratch.byId) != trades)
+            printf("  FAILED");
+        printf("\n");
+        BPTreeCursor cursor;
+        for (BPTreeNode* leaf = seekBPTree(scratch.byId, LLONG_MIN, &cursor); leaf; leaf = nextLeafInBPTree(&cursor))
+            for (int i = 0; i < leaf->numKeys; i++) releaseTransaction(leaf->records[i]);
+        releaseBPTree(scratch.byId);
+        releaseBPTree(scratch.byTime);
+        releaseBPTree(scratch.byEnergy);
+    }
+    remove(scratchPath);
+}
+
+/* Pushes generated trades through 1, 2, 4, ... 16 shards, with as many producers as
+   shards, into scratch log segments. The trades use IDs past the store's and sellers it
+   has not seen, which the shards register at scratch rates; nothing is gathered into
+   the store. */
+void benchmarkShardedIngest(int trades) {
+    if (trades < 1) {
+        printf("Benchmark needs at least one trade.\n");
+        return;
     }
-    
-    int found = 0;
-    while (cursor) {
-        for (int i = 0; i < cursor->numKeys; i++) {
-            Transaction* t = cursor->records[i];
-            if (t) {
-                char id[20], buyer[20], seller[20], energy[20], price[20], total[20];
-                snprintf(id, sizeof(id), "%d", t->transactionID);
-                snprintf(buyer, sizeof(buyer), "%d", t->buyerID);
-                snprintf(seller, sizeof(seller), "%d", t->sellerID);
-                snprintf(energy, sizeof(energy), "%.2f", t->energyAmount);
-                snprintf(price, sizeof(price), "%.2f", t->pricePerKwh);
-                snprintf(total, sizeof(total), "%.2f", t->totalPrice);
-                
-                add_table_row(&table, id, buyer, seller, energy, price, total, t->timestamp);
-                found++;
+    static IngestQueue queues[INGEST_BENCH_MAX_PRODUCERS];
+    static IngestBenchProducer producers[INGEST_BENCH_MAX_PRODUCERS];
+    pthread_t threads[INGEST_BENCH_MAX_PRODUCERS];
+    UnknownSellerPolicy savedPolicy = unknownSellerPolicy;
+    double savedBelow = defaultRateBelow300, savedAbove = defaultRateAbove300;
+    unknownSellerPolicy = UNKNOWN_SELLER_DEFAULT;
+    defaultRateBelow300 = defaultRateAbove300 = 5.0;
+    printf("\n===== Sharded Ingest Benchmark (%d trades, one producer per shard) =====\n", trades);
+    printf("%-8s %12s %8s %10s %10s %12s\n", "Shards", "Trades/s", "Batches", "p50 (us)", "p99 (us)", "Full waits");
+    for (int count = 1; count <= INGEST_BENCH_MAX_PRODUCERS; count *= 2) {
+        createShards(count);
+        if (startShardIngest(queues, "shard_benchmark.tmp%d") != 0) {
+            releaseShards();
+            break;
+        }
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, count + 1);
+        for (int p = 0; p < count; p++) {
+            memset(&producers[p], 0, sizeof(IngestBenchProducer));
+            producers[p].queues = queues;
+            producers[p].queueCount = count;
+            producers[p].start = &start;
+            producers[p].first = nextTransactionID + p;
+            producers[p].stride = count;
+            producers[p].trades = trades / count + (p < trades % count);
+            if (pthread_create(&threads[p], NULL, ingestBenchProducer, &producers[p]) != 0) {
+                printf("Error starting benchmark thread.\n");
+                exit(1);
             }
         }
-        cursor = cursor->next;
-    }
-    
-    if (found) {
-        print_table(&table);
-    } else {
-        printf("No transactions found for Buyer ID %d.\n", buyerID);
+        pthread_barrier_wait(&start);
+        double began = currentTimeSeconds();
+        IngestProducerStats total;
+        memset(&total, 0, sizeof(total));
+        for (int p = 0; p < count; p++) {
+            pthread_join(threads[p], NULL);
+            mergeLatency(&total.latency, &producers[p].stats.latency);
+            total.fullWaits += producers[p].stats.fullWaits;
+        }
+        int status = stopShardIngest(queues);
+        double elapsed = currentTimeSeconds() - began;
+        pthread_barrier_destroy(&start);
+
+        long long applied = 0, batches = 0;
+        for (int q = 0; q < count; q++) {
+            applied += queues[q].outcomes[CHANGE_APPLIED];
+            batches += queues[q].batches;
+        }
+        printf("%-8d %12.0f %8lld %10.2f %10.2f %12lld", count, trades / elapsed, batches,
+               latencyPercentile(&total.latency, 0.50) / 1e3, latencyPercentile(&total.latency, 0.99) / 1e3,
+               total.fullWaits);
+        if (status != 0 || applied != trades) printf("  FAILED");
+        printf("\n");
+        // Nothing the shards took is kept, so their pools go whole
+        for (int q = 0; q < count; q++) {
+            destroyObjectPool(&shards[q].nodes);
+            destroyObjectPool(&shards[q].transactions);
+            remove(shards[q].segmentPath);
+        }
+        releaseShards();
     }
-    
-    free_table(&table);
+    unknownSellerPolicy = savedPolicy;
+    defaultRateBelow300 = savedBelow;
+    defaultRateAbove300 = savedAbove;
 }
 
-void deleteTransaction(int transactionID) {
-    Transaction* t = findTransactionById(globalTransactionTree, transactionID);
-    if (!t) {
-        printf("Error: Transaction with ID %d does not exist.\n", transactionID);
+/* Writes a synthetic transaction file of the given size and loads it end to end,
+   first with one parser thread and then with the default count, and finally restores
+   it from a snapshot. The fgets/sscanf line shows what parsing alone used to cost. */
+void benchmarkLoad(int rows) {
+    if (rows < 1) {
+        printf("Benchmark needs at least one row.\n");
         return;
     }
-    
-    int buyerID = t->buyerID;
-    int sellerID = t->sellerID;
-    double energyAmount = t->energyAmount;
-    double totalPrice = t->totalPrice;
-    
-    // Find the seller and buyer
-    Seller* seller = seller_head;
-    while (seller && seller->sellerID != sellerID) {
-        seller = seller->next;
-    }
-    
-    Buyer* buyer = buyer_head;
-    while (buyer && buyer->buyerID != buyerID) {
-        buyer = buyer->next;
-    }
-    
-    // Delete from global transaction tree
-    deleteTransactionFromBPTree(&globalTransactionTree, transactionID);
-    
-    // Delete from seller's transaction tree if it exists
-    if (seller && seller->transactionTree) {
-        deleteTransactionFromBPTree(&seller->transactionTree, transactionID);
-        seller->numTransactions--;
-        seller->totalRevenue -= totalPrice;
+    const char* path = "load_benchmark.tmp";
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        printf("Error creating %s.\n", path);
+        return;
     }
-    
-    // Delete from buyer's transaction tree if it exists
-    if (buyer && buyer->transactionTree) {
-        deleteTransactionFromBPTree(&buyer->transactionTree, transactionID);
-        buyer->numTransactions--;
-        buyer->totalEnergyPurchased -= energyAmount;
+    srand(2024);
+    for (int i = 1; i <= rows; i++) {
+        char timestamp[30];
+        formatTimestamp(1262304000LL + (long long)rand() * 7 % 441504000LL, timestamp, sizeof(timestamp));
+        double energy = (rand() % 60000) / 100.0;
+        double price = 4 + rand() % 7;
+        fprintf(out, "%d,%d,%d,%.2f,%.2f,%.2f,%s\n", i, 100000 + rand() % 100000, 1000 + rand() % 1000,
+                energy, price, energy * price, timestamp);
     }
-    
-    // Update the transaction file
-    deleteTransactionFile(transactionID);
-    printf("Transaction with ID %d successfully deleted.\n", transactionID);
-}
+    fclose(out);
 
-BPTreeNode* findParent(BPTreeNode* root, BPTreeNode* child) {
-    if (!root || root == child)
-        return NULL;
-    for (int i = 0; i <= root->numKeys; i++) {
-        if (root->children[i] == child)
-            return root;
+    printf("\n===== Load Benchmark (%d rows) =====\n", rows);
+    FILE* in = fopen(path, "r");
+    char line[256];
+    int legacyRows = 0;
+    double began = currentTimeSeconds();
+    while (in && fgets(line, sizeof(line), in)) {
+        int transactionID, buyerID, sellerID;
+        double energyAmount, pricePerKwh, totalPrice;
+        char timestamp[30];
+        long long epoch;
+        if (sscanf(line, "%d,%d,%d,%lf,%lf,%lf,%29[^\n]", &transactionID, &buyerID, &sellerID,
+                   &energyAmount, &pricePerKwh, &totalPrice, timestamp) == 7 && parseTimestamp(timestamp, &epoch))
+            legacyRows++;
     }
-    for (int i = 0; i <= root->numKeys; i++) {
-        if (!root->isLeaf) {
-            BPTreeNode* parent = findParent(root->children[i], child);
-            if (parent)
-                return parent;
+    double legacySeconds = currentTimeSeconds() - began;
+    if (in) fclose(in);
+
+    int settings[2] = { 1, loaderThreads };
+    int runs = chooseLoaderThreads((size_t)LOADER_MAX_THREADS * LOADER_MIN_CHUNK_BYTES) > 1 ? 2 : 1;
+    double parseSeconds[2], buildSeconds[2];
+    int threadCounts[2];
+    int savedThreads = loaderThreads;
+    const char* snapshotPath = "load_benchmark.snapshot";
+    for (int r = 0; r < runs; r++) {
+        loaderThreads = settings[r];
+        initObjectPools();
+        loadTransactionFile(path);
+        parseSeconds[r] = lastLoadStats.parseSeconds;
+        buildSeconds[r] = lastLoadStats.buildSeconds;
+        threadCounts[r] = lastLoadStats.threads;
+        if (r == runs - 1) {
+            SnapshotImage image;
+            if (captureSnapshotImage(&image) != 0 || writeSnapshotImage(snapshotPath, &image) != 0)
+                snapshotPath = NULL;
+            freeSnapshotImage(&image);
         }
+        freeTransactions();
+    }
+    loaderThreads = savedThreads;
+    initObjectPools();
+    double restoreRead = 0, restoreBuild = 0;
+    if (snapshotPath) {
+        uint64_t lsn;
+        LoadedRow* restoredRows;
+        int restoredCount, duplicates;
+        began = currentTimeSeconds();
+        loadSnapshotRows(snapshotPath, &lsn, &restoredRows, &restoredCount);
+        double readAt = currentTimeSeconds();
+        applyLoadedRows(restoredRows, restoredCount, &duplicates);
+        restoreRead = readAt - began;
+        restoreBuild = currentTimeSeconds() - readAt;
+        freeTransactions();
+        initObjectPools();
+        remove(snapshotPath);
+    }
+    remove(path);
+
+    printf("\n%-28s %10s %10s %10s %12s\n", "Loader", "parse ms", "build ms", "total ms", "rows/s");
+    printf("%-28s %10.1f %10s %10s %12.0f\n", "fgets + sscanf (parse only)", legacySeconds * 1e3, "-", "-",
+           legacyRows / legacySeconds);
+    for (int r = 0; r < runs; r++) {
+        char name[40];
+        snprintf(name, sizeof(name), "mmap, %d thread%s", threadCounts[r], threadCounts[r] == 1 ? "" : "s");
+        double total = parseSeconds[r] + buildSeconds[r];
+        printf("%-28s %10.1f %10.1f %10.1f %12.0f\n", name, parseSeconds[r] * 1e3, buildSeconds[r] * 1e3,
+               total * 1e3, rows / total);
+    }
+    if (snapshotPath) {
+        double total = restoreRead + restoreBuild;
+        printf("%-28s %10.1f %10.1f %10.1f %12.0f\n", "snapshot restore", restoreRead * 1e3,
+               restoreBuild * 1e3, total * 1e3, rows / total);
     }
-    return NULL;
 }
 
-void removeFromLeaf(BPTreeNode* node, int idx) {
-    for (int i = idx; i < node->numKeys - 1; i++) {
-        node->keys[i] = node->keys[i + 1];
-        node->records[i] = node->records[i + 1];
-    }
-    node->numKeys--;
+/* ============== BATCH MODE ============== */
+/* --batch reads newline-delimited commands from stdin or a file and answers them in a
+   machine-readable format instead of menus and prompts. Fields are comma-separated as
+   in the transaction file:
+     add,ID,BUYER,SELLER,ENERGY,YYYY-MM-DD HH:MM:SS   delete,ID   get,ID
+     seller,ID   buyer,ID   time,START,END   energy,MIN,MAX   all
+     revenue[,SELLER]   top-buyers,K   rank,BUYER   top-pairs,N
+     rates,SELLER,BELOW300,ABOVE300   sync
+   Queries first write their result set in the --format encoding (csv by default). Every
+   command then ends with exactly one status line: "ok[,...]" or "error,CODE[,DETAIL]",
+   or a JSON object with a "status" member under --format=jsonl. Under --format=binary
+   it is a BatchStatusRecord, so every result set header stays 8-byte aligned. Blank
+   lines and lines starting with '#' get no answer.
+   Input is taken one read() at a time. Under --sync=record the log is synced once per
+   read rather than once per record, and the answers for that read are written only
+   after the sync, so nothing is acknowledged before it is durable. */
+#define BATCH_READ_BYTES (1 << 20)
+
+typedef struct {
+    long long commands;
+    long long errors;
+} BatchStats;
+
+#define STATUS_MAGIC "ETST"
+
+// Index of a status in a BatchStatusRecord; 0 is ok and the rest are error codes
+static const char* const batchStatusCodes[] = { "ok", "bad-arguments", "unknown-command", "duplicate-id",
+                                                "not-found", "unknown-seller", "log-failed" };
+
+typedef struct {
+    char magic[4];       // STATUS_MAGIC, where a result set would have RESULT_MAGIC
+    uint16_t status;     // index into batchStatusCodes
+    uint16_t reserved;
+    int64_t value;       // the count or ID an ok reports, the ID an error names, else -1
+    double pricePerKwh;  // set by add
+    double totalPrice;
+} BatchStatusRecord;
+
+_Static_assert(sizeof(BatchStatusRecord) == 32, "batch status record layout changed");
+
+void batchStatusRecord(OutputBuffer* out, const char* code, long long value, double pricePerKwh, double totalPrice) {
+    BatchStatusRecord record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.magic, STATUS_MAGIC, sizeof(record.magic));
+    for (int i = 0; i < (int)(sizeof(batchStatusCodes) / sizeof(batchStatusCodes[0])); i++) {
+        if (strcmp(code, batchStatusCodes[i]) == 0) record.status = (uint16_t)i;
+    }
+    record.value = value;
+    record.pricePerKwh = pricePerKwh;
+    record.totalPrice = totalPrice;
+    outputWrite(out, &record, sizeof(record));
 }
 
-void removeFromNonLeaf(BPTreeNode** root, BPTreeNode* node, int idx) {
-    int key = node->keys[idx];
-    if (node->children[idx]->numKeys >= ORDER/2) {
-        BPTreeNode* cursor = node->children[idx];
-        while (!cursor->isLeaf)
-            cursor = cursor->children[cursor->numKeys];
-        int predKey = cursor->keys[cursor->numKeys - 1];
-        node->keys[idx] = predKey;
-        deleteTransactionFromBPTree(&node->children[idx], predKey);
-    }
-    else if (node->children[idx + 1]->numKeys >= ORDER/2) {
-        BPTreeNode* cursor = node->children[idx + 1];
-        while (!cursor->isLeaf)
-            cursor = cursor->children[0];
-        int succKey = cursor->keys[0];
-        node->keys[idx] = succKey;
-        deleteTransactionFromBPTree(&node->children[idx + 1], succKey);
+void batchOk(OutputBuffer* out) {
+    if (outputFormat == OUTPUT_BINARY) {
+        batchStatusRecord(out, "ok", -1, 0.0, 0.0);
+        return;
     }
-    else {
-        mergeNodes(root, node, idx);
-        deleteTransactionFromBPTree(&node->children[idx], key);
+    outputPrintf(out, outputFormat == OUTPUT_JSONL ? "{\"status\":\"ok\"}\n" : "ok\n");
+}
+
+void batchOkCount(OutputBuffer* out, long long count) {
+    if (outputFormat == OUTPUT_BINARY) {
+        batchStatusRecord(out, "ok", count, 0.0, 0.0);
+        return;
     }
+    outputPrintf(out, outputFormat == OUTPUT_JSONL ? "{\"status\":\"ok\",\"count\":%lld}\n" : "ok,%lld\n", count);
 }
 
-void borrowFromNext(BPTreeNode* node, int idx) {
-    BPTreeNode* child = node->children[idx];
-    BPTreeNode* sibling = node->children[idx + 1];
-    child->keys[child->numKeys] = node->keys[idx];
-    if (!child->isLeaf)
-        child->children[child->numKeys + 1] = sibling->children[0];
-    else
-        child->records[child->numKeys] = sibling->records[0];
-    node->keys[idx] = sibling->keys[0];
-    for (int i = 0; i < sibling->numKeys - 1; i++) {
-        sibling->keys[i] = sibling->keys[i + 1];
-        if (!sibling->isLeaf)
-            sibling->children[i] = sibling->children[i + 1];
-        else
-            sibling->records[i] = sibling->records[i + 1];
+void batchOkId(OutputBuffer* out, int id) {
+    if (outputFormat == OUTPUT_BINARY) {
+        batchStatusRecord(out, "ok", id, 0.0, 0.0);
+        return;
     }
-    if (!sibling->isLeaf)
-        sibling->children[sibling->numKeys - 1] = sibling->children[sibling->numKeys];
-    child->numKeys++;
-    sibling->numKeys--;
+    outputPrintf(out, outputFormat == OUTPUT_JSONL ? "{\"status\":\"ok\",\"id\":%d}\n" : "ok,%d\n", id);
 }
 
-void borrowFromPrev(BPTreeNode* node, int idx) {
-    BPTreeNode* child = node->children[idx];
-    BPTreeNode* sibling = node->children[idx - 1];
-    for (int i = child->numKeys - 1; i >= 0; i--) {
-        child->keys[i + 1] = child->keys[i];
-        if (!child->isLeaf)
-            child->children[i + 2] = child->children[i + 1];
-        else
-            child->records[i + 1] = child->records[i];
+void batchOkAdded(OutputBuffer* out, const Transaction* t) {
+    if (outputFormat == OUTPUT_BINARY) {
+        batchStatusRecord(out, "ok", t->transactionID, t->pricePerKwh, t->totalPrice);
+        return;
     }
-    if (!child->isLeaf)
-        child->children[1] = child->children[0];
-    child->keys[0] = node->keys[idx - 1];
-    if (!child->isLeaf)
-        child->children[0] = sibling->children[sibling->numKeys];
-    else
-        child->records[0] = sibling->records[sibling->numKeys - 1];
-    node->keys[idx - 1] = sibling->keys[sibling->numKeys - 1];
-    child->numKeys++;
-    sibling->numKeys--;
+    outputPrintf(out, outputFormat == OUTPUT_JSONL ? "{\"status\":\"ok\",\"id\":%d,\"price\":%.2f,\"total\":%.2f}\n"
+                                                   : "ok,%d,%.2f,%.2f\n",
+                 t->transactionID, t->pricePerKwh, t->totalPrice);
 }
 
-void mergeNodes(BPTreeNode** root, BPTreeNode* node, int idx) {
-    BPTreeNode* leftChild = node->children[idx];
-    BPTreeNode* rightChild = node->children[idx + 1];
-    leftChild->keys[leftChild->numKeys] = node->keys[idx];
-    for (int i = 0; i < rightChild->numKeys; i++) {
-        leftChild->keys[leftChild->numKeys + 1 + i] = rightChild->keys[i];
-        if (!leftChild->isLeaf)
-            leftChild->children[leftChild->numKeys + 1 + i] = rightChild->children[i];
-        else
-            leftChild->records[leftChild->numKeys + 1 + i] = rightChild->records[i];
+// detail may be echoed input, so JSON output escapes it; binary output has no room for it
+void batchError(OutputBuffer* out, BatchStats* stats, const char* code, const char* detail, int detailLength) {
+    stats->errors++;
+    if (outputFormat == OUTPUT_BINARY) {
+        batchStatusRecord(out, code, -1, 0.0, 0.0);
+        return;
     }
-    if (!leftChild->isLeaf)
-        leftChild->children[leftChild->numKeys + 1 + rightChild->numKeys] = rightChild->children[rightChild->numKeys];
-    if (leftChild->isLeaf)
-        leftChild->next = rightChild->next;
-    leftChild->numKeys += 1 + rightChild->numKeys;
-    for (int i = idx; i < node->numKeys - 1; i++) {
-        node->keys[i] = node->keys[i + 1];
-        node->children[i + 1] = node->children[i + 2];
+    if (outputFormat != OUTPUT_JSONL) {
+        outputPrintf(out, detailLength > 0 ? "error,%s,%.*s\n" : "error,%s\n", code, detailLength, detail);
+        return;
     }
-    node->numKeys--;
-    free(rightChild);
-    if (node->numKeys == 0 && *root == node) {
-        *root = leftChild;
-        free(node);
+    outputPrintf(out, "{\"status\":\"error\",\"code\":\"%s\",\"detail\":\"", code);
+    for (int i = 0; i < detailLength; i++) {
+        unsigned char c = (unsigned char)detail[i];
+        if (c == '"' || c == '\\')
+            outputPrintf(out, "\\%c", c);
+        else if (c < 0x20)
+            outputPrintf(out, "\\u%04x", c);
+        else
+            outputWrite(out, &detail[i], 1);
     }
+    outputWrite(out, "\"}\n", 3);
 }
 
-void deleteTransactionFromBPTree(BPTreeNode** root, int transactionID) {
-    if (!*root) {
-        printf("Tree is empty. Nothing to delete.\n");
+void batchErrorId(OutputBuffer* out, BatchStats* stats, const char* code, int id) {
+    if (outputFormat == OUTPUT_BINARY) {
+        stats->errors++;
+        batchStatusRecord(out, code, id, 0.0, 0.0);
         return;
     }
-    BPTreeNode* cursor = *root;
-    BPTreeNode* parent = NULL;
-    int idx = 0;
-    while (!cursor->isLeaf) {
-        parent = cursor;
-        for (idx = 0; idx < cursor->numKeys; idx++) {
-            if (transactionID < cursor->keys[idx])
-                break;
+    char detail[20];
+    batchError(out, stats, code, detail, snprintf(detail, sizeof(detail), "%d", id));
+}
+
+void batchChangeResult(OutputBuffer* out, BatchStats* stats, ChangeStatus status, int id) {
+    static const char* const codes[] = { "ok", "duplicate-id", "not-found", "unknown-seller", "log-failed" };
+    if (status != CHANGE_APPLIED) batchErrorId(out, stats, codes[status], id);
+}
+
+// Matches the command word at *cursor and moves past its separator
+static inline int batchCommandIs(const char** cursor, const char* end, const char* word) {
+    size_t length = strlen(word);
+    if ((size_t)(end - *cursor) <= length || memcmp(*cursor, word, length) != 0 || (*cursor)[length] != ',')
+        return 0;
+    *cursor += length + 1;
+    return 1;
+}
+
+// Parses a "YYYY-MM-DD HH:MM:SS" field ending at ',', rejecting impossible dates
+static inline int parseBatchTimestamp(const char** cursor, const char* end, long long* epoch) {
+    const char* p = *cursor;
+    const char* comma = (const char*)memchr(p, ',', (size_t)(end - p));
+    if (!comma || comma - p != 19) return 0;
+    char text[20];
+    memcpy(text, p, 19);
+    text[19] = '\0';
+    if (!isValidDateTimeFormat(text) || !parseTimestampField(p, comma, epoch)) return 0;
+    *cursor = comma + 1;
+    return 1;
+}
+
+// Writes all of data to fd; returns 0 on success
+int writeFully(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
-        cursor = cursor->children[idx];
+        data += written;
+        size -= (size_t)written;
     }
-    int keyIdx = -1;
-    for (int i = 0; i < cursor->numKeys; i++) {
-        if (cursor->keys[i] == transactionID) {
-            keyIdx = i;
-            break;
+    return 0;
+}
+
+/* Listings that would take a while (seller, buyer, time, energy and all) run on a
+   report thread against a snapshot pinned when the command is read, so the changes
+   after them go ahead while they are written. Answers still come out in command
+   order: each one waits in a queue behind any report ahead of it that has not
+   finished. Short listings are answered inline. */
+#define BATCH_REPORT_MIN_ROWS SCAN_PARTITION_ROWS
+#define BATCH_MAX_REPORTS 4  // reports in flight before the reader waits for one
+
+typedef struct BatchAnswer {
+    OutputBuffer out;
+    int isReport;
+    int done;                  // report finished; read and set under BatchAnswers.lock
+    StoreSnapshot* snapshot;   // pinned until the report is done
+    BPTreeNode* root;          // what the report lists, from the snapshot
+    BPKey low, high;
+    double bounds[2];
+    int hasBounds;
+    long long count;           // -1 when unknown
+    struct BatchAnswer* next;        // answer order
+    struct BatchAnswer* nextReport;  // report queue
+} BatchAnswer;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;    // a report was queued, or the reporter should stop
+    pthread_cond_t finished;  // a report finished
+    pthread_t reporter;
+    int reporterRunning;
+    int stopping;
+    BatchAnswer* head;        // oldest answer not yet written
+    BatchAnswer* tail;
+    BatchAnswer* reportHead;  // reports not yet started
+    BatchAnswer* reportTail;
+    int reportsInFlight;      // queued, running, or done but still pinned
+} BatchAnswers;
+
+void initBatchAnswers(BatchAnswers* answers) {
+    memset(answers, 0, sizeof(*answers));
+    pthread_mutex_init(&answers->lock, NULL);
+    pthread_cond_init(&answers->queued, NULL);
+    pthread_cond_init(&answers->finished, NULL);
+}
+
+BatchAnswer* appendBatchAnswer(BatchAnswers* answers, int isReport) {
+    BatchAnswer* answer = (BatchAnswer*)calloc(1, sizeof(BatchAnswer));
+    if (!answer) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    initOutputBuffer(&answer->out, NULL);
+    answer->isReport = isReport;
+    if (answers->tail)
+        answers->tail->next = answer;
+    else
+        answers->head = answer;
+    answers->tail = answer;
+    return answer;
+}
+
+// Where the next inline answer goes: behind every report queued so far
+OutputBuffer* batchOutput(BatchAnswers* answers) {
+    if (!answers->tail || answers->tail->isReport) appendBatchAnswer(answers, 0);
+    return &answers->tail->out;
+}
+
+void* batchReporter(void* arg) {
+    BatchAnswers* answers = (BatchAnswers*)arg;
+    pthread_mutex_lock(&answers->lock);
+    for (;;) {
+        while (!answers->stopping && !answers->reportHead) {
+            pthread_cond_wait(&answers->queued, &answers->lock);
+        }
+        BatchAnswer* report = answers->reportHead;
+        if (!report) break;
+        answers->reportHead = report->nextReport;
+        if (!answers->reportHead) answers->reportTail = NULL;
+        pthread_mutex_unlock(&answers->lock);
+        batchOkCount(&report->out, writeTransactionScan(report->root, report->low, report->high,
+                                                        report->hasBounds ? report->bounds : NULL,
+                                                        report->count, &report->out));
+        pthread_mutex_lock(&answers->lock);
+        report->done = 1;
+        pthread_cond_signal(&answers->finished);
+    }
+    pthread_mutex_unlock(&answers->lock);
+    return NULL;
+}
+
+// Unpins the snapshots of finished reports
+void collectBatchReports(BatchAnswers* answers) {
+    pthread_mutex_lock(&answers->lock);
+    for (BatchAnswer* answer = answers->head; answer; answer = answer->next) {
+        if (answer->isReport && answer->done && answer->snapshot) {
+            unpinSnapshot(answer->snapshot);
+            answer->snapshot = NULL;
+            answers->reportsInFlight--;
         }
     }
-    if (keyIdx == -1) {
-        printf("Transaction with ID %d not found in the tree.\n", transactionID);
-        return;
+    pthread_mutex_unlock(&answers->lock);
+}
+
+// Waits until the report has finished
+void waitForBatchReport(BatchAnswers* answers, BatchAnswer* report) {
+    pthread_mutex_lock(&answers->lock);
+    while (!report->done) {
+        pthread_cond_wait(&answers->finished, &answers->lock);
     }
-    free(cursor->records[keyIdx]);
-    removeFromLeaf(cursor, keyIdx);
-    if (cursor->numKeys == 0 && cursor == *root) {
-        free(cursor);
-        *root = NULL;
+    pthread_mutex_unlock(&answers->lock);
+}
+
+/* Answers a listing of keys [low, high] of root with its result set and status line.
+   Large ones are handed to the report thread along with a snapshot pinned now;
+   root must be reachable from that snapshot. count is -1 when unknown. */
+void batchListing(BatchAnswers* answers, BPTreeNode* root, BPKey low, BPKey high, const double* energyBounds,
+                  long long count) {
+    double expected = count >= 0 ? (double)count : estimateScanRows(root, low, high);
+    if (expected < BATCH_REPORT_MIN_ROWS) {
+        OutputBuffer* out = batchOutput(answers);
+        batchOkCount(out, writeTransactionScan(root, low, high, energyBounds, count, out));
         return;
     }
-    if (cursor->numKeys >= (ORDER - 1) / 2 || cursor == *root)
-        return;
-    int parentIdx = 0;
-    while (parentIdx <= parent->numKeys && parent->children[parentIdx] != cursor)
-        parentIdx++;
-    if (parentIdx < parent->numKeys && parent->children[parentIdx + 1]->numKeys > (ORDER - 1) / 2) {
-        borrowFromNext(parent, parentIdx);
-    }
-    else if (parentIdx > 0 && parent->children[parentIdx - 1]->numKeys > (ORDER - 1) / 2) {
-        borrowFromPrev(parent, parentIdx);
-    }
-    else {
-        if (parentIdx < parent->numKeys)
-            mergeNodes(root, parent, parentIdx);
-        else
-            mergeNodes(root, parent, parentIdx - 1);
+    collectBatchReports(answers);
+    // Each pinned report keeps its old nodes alive, so only so many may be pending
+    for (BatchAnswer* oldest = answers->head; answers->reportsInFlight >= BATCH_MAX_REPORTS; oldest = oldest->next) {
+        if (oldest->isReport && oldest->snapshot) {
+            waitForBatchReport(answers, oldest);
+            collectBatchReports(answers);
+        }
     }
+    if (!answers->reporterRunning) {
+        if (pthread_create(&answers->reporter, NULL, batchReporter, answers) != 0) {
+            printf("Error starting the report thread.\n");
+            exit(1);
+        }
+        answers->reporterRunning = 1;
+    }
+    BatchAnswer* report = appendBatchAnswer(answers, 1);
+    report->snapshot = pinSnapshot();
+    report->root = root;
+    report->low = low;
+    report->high = high;
+    report->hasBounds = energyBounds != NULL;
+    if (energyBounds) {
+        report->bounds[0] = energyBounds[0];
+        report->bounds[1] = energyBounds[1];
+    }
+    report->count = count;
+    pthread_mutex_lock(&answers->lock);
+    if (answers->reportTail)
+        answers->reportTail->nextReport = report;
+    else
+        answers->reportHead = report;
+    answers->reportTail = report;
+    answers->reportsInFlight++;
+    pthread_cond_signal(&answers->queued);
+    pthread_mutex_unlock(&answers->lock);
 }
 
-void deleteTransactionFile(int transactionID) {
-    FILE *originalFile = fopen(TRANSACTION_FILE, "r");
-    if (!originalFile) {
-        printf("Error opening transaction file for reading.\n");
-        return;
-    }
-    FILE *tempFile = fopen("temp_transactions.txt", "w");
-    if (!tempFile) {
-        printf("Error creating temporary file.\n");
-        fclose(originalFile);
-        return;
+/* Writes the answers that are ready to fd, stopping at the first unfinished report
+   unless wait is set. Returns 0 on success. */
+int writeBatchAnswers(BatchAnswers* answers, int fd, int wait) {
+    collectBatchReports(answers);
+    while (answers->head) {
+        BatchAnswer* answer = answers->head;
+        if (answer->isReport && answer->snapshot) {
+            if (!wait) break;
+            waitForBatchReport(answers, answer);
+            collectBatchReports(answers);
+        }
+        if (writeFully(fd, answer->out.data, answer->out.used) != 0) return -1;
+        answer->out.used = 0;
+        // The last inline answer stays to take the next ones
+        if (answer == answers->tail && !answer->isReport) break;
+        answers->head = answer->next;
+        if (!answers->head) answers->tail = NULL;
+        freeOutputBuffer(&answer->out);
+        free(answer);
     }
-    char line[256];
-    while (fgets(line, sizeof(line), originalFile)) {
-        int currentID;
-        if (sscanf(line, "%d,", &currentID) == 1) {
-            if (currentID != transactionID) {
-                fputs(line, tempFile);
+    return 0;
+}
+
+// Lets the reporter finish what is queued, then drops every unwritten answer
+void freeBatchAnswers(BatchAnswers* answers) {
+    if (answers->reporterRunning) {
+        pthread_mutex_lock(&answers->lock);
+        answers->stopping = 1;
+        pthread_cond_signal(&answers->queued);
+        pthread_mutex_unlock(&answers->lock);
+        pthread_join(answers->reporter, NULL);
+        answers->reporterRunning = 0;
+    }
+    collectBatchReports(answers);
+    while (answers->head) {
+        BatchAnswer* answer = answers->head;
+        answers->head = answer->next;
+        freeOutputBuffer(&answer->out);
+        free(answer);
+    }
+    answers->tail = NULL;
+    pthread_mutex_destroy(&answers->lock);
+    pthread_cond_destroy(&answers->queued);
+    pthread_cond_destroy(&answers->finished);
+}
+
+/* Runs one command. The line runs from p to end, and its newline has been replaced by
+   a ',' so every field, including the last, ends at a separator. */
+void runBatchCommand(BatchAnswers* answers, BatchStats* stats, const char* p, const char* end) {
+    OutputBuffer* out = batchOutput(answers);
+    const char* command = p;
+    int id, other;
+    double low, high;
+    long long startEpoch, endEpoch;
+    ResultWriter writer;
+    stats->commands++;
+    if (batchCommandIs(&p, end, "add")) {
+        int buyerID, sellerID;
+        if (!parseIntField(&p, end, ',', &id) || !parseIntField(&p, end, ',', &buyerID) ||
+            !parseIntField(&p, end, ',', &sellerID) || !parseDecimalField(&p, end, &low) ||
+            !parseBatchTimestamp(&p, end, &startEpoch) || p != end || id < 0)
+            goto badArguments;
+        Transaction* t = createTransaction(id, buyerID, sellerID, low, 0.0, startEpoch);
+        ChangeStatus status = applyInsert(t);
+        if (status == CHANGE_APPLIED) batchOkAdded(out, t);
+        batchChangeResult(out, stats, status, status == CHANGE_UNKNOWN_SELLER ? sellerID : id);
+    } else if (batchCommandIs(&p, end, "delete")) {
+        if (!parseIntField(&p, end, ',', &id) || p != end) goto badArguments;
+        ChangeStatus status = applyDelete(id);
+        if (status == CHANGE_APPLIED) batchOkId(out, id);
+        batchChangeResult(out, stats, status, id);
+    } else if (batchCommandIs(&p, end, "get")) {
+        if (!parseIntField(&p, end, ',', &id) || p != end) goto badArguments;
+        Transaction* t = findTransactionById(globalTransactionTree, id);
+        if (!t) goto notFound;
+        beginResult(&writer, RESULT_TRANSACTIONS, 1, out);
+        resultTransaction(&writer, t);
+        batchOkCount(out, endResult(&writer));
+    } else if (batchCommandIs(&p, end, "seller")) {
+        if (!parseIntField(&p, end, ',', &id) || p != end) goto badArguments;
+        Seller* seller = findSeller(id);
+        if (!seller) goto notFound;
+        batchListing(answers, seller->transactionTree, LLONG_MIN, LLONG_MAX, NULL, seller->numTransactions);
+    } else if (batchCommandIs(&p, end, "buyer")) {
+        if (!parseIntField(&p, end, ',', &id) || p != end) goto badArguments;
+        if (shardCount > 0) {
+            long long rows = writeShardedBuyerTrades(id, out);
+            if (rows < 0) goto notFound;
+            batchOkCount(out, rows);
+            return;
+        }
+        Buyer* buyer = findBuyer(id);
+        if (!buyer) goto notFound;
+        batchListing(answers, buyer->transactionTree, LLONG_MIN, LLONG_MAX, NULL, buyer->numTransactions);
+    } else if (batchCommandIs(&p, end, "all")) {
+        if (p != end) goto badArguments;
+        batchListing(answers, globalTransactionTree, LLONG_MIN, LLONG_MAX, NULL, storeTotals.transactions);
+    } else if (batchCommandIs(&p, end, "time")) {
+        if (!parseBatchTimestamp(&p, end, &startEpoch) || !parseBatchTimestamp(&p, end, &endEpoch) || p != end)
+            goto badArguments;
+        batchListing(answers, timeIndexTree, timeIndexKey(startEpoch, 0),
+                     timeIndexKey(endEpoch, (int)(TIME_KEY_ID_SPAN - 1)), NULL, -1);
+    } else if (batchCommandIs(&p, end, "energy")) {
+        if (!parseDecimalField(&p, end, &low) || !parseDecimalField(&p, end, &high) || p != end)
+            goto badArguments;
+        // Same widened seek as findTransactionsByEnergyRange, with the exact check per record
+        double bounds[2] = { low, high };
+        batchListing(answers, energyIndexTree, energyIndexKey(energyToCents(low) - 1, 0),
+                     energyIndexKey(energyToCents(high) + 1, (int)(TIME_KEY_ID_SPAN - 1)), bounds, -1);
+    } else if (batchCommandIs(&p, end, "revenue")) {
+        if (p == end && shardCount > 0) {
+            batchOkCount(out, writeShardedRevenue(out));
+            return;
+        }
+        if (p == end) {
+            // Seller ID order, as the sharded store answers it
+            Seller* ordered = sellersById(sellers, sellerCount);
+            beginResult(&writer, RESULT_SELLER_REVENUE, sellerCount, out);
+            for (int i = 0; i < sellerCount; i++) {
+                resultSellerRevenue(&writer, &ordered[i]);
             }
+            free(ordered);
+        } else {
+            if (!parseIntField(&p, end, ',', &id) || p != end) goto badArguments;
+            Seller* seller = findSeller(id);
+            if (!seller) goto notFound;
+            beginResult(&writer, RESULT_SELLER_REVENUE, 1, out);
+            resultSellerRevenue(&writer, seller);
+        }
+        batchOkCount(out, endResult(&writer));
+    } else if (batchCommandIs(&p, end, "top-buyers")) {
+        if (!parseIntField(&p, end, ',', &other) || p != end) goto badArguments;
+        int shown = (other > 0 && other < buyerCount) ? other : buyerCount;
+        beginResult(&writer, RESULT_BUYER_RANKS, shown, out);
+        for (int position = 0; position < shown; position++) {
+            resultBuyerRank(&writer, position + 1, &buyers[leaderboardAt(position)]);
+        }
+        batchOkCount(out, endResult(&writer));
+    } else if (batchCommandIs(&p, end, "rank")) {
+        if (!parseIntField(&p, end, ',', &id) || p != end) goto badArguments;
+        Buyer* buyer = findBuyer(id);
+        if (!buyer) goto notFound;
+        beginResult(&writer, RESULT_BUYER_RANKS, 1, out);
+        resultBuyerRank(&writer, leaderboardRank((int)(buyer - buyers)), buyer);
+        batchOkCount(out, endResult(&writer));
+    } else if (batchCommandIs(&p, end, "top-pairs")) {
+        if (!parseIntField(&p, end, ',', &other) || p != end) goto badArguments;
+        if (shardCount > 0) {
+            batchOkCount(out, writeShardedTopPairs(other, out));
+            return;
+        }
+        int pairCount, shown, totalTransactions;
+        SellerBuyerPair* pairs = sortedLivePairs(&pairCounter, other, &pairCount, &shown, &totalTransactions);
+        if (!pairs) {
+            printf("Memory allocation failed.\n");
+            exit(1);
+        }
+        beginResult(&writer, RESULT_PAIRS, shown, out);
+        for (int i = 0; i < shown; i++) {
+            resultPair(&writer, &pairs[i]);
+        }
+        free(pairs);
+        batchOkCount(out, endResult(&writer));
+    } else if (batchCommandIs(&p, end, "window")) {
+        int isBuyer = batchCommandIs(&p, end, "buyer");
+        if ((!isBuyer && !batchCommandIs(&p, end, "seller")) || !parseIntField(&p, end, ',', &id) ||
+            !parseBatchTimestamp(&p, end, &startEpoch) || !parseBatchTimestamp(&p, end, &endEpoch) ||
+            p != end || startEpoch > endEpoch)
+            goto badArguments;
+        if (isBuyer ? !findBuyer(id) : !findSeller(id)) goto notFound;
+        RollupWindow window;
+        sumRollupWindow(&window, isBuyer, id, startEpoch, endEpoch);
+        beginResult(&writer, RESULT_WINDOW, 1, out);
+        resultWindow(&writer, &window);
+        batchOkCount(out, endResult(&writer));
+    } else if (batchCommandIs(&p, end, "rates")) {
+        if (!parseIntField(&p, end, ',', &id) || !parseDecimalField(&p, end, &low) ||
+            !parseDecimalField(&p, end, &high) || p != end)
+            goto badArguments;
+        if (appendSellerRatesRecord(&transactionLog, id, low, high) != 0) {
+            batchChangeResult(out, stats, CHANGE_LOG_FAILED, id);
+            return;
+        }
+        // New rates apply to later transactions; logged prices keep existing ones intact
+        Seller* seller = findSeller(id);
+        if (seller) {
+            seller->rateBelow300 = low;
+            seller->rateAbove300 = high;
         } else {
-            fputs(line, tempFile);
+            addSeller(id, low, high);
+        }
+        noteWalRecord();
+        batchOkId(out, id);
+    } else if (batchCommandIs(&p, end, "sync")) {
+        if (p != end) goto badArguments;
+        if (appendLogSync(&transactionLog) != 0) {
+            batchError(out, stats, "log-failed", NULL, 0);
+            return;
+        }
+        batchOk(out);
+    } else {
+        const char* comma = (const char*)memchr(command, ',', (size_t)(end - command));
+        batchError(out, stats, "unknown-command", command, (int)(comma - command < 32 ? comma - command : 32));
+    }
+    return;
+
+badArguments:
+    batchError(out, stats, "bad-arguments", command,
+               (int)((const char*)memchr(command, ',', (size_t)(end - command)) - command));
+    return;
+notFound:
+    batchErrorId(out, stats, "not-found", id);
+}
+
+/* Runs every command read from inFd and writes the answers to outFd. Returns 0 at end
+   of input, -1 if the input could not be read or the answers could not be written. */
+int runBatch(int inFd, int outFd) {
+    size_t capacity = BATCH_READ_BYTES, have = 0;
+    char* input = (char*)malloc(capacity);
+    BatchAnswers answers;
+    initBatchAnswers(&answers);
+    if (!input) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    BatchStats stats = { 0, 0 };
+    int status = 0, done = 0;
+    double start = currentTimeSeconds();
+    while (!done) {
+        // A line longer than the buffer grows it; so does a final line missing its newline
+        if (have == capacity) {
+            capacity *= 2;
+            input = (char*)realloc(input, capacity);
+            if (!input) {
+                printf("Memory allocation failed.\n");
+                exit(1);
+            }
+        }
+        ssize_t bytesRead = read(inFd, input + have, capacity - have);
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            printf("Error reading batch input: %s\n", strerror(errno));
+            status = -1;
+            break;
+        }
+        if (bytesRead == 0) {
+            done = 1;
+            if (have == 0) break;
+            if (input[have - 1] != '\n') input[have++] = '\n';
+        }
+        have += (size_t)bytesRead;
+
+        char* line = input;
+        char* limit = input + have;
+        char* newline;
+        while ((newline = (char*)memchr(line, '\n', (size_t)(limit - line)))) {
+            char* end = (newline > line && newline[-1] == '\r') ? newline - 1 : newline;
+            if (end > line && *line != '#') {
+                *end = ',';
+                runBatchCommand(&answers, &stats, line, end + 1);
+                // Finished reports are unpinned promptly so their old nodes can be reclaimed
+                if (answers.reportsInFlight && (stats.commands & 255) == 0) collectBatchReports(&answers);
+            }
+            line = newline + 1;
+        }
+        have = (size_t)(limit - line);
+        memmove(input, line, have);
+
+        // Group commit: everything this read changed becomes durable before it is answered
+        if (transactionLog.deferSyncs && appendLogSync(&transactionLog) != 0) {
+            status = -1;
+            break;
         }
+        if (writeBatchAnswers(&answers, outFd, 0) != 0) {
+            printf("Error writing batch output: %s\n", strerror(errno));
+            status = -1;
+            break;
+        }
+        pollCheckpoint(0);
+    }
+    // Reports still running at the end of the input are waited for
+    if (status == 0 && writeBatchAnswers(&answers, outFd, 1) != 0) {
+        printf("Error writing batch output: %s\n", strerror(errno));
+        status = -1;
+    }
+    double elapsed = currentTimeSeconds() - start;
+    printf("Batch: %lld commands, %lld errors in %.3f s (%.0f commands/s)\n", stats.commands, stats.errors,
+           elapsed, elapsed > 0 ? stats.commands / elapsed : 0.0);
+    free(input);
+    freeBatchAnswers(&answers);
+    return status;
+}
+
+/* Parses "prompt", "reject" or "rates:BELOW300,ABOVE300" as given to --unknown-seller;
+   returns 0 on bad input. */
+int parseUnknownSellerPolicy(const char* text) {
+    double below, above;
+    char extra;
+    if (strcmp(text, "prompt") == 0) {
+        unknownSellerPolicy = UNKNOWN_SELLER_PROMPT;
+        return 1;
+    }
+    if (strcmp(text, "reject") == 0) {
+        unknownSellerPolicy = UNKNOWN_SELLER_REJECT;
+        return 1;
+    }
+    if (sscanf(text, "rates:%lf,%lf%c", &below, &above, &extra) == 2) {
+        unknownSellerPolicy = UNKNOWN_SELLER_DEFAULT;
+        defaultRateBelow300 = below;
+        defaultRateAbove300 = above;
+        return 1;
     }
-    fclose(originalFile);
-    fclose(tempFile);
-    remove(TRANSACTION_FILE);
-    rename("temp_transactions.txt", TRANSACTION_FILE);
+    return 0;
 }
 
 void displayMenu() {
@@ -1736,17 +7678,154 @@ void displayMenu() {
     printf("11. Delete a transaction\n"); 
     printf("12. Debug\n");
     printf("13. Exit\n");
-    printf("Enter your choice (1-13): ");
+    printf("14. Revenue and energy in a time window\n");
+    printf("Enter your choice (1-14): ");
 }
 
-int main() {
+void printUsage(const char* program) {
+    printf("Usage: %s [--sync=record|every:N|interval:MS] [--checkpoint-every=N] [--load-threads=N]\n"
+           "       %*s [--checkpoint-on-exit] [--unknown-seller=prompt|reject|rates:B,A] [--batch[=FILE]]\n"
+           "       %*s [--format=table|csv|jsonl|binary] [--scan-threads=N] [--ingest=FILE] [--shards=N]\n"
+           "       %s --benchmark-load=N\n", program, (int)strlen(program), "", (int)strlen(program), "", program);
+    printf("  --sync=record         fdatasync each transaction before confirming it (default)\n");
+    printf("  --sync=every:N        fdatasync once N transactions are pending\n");
+    printf("  --sync=interval:MS    fdatasync pending transactions every MS milliseconds\n");
+    printf("  --checkpoint-every=N  checkpoint after N WAL records (default %d, 0 for never)\n",
+           CHECKPOINT_EVERY_RECORDS);
+    printf("  --load-threads=N      parser threads for importing text files (default: one per CPU)\n");
+    printf("  --scan-threads=N      threads for large range scans and listings (default: one per CPU)\n");
+    printf("  --checkpoint-on-exit  checkpoint when the program exits\n");
+    printf("  --unknown-seller=P    for a new seller ID: prompt for its rates (default), reject the\n"
+           "                        transaction, or register it at rates:BELOW300,ABOVE300\n");
+    printf("  --batch[=FILE]        run the commands in FILE (default stdin) without menus, answering\n"
+           "                        on stdout; unknown sellers are rejected unless given rates\n");
+    printf("  --format=F            write query results as table (the menu's default), csv (batch\n"
+           "                        default), jsonl, or binary fixed-width records\n");
+    printf("  --ingest=FILE         add the trades in FILE (transactions.txt layout) through the ingest\n"
+           "                        queue, then exit; unknown sellers are rejected unless given rates\n");
+    printf("  --shards=N            split the store across N shards by seller for --batch or --ingest,\n"
+           "                        each with its own worker thread (1 to %d)\n", MAX_SHARDS);
+    printf("  --benchmark-load=N    time loading a generated N-row file, then exit\n");
+}
 
-    loadSellerPrices();
-    loadDataFromFile();
+int main(int argc, char* argv[]) {
+    selectNodeSearchKernel();
+    SyncPolicy syncPolicy = SYNC_PER_RECORD;
+    int syncEveryRecords = 1, syncIntervalMs = 100;
+    int benchmarkRows = 0;
+    int checkpointOnExit = 0;
+    int batchMode = 0;
+    int formatGiven = 0;
+    const char* batchPath = NULL;
+    const char* ingestPath = NULL;
+    int shardsWanted = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--sync=", 7) == 0 &&
+            parseSyncPolicy(argv[i] + 7, &syncPolicy, &syncEveryRecords, &syncIntervalMs)) {
+            continue;
+        }
+        if (strcmp(argv[i], "--checkpoint-on-exit") == 0) {
+            checkpointOnExit = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--unknown-seller=", 17) == 0 && parseUnknownSellerPolicy(argv[i] + 17)) {
+            continue;
+        }
+        if (strncmp(argv[i], "--format=", 9) == 0 && parseOutputFormat(argv[i] + 9, &outputFormat)) {
+            formatGiven = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--batch") == 0 || (strncmp(argv[i], "--batch=", 8) == 0 && argv[i][8])) {
+            batchMode = 1;
+            batchPath = argv[i][7] ? argv[i] + 8 : NULL;
+            continue;
+        }
+        if (strncmp(argv[i], "--ingest=", 9) == 0 && argv[i][9]) {
+            ingestPath = argv[i] + 9;
+            continue;
+        }
+        char extra;
+        if (sscanf(argv[i], "--checkpoint-every=%lld%c", &checkpointer.checkpointEvery, &extra) == 1 &&
+            checkpointer.checkpointEvery >= 0) {
+            continue;
+        }
+        if (sscanf(argv[i], "--load-threads=%d%c", &loaderThreads, &extra) == 1 && loaderThreads > 0) {
+            continue;
+        }
+        if (sscanf(argv[i], "--scan-threads=%d%c", &scanThreads, &extra) == 1 && scanThreads > 0) {
+            continue;
+        }
+        if (sscanf(argv[i], "--benchmark-load=%d%c", &benchmarkRows, &extra) == 1 && benchmarkRows > 0) {
+            continue;
+        }
+        if (sscanf(argv[i], "--shards=%d%c", &shardsWanted, &extra) == 1 && shardsWanted > 0 &&
+            shardsWanted <= MAX_SHARDS) {
+            continue;
+        }
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (batchMode && ingestPath) {
+        printf("Use either --batch or --ingest, not both.\n");
+        return 1;
+    }
+    if (shardsWanted > 0 && !batchMode && !ingestPath) {
+        printf("--shards only applies to --batch and --ingest.\n");
+        return 1;
+    }
+    initObjectPools();
+    if (benchmarkRows > 0) {
+        benchmarkLoad(benchmarkRows);
+        return 0;
+    }
+    int batchInput = STDIN_FILENO, batchOutput = STDOUT_FILENO;
+    if (batchMode) {
+        if (!formatGiven) {
+            outputFormat = OUTPUT_CSV;
+        } else if (outputFormat == OUTPUT_TABLE) {
+            printf("Batch mode writes csv, jsonl or binary, not tables.\n");
+            return 1;
+        }
+        if (batchPath && (batchInput = open(batchPath, O_RDONLY)) < 0) {
+            printf("Error opening %s: %s\n", batchPath, strerror(errno));
+            return 1;
+        }
+        // Answers keep the real stdout; every other message moves to stderr
+        fflush(stdout);
+        batchOutput = dup(STDOUT_FILENO);
+        if (batchOutput < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            printf("Error redirecting messages to stderr: %s\n", strerror(errno));
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+    }
+    if ((batchMode || ingestPath) && unknownSellerPolicy == UNKNOWN_SELLER_PROMPT)
+        unknownSellerPolicy = UNKNOWN_SELLER_REJECT;
+    if (recoverState() != 0 ||
+        appendLogOpen(&transactionLog, WAL_FILE, syncPolicy, syncEveryRecords, syncIntervalMs) != 0 ||
+        (pendingShardSegments > 0 && retireShardSegments() != 0)) {
+        return 1;
+    }
+    if (batchMode || ingestPath) {
+        transactionLog.deferSyncs = syncPolicy == SYNC_PER_RECORD;
+        if (shardsWanted > 0) startShards(shardsWanted);
+        int status = ingestPath ? ingestFile(ingestPath) : runBatch(batchInput, batchOutput);
+        pollCheckpoint(1);
+        if (checkpointOnExit) {
+            startCheckpoint();
+            pollCheckpoint(1);
+        }
+        appendLogClose(&transactionLog);
+        stopScanPool();
+        freeTransactions();
+        return status == 0 ? 0 : 1;
+    }
     int choice;
     int running = 1;
     
     while (running) {
+        pollCheckpoint(0);
         displayMenu();
         scanf("%d", &choice);
         
@@ -1758,6 +7837,10 @@ int main() {
                 printf("\nEnter transaction details:\n");
                 printf("Transaction ID: ");
                 scanf("%d", &transactionID);
+                if (transactionID < 0) {
+                    printf("Error: Transaction ID must not be negative.\n");
+                    break;
+                }
                 if (findTransactionInBPTree(globalTransactionTree, transactionID)) {
                     printf("Error: Transaction with ID %d already exists. Cannot create duplicate transactions.\n", transactionID);
                     break;
@@ -1776,7 +7859,9 @@ int main() {
                         printf("Invalid format. Please use YYYY-MM-DD HH:MM:SS format.\n");
                     }
                 } while (!isValidDateTimeFormat(timestamp));
-                Transaction* t = createTransaction(transactionID, buyerID, sellerID, energyAmount, 0.0, timestamp);
+                long long epoch;
+                parseTimestamp(timestamp, &epoch);
+                Transaction* t = createTransaction(transactionID, buyerID, sellerID, energyAmount, 0.0, epoch);
                 insertTransaction(t);
                 break;
             }
@@ -1784,25 +7869,21 @@ int main() {
                 displayTransactionsFromTree(globalTransactionTree);
                 break;
             case 3: {
-                Seller* seller = seller_head;
-                if (!seller) {
+                if (sellerCount == 0) {
                      printf("No sellers found.\n");
                 } else {
-                    while (seller) {
-                        createSetOfTransactionsForSeller(seller->sellerID);
-                         seller = seller->next;
+                    for (int i = 0; i < sellerCount; i++) {
+                        createSetOfTransactionsForSeller(sellers[i].sellerID);
                     }
                 }
                 break;
             }
             case 4: {
-                Buyer* buyer = buyer_head;
-                if (!buyer) {
+                if (buyerCount == 0) {
                     printf("No buyers found.\n");
                 } else {
-                    while (buyer) {
-                        createSetOfTransactionsForBuyer(buyer->buyerID);
-                        buyer = buyer->next;
+                    for (int i = 0; i < buyerCount; i++) {
+                        createSetOfTransactionsForBuyer(buyers[i].buyerID);
                     }
                 }
                 break;
@@ -1847,11 +7928,42 @@ int main() {
                 break;
             }
             case 9:{
-                sortBuyersByEnergyBought();
+                printf("\n1. Full leaderboard\n");
+                printf("2. Top K buyers\n");
+                printf("3. Rank of a buyer\n");
+                printf("4. Leaderboard page\n");
+                printf("Enter option: ");
+                int leaderboardOption;
+                scanf("%d", &leaderboardOption);
+                if (leaderboardOption == 2) {
+                    int k;
+                    printf("Enter K: ");
+                    scanf("%d", &k);
+                    sortBuyersByEnergyBought(0, k > 0 ? k : 1);
+                } else if (leaderboardOption == 3) {
+                    int buyerID;
+                    printf("Enter buyer ID: ");
+                    scanf("%d", &buyerID);
+                    showBuyerRank(buyerID);
+                } else if (leaderboardOption == 4) {
+                    int page, pageSize;
+                    printf("Enter page size: ");
+                    scanf("%d", &pageSize);
+                    printf("Enter page number (from 1): ");
+                    scanf("%d", &page);
+                    if (pageSize < 1) pageSize = 1;
+                    if (page < 1) page = 1;
+                    sortBuyersByEnergyBought((page - 1) * pageSize, pageSize);
+                } else {
+                    sortBuyersByEnergyBought(0, 0);
+                }
                 break;
             }
             case 10:{
-                sortSellerBuyerPairsByTransactions();
+                int topN;
+                printf("\nShow top N pairs (0 for all): ");
+                scanf("%d", &topN);
+                sortSellerBuyerPairsByTransactions(topN);
                 break;
             }
             case 11: {
@@ -1866,6 +7978,16 @@ int main() {
                 printf("1. Verify B+ Tree Structure\n");
                 printf("2. Search for Transaction by ID\n");
                 printf("3. List all Transaction IDs in order\n");
+                printf("4. Benchmark B+ tree inserts and deletes\n");
+                printf("5. Benchmark in-node key search\n");
+                printf("6. Show allocator statistics\n");
+                printf("7. Benchmark append log sync policies\n");
+                printf("8. Checkpoint now\n");
+                printf("9. Export the data to the text files\n");
+                printf("10. Benchmark parallel scans\n");
+                printf("11. Benchmark concurrent B+ tree\n");
+                printf("12. Benchmark the ingest queue\n");
+                printf("13. Benchmark sharded ingest\n");
                 printf("Enter debug option: ");
                 int debugOption;
                 scanf("%d", &debugOption);
@@ -1874,6 +7996,11 @@ int main() {
                     case 1: {
                         int count = countTransactionsInTree(globalTransactionTree);
                         printf("Total transactions in B+ tree: %d\n", count);
+                        printf("Tree height: %d (order %d, %zu bytes per node)\n",
+                               getTreeHeight(globalTransactionTree), ORDER, sizeof(BPTreeNode));
+                        printf("Structure check (ID, time and energy trees): %s\n",
+                               checkBPTree(globalTransactionTree) && checkBPTree(timeIndexTree) &&
+                               checkBPTree(energyIndexTree) ? "ok" : "FAILED");
                         break;
                     }
                     case 2: {
@@ -1882,41 +8009,122 @@ int main() {
                         scanf("%d", &searchID);
                         Transaction* t = findTransactionById(globalTransactionTree, searchID);
                         if (t) {
+                            char timestamp[30];
+                            formatTimestamp(t->epoch, timestamp, sizeof(timestamp));
                             printf("Found Transaction ID: %d | Buyer ID: %d | Seller ID: %d | Energy: %.2f kWh | Price: %.2f/kWh | Total: %.2f | Time: %s\n",
                                     t->transactionID, t->buyerID, t->sellerID, 
                                     t->energyAmount, t->pricePerKwh, t->totalPrice, 
-                                    t->timestamp);
+                                    timestamp);
                         } else {
                             printf("Transaction with ID %d not found in the tree.\n", searchID);
                         }
                         break;
                     }
                     case 3: {
-                        BPTreeNode* cursor = globalTransactionTree;
-                        if (!cursor) {
+                        BPTreeCursor cursor;
+                        BPTreeNode* leaf = seekBPTree(globalTransactionTree, LLONG_MIN, &cursor);
+                        if (!leaf) {
                             printf("Tree is empty.\n");
                             break;
                         }
-                        while (!cursor->isLeaf) {
-                            cursor = cursor->children[0];
-                        }
                         printf("Transaction IDs in order: ");
                         int count = 0;
-                        while (cursor) {
-                            for (int i = 0; i < cursor->numKeys; i++) {
-                                printf("%d ", cursor->keys[i]);
+                        for (; leaf; leaf = nextLeafInBPTree(&cursor)) {
+                            for (int i = 0; i < leaf->numKeys; i++) {
+                                printf("%lld ", leaf->keys[i]);
                                 count++;
                             }
-                            cursor = cursor->next;
                         }
                         printf("\nTotal: %d IDs\n", count);
                         break;
                     }
+                    case 4: {
+                        int totalKeys;
+                        printf("Number of keys to insert (e.g. 10000000): ");
+                        scanf("%d", &totalKeys);
+                        benchmarkBPTreeInserts(totalKeys);
+                        break;
+                    }
+                    case 5: {
+                        int searches;
+                        printf("Number of searches (e.g. 10000000): ");
+                        scanf("%d", &searches);
+                        benchmarkNodeSearch(searches);
+                        break;
+                    }
+                    case 6:
+                        printPoolStatistics(&nodePool);
+                        printPoolStatistics(&transactionPool);
+                        break;
+                    case 7: {
+                        int records;
+                        printf("Number of records to append (e.g. 20000): ");
+                        scanf("%d", &records);
+                        benchmarkAppendLog(records);
+                        break;
+                    }
+                    case 8:
+                        pollCheckpoint(1);
+                        startCheckpoint();
+                        pollCheckpoint(1);
+                        printCheckpointStatus();
+                        break;
+                    case 9:
+                        exportTextFiles();
+                        break;
+                    case 10:
+                        benchmarkScans();
+                        break;
+                    case 11: {
+                        int operations;
+                        printf("Number of operations per run (e.g. 4000000): ");
+                        scanf("%d", &operations);
+                        benchmarkConcurrentTree(operations);
+                        break;
+                    }
+                    case 12: {
+                        int trades;
+                        printf("Number of trades per run (e.g. 1000000): ");
+                        scanf("%d", &trades);
+                        benchmarkIngestQueue(trades);
+                        break;
+                    }
+                    case 13: {
+                        int trades;
+                        printf("Number of trades per run (e.g. 1000000): ");
+                        scanf("%d", &trades);
+                        benchmarkShardedIngest(trades);
+                        break;
+                    }
                     default:
                         printf("Invalid debug option.\n");
                 }
                 break;
             }            
+            case 14: {
+                int role, entityID;
+                char startDateTime[30], endDateTime[30];
+                printf("\nTotals for (1) a seller or (2) a buyer: ");
+                scanf("%d", &role);
+                printf("Enter %s ID: ", role == 2 ? "buyer" : "seller");
+                scanf("%d", &entityID);
+                do {
+                    printf("Enter start date and time (YYYY-MM-DD HH:MM:SS): ");
+                    scanf(" %[^\n]", startDateTime);
+                    if (!isValidDateTimeFormat(startDateTime)) {
+                        printf("Invalid format. Please use YYYY-MM-DD HH:MM:SS format.\n");
+                    }
+                } while (!isValidDateTimeFormat(startDateTime));
+                do {
+                    printf("Enter end date and time (YYYY-MM-DD HH:MM:SS): ");
+                    scanf(" %[^\n]", endDateTime);
+                    if (!isValidDateTimeFormat(endDateTime)) {
+                        printf("Invalid format. Please use YYYY-MM-DD HH:MM:SS format.\n");
+                    }
+                } while (!isValidDateTimeFormat(endDateTime));
+                showRollupWindow(role == 2, entityID, startDateTime, endDateTime);
+                break;
+            }
             case 13:
                 printf("\nExiting program. Goodbye!\n");
                 running = 0;
@@ -1925,6 +8133,13 @@ int main() {
                 printf("\nInvalid choice. Please try again.\n");
         }
     }
+    pollCheckpoint(1);
+    if (checkpointOnExit) {
+        startCheckpoint();
+        pollCheckpoint(1);
+    }
+    appendLogClose(&transactionLog);
+    stopScanPool();
     freeTransactions();
     return 0;
 }
\ No newline at end of file